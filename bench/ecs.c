@@ -0,0 +1,1427 @@
+// Micro-benchmarks for the ECS. Build and run with 'make bench-ecs'.
+//
+// The regression suite runs first, every case at every size in a process of
+// its own so the peak RSS is that of the case. '--json <path>' also writes
+// its results there as an array of objects.
+#define _XOPEN_SOURCE 600
+
+#include "core.h"
+#include "ecs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+typedef struct Position Position;
+struct Position {
+    f32 x, y;
+};
+
+typedef struct Velocity Velocity;
+struct Velocity {
+    f32 x, y;
+};
+
+typedef struct Rotation Rotation;
+struct Rotation {
+    f32 angle, speed;
+};
+
+typedef struct Scale Scale;
+struct Scale {
+    f32 x, y;
+};
+
+typedef struct Target Target;
+struct Target {
+    Entity entity;
+};
+
+ecs_declare_component(Position);
+ecs_declare_component(Velocity);
+ecs_declare_component(Rotation);
+ecs_declare_component(Scale);
+ecs_declare_component(Target);
+
+static f64 now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, u32 count, f64 seconds) {
+    printf("%-28s %8u ops %10.3f ms %8.2f ns/op\n",
+            name, count, seconds*1e3, seconds*1e9/count);
+}
+
+// xorshift32, keeps the access pattern identical between runs.
+static u32 random_u32(u32 *state) {
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void move_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    u64 *checksum = user_ptr;
+
+    Position *pos = ecs_query_iter_get_field(iter, 0);
+    Velocity *vel = ecs_query_iter_get_field(iter, 1);
+    for (size_t i = 0; i < iter.count; i++) {
+        pos[i].x += vel[i].x;
+        pos[i].y += vel[i].y;
+        *checksum += iter.entities[i];
+    }
+}
+
+static void kill_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) user_ptr;
+    for (size_t i = 0; i < iter.count; i++) {
+        ecs_entity_kill(ecs, iter.entities[i]);
+    }
+}
+
+// Spawns 'count' entities, iterates them while reading their entity ids and
+// kills every one of them from inside a system.
+static void bench_spawn_kill_iterate(u32 count) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+    QueryDesc desc = {
+        .fields = {
+            ecs_id(ecs, Position),
+            ecs_id(ecs, Velocity),
+            QUERY_FIELDS_END,
+        },
+    };
+
+    f64 start = now();
+    for (u32 i = 0; i < count; i++) {
+        Entity ent = ecs_entity(ecs);
+        entity_add_component(ecs, ent, Position, {.x = i});
+        entity_add_component(ecs, ent, Velocity, {.x = 1.0f, .y = 1.0f});
+    }
+    report("spawn", count, now() - start);
+
+    u64 checksum = 0;
+    desc.user_ptr = &checksum;
+    start = now();
+    ecs_run_system(ecs, move_system, desc);
+    report("iterate", count, now() - start);
+
+    start = now();
+    ecs_run_system(ecs, kill_system, desc);
+    report("kill (deferred)", count, now() - start);
+
+    if (checksum == 0) {
+        printf("unexpected checksum\n");
+    }
+
+    ecs_free(ecs);
+}
+
+// Random access through the name based API compared to the cached component
+// handles used by the 'entity_get_component()' macro.
+static void bench_get_component(u32 entity_count, u32 lookup_count) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+
+    Entity *entities = malloc(sizeof(Entity)*entity_count);
+    for (u32 i = 0; i < entity_count; i++) {
+        entities[i] = ecs_entity(ecs);
+        entity_add_component(ecs, entities[i], Position, {.x = i});
+        entity_add_component(ecs, entities[i], Velocity, {.y = i});
+    }
+
+    f32 sum = 0.0f;
+    u32 rng = 0x9e3779b9;
+    f64 start = now();
+    for (u32 i = 0; i < lookup_count; i++) {
+        Entity ent = entities[random_u32(&rng) % entity_count];
+        Position *pos = _entity_get_component(ecs, ent, str_lit("Position"));
+        sum += pos->x;
+    }
+    report("get_component (name)", lookup_count, now() - start);
+
+    rng = 0x9e3779b9;
+    start = now();
+    for (u32 i = 0; i < lookup_count; i++) {
+        Entity ent = entities[random_u32(&rng) % entity_count];
+        Position *pos = entity_get_component(ecs, ent, Position);
+        sum += pos->x;
+    }
+    report("get_component (handle)", lookup_count, now() - start);
+
+    if (sum == 0.0f) {
+        printf("unexpected sum\n");
+    }
+
+    free(entities);
+    ecs_free(ecs);
+}
+
+static void spawn_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) iter;
+    u32 count = *(u32 *) user_ptr;
+    for (u32 i = 0; i < count; i++) {
+        Entity ent = ecs_entity(ecs);
+        entity_add_component(ecs, ent, Position, {.x = i});
+        entity_add_component(ecs, ent, Velocity, {.x = 1.0f, .y = 1.0f});
+    }
+}
+
+static void spawn_batch_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) iter;
+    u32 count = *(u32 *) user_ptr;
+    Position *positions = malloc(sizeof(Position)*count);
+    for (u32 i = 0; i < count; i++) {
+        positions[i] = (Position) {.x = i};
+    }
+    ecs_spawn_batch(ecs, count, NULL,
+            component_column(Position, positions),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}));
+    free(positions);
+}
+
+// Spawns the same entities as 'bench_spawn_kill_iterate()' from inside a
+// system, one at a time and in one batch, followed by a direct batch.
+static void bench_spawn_batch(u32 count) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+    ecs_register_component(ecs, Rotation);
+
+    Position *positions = malloc(sizeof(Position)*count);
+    for (u32 i = 0; i < count; i++) {
+        positions[i] = (Position) {.x = i};
+    }
+
+    // A single entity to run the spawning systems once. It's the only one with
+    // a 'Rotation' so the spawned entities never match the query.
+    ecs_spawn_batch(ecs, 1, NULL, component_fill(Rotation, {0}));
+    QueryDesc desc = {
+        .fields = {
+            ecs_id(ecs, Rotation),
+            QUERY_FIELDS_END,
+        },
+        .user_ptr = &count,
+    };
+    f64 start = now();
+    ecs_run_system(ecs, spawn_system, desc);
+    report("spawn (deferred)", count, now() - start);
+
+    start = now();
+    ecs_run_system(ecs, spawn_batch_system, desc);
+    report("spawn_batch (deferred)", count, now() - start);
+
+    start = now();
+    ecs_spawn_batch(ecs, count, NULL,
+            component_column(Position, positions),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}));
+    report("spawn_batch", count, now() - start);
+
+    free(positions);
+    ecs_free(ecs);
+}
+
+// Heavier per-entity work than 'move_system()' so that the cost of the systems
+// outweighs the cost of scheduling them.
+static void orbit_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    (void) user_ptr;
+
+    Position *pos = ecs_query_iter_get_field(iter, 0);
+    const Velocity *vel = ecs_query_iter_get_field(iter, 1);
+    for (size_t i = 0; i < iter.count; i++) {
+        for (u32 j = 0; j < 16; j++) {
+            pos[i].x = pos[i].x*0.99f + vel[i].x;
+            pos[i].y = pos[i].y*0.99f + vel[i].y;
+        }
+    }
+}
+
+static void spin_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    (void) user_ptr;
+
+    Rotation *rot = ecs_query_iter_get_field(iter, 0);
+    for (size_t i = 0; i < iter.count; i++) {
+        for (u32 j = 0; j < 16; j++) {
+            rot[i].angle = rot[i].angle*0.99f + rot[i].speed;
+        }
+    }
+}
+
+// Two systems without conflicting access, run serially and on the worker
+// pool.
+static void bench_run_group(u32 count, u32 frames) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+    ecs_register_component(ecs, Rotation);
+
+    ecs_spawn_batch(ecs, count, NULL,
+            component_fill(Position, {0}),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}));
+    ecs_spawn_batch(ecs, count, NULL,
+            component_fill(Rotation, {.speed = 1.0f}));
+
+    SystemGroup group = ecs_system_group(ecs);
+    ecs_register_system(ecs, orbit_system, group, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Position),
+                ecs_id(ecs, Velocity),
+                QUERY_FIELDS_END,
+            },
+            .access = {
+                [1] = QUERY_ACCESS_READ,
+            },
+        });
+    ecs_register_system(ecs, spin_system, group, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Rotation),
+                QUERY_FIELDS_END,
+            },
+        });
+
+    ecs_set_worker_count(ecs, 0);
+    f64 start = now();
+    for (u32 i = 0; i < frames; i++) {
+        ecs_run_group(ecs, group);
+    }
+    report("run_group (serial)", count*frames, now() - start);
+
+    // One worker is enough for two systems.
+    ecs_set_worker_count(ecs, 1);
+    start = now();
+    for (u32 i = 0; i < frames; i++) {
+        ecs_run_group(ecs, group);
+    }
+    report("run_group (parallel)", count*frames, now() - start);
+
+    // A single system split into ranges.
+    SystemGroup parallel_for = ecs_system_group(ecs);
+    ecs_register_system(ecs, orbit_system, parallel_for, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Position),
+                ecs_id(ecs, Velocity),
+                QUERY_FIELDS_END,
+            },
+            .access = {
+                [1] = QUERY_ACCESS_READ,
+            },
+            .parallel = true,
+            .grain_size = 4096,
+        });
+    start = now();
+    for (u32 i = 0; i < frames; i++) {
+        ecs_run_group(ecs, parallel_for);
+    }
+    report("run_group (parallel-for)", count*frames, now() - start);
+
+    ecs_free(ecs);
+}
+
+static void sum_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    f32 *sum = user_ptr;
+
+    const Position *pos = ecs_query_iter_get_field(iter, 0);
+    for (size_t i = 0; i < iter.count; i++) {
+        *sum += pos[i].x;
+    }
+}
+
+// Reads every position each frame, and only the chunks where one of 'changes'
+// random entities had its position written since the previous frame.
+static void bench_changed(u32 count, u32 changes, u32 frames) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+
+    Entity *entities = malloc(sizeof(Entity)*count);
+    ecs_spawn_batch(ecs, count, entities, component_fill(Position, {0}));
+
+    f32 sum = 0.0f;
+    SystemGroup all = ecs_system_group(ecs);
+    ecs_register_system(ecs, sum_system, all, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Position),
+                QUERY_FIELDS_END,
+            },
+            .access = {
+                QUERY_ACCESS_READ,
+            },
+            .user_ptr = &sum,
+        });
+    SystemGroup changed = ecs_system_group(ecs);
+    ecs_register_system(ecs, sum_system, changed, (QueryDesc) {
+            .fields = {
+                Changed(ecs_id(ecs, Position)),
+                QUERY_FIELDS_END,
+            },
+            .access = {
+                QUERY_ACCESS_READ,
+            },
+            .user_ptr = &sum,
+        });
+
+    u32 rng = 0x9e3779b9;
+    ecs_run_group(ecs, changed);
+    f64 start = now();
+    for (u32 i = 0; i < frames; i++) {
+        for (u32 j = 0; j < changes; j++) {
+            Position *pos = entity_get_component(ecs, entities[random_u32(&rng) % count], Position);
+            pos->x += 1.0f;
+        }
+        ecs_run_group(ecs, all);
+    }
+    report("iterate (all)", count*frames, now() - start);
+
+    start = now();
+    for (u32 i = 0; i < frames; i++) {
+        for (u32 j = 0; j < changes; j++) {
+            Position *pos = entity_get_component(ecs, entities[random_u32(&rng) % count], Position);
+            pos->x += 1.0f;
+        }
+        ecs_run_group(ecs, changed);
+    }
+    report("iterate (changed)", count*frames, now() - start);
+
+    if (sum == 0.0f) {
+        printf("unexpected sum\n");
+    }
+
+    free(entities);
+    ecs_free(ecs);
+}
+
+// Iterates positions of which every entity in one out of 'stride' is
+// enabled, the rest disabled in place. Reported per entity of the world.
+static void bench_enabled(u32 count, u32 stride, u32 frames) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+
+    Entity *entities = malloc(sizeof(Entity)*count);
+    ecs_spawn_batch(ecs, count, entities, component_fill(Position, {1.0f, 0.0f}));
+
+    f64 start = now();
+    for (u32 i = 0; i < count; i++) {
+        ecs_entity_set_enabled(ecs, entities[i], i % stride == 0);
+    }
+    report("set enabled", count, now() - start);
+
+    f32 sum = 0.0f;
+    QueryCache *cache = ecs_query_cache_new(ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Position),
+                QUERY_FIELDS_END,
+            },
+            .access = {
+                QUERY_ACCESS_READ,
+            },
+        });
+    start = now();
+    for (u32 i = 0; i < frames; i++) {
+        Query query = ecs_query_cached(ecs, cache);
+        for (size_t j = 0; j < query.count; j++) {
+            sum_system(ecs, ecs_query_get_iter(query, j), &sum);
+        }
+        ecs_query_free(ecs, query);
+    }
+    report("iterate (enabled)", count*frames, now() - start);
+
+    if (sum != (f32) ((count + stride - 1)/stride)*frames) {
+        printf("unexpected sum\n");
+    }
+
+    free(entities);
+    ecs_free(ecs);
+}
+
+#define WIDE_COMPONENT_COUNT 128
+
+// Entities made up of three out of 'WIDE_COMPONENT_COUNT' components, one per
+// combination, so every entity gets an archetype of its own. Components are
+// added one at a time, the archetypes of the first one or two components of a
+// combination are shared.
+static void bench_archetypes(u32 archetype_count, u32 query_count) {
+    ECS *ecs = ecs_new();
+
+    static char names[WIDE_COMPONENT_COUNT][16];
+    ComponentId ids[WIDE_COMPONENT_COUNT];
+    for (u32 i = 0; i < WIDE_COMPONENT_COUNT; i++) {
+        snprintf(names[i], sizeof(names[i]), "Wide%u", i);
+        ids[i] = _ecs_register_component(ecs, (Str) {(const u8 *) names[i], strlen(names[i])}, sizeof(f32), COMPONENT_STORAGE_TABLE);
+    }
+
+    Entity *entities = malloc(sizeof(Entity)*archetype_count);
+    u32 (*combinations)[3] = malloc(sizeof(u32[3])*archetype_count);
+    u32 n = 0;
+    for (u32 a = 0; a < WIDE_COMPONENT_COUNT && n < archetype_count; a++) {
+        for (u32 b = a + 1; b < WIDE_COMPONENT_COUNT && n < archetype_count; b++) {
+            for (u32 c = b + 1; c < WIDE_COMPONENT_COUNT && n < archetype_count; c++) {
+                combinations[n][0] = a;
+                combinations[n][1] = b;
+                combinations[n][2] = c;
+                n++;
+            }
+        }
+    }
+
+    f32 value = 1.0f;
+    f64 start = now();
+    for (u32 i = 0; i < archetype_count; i++) {
+        entities[i] = ecs_entity(ecs);
+        for (u32 j = 0; j < 3; j++) {
+            entity_add_component_id(ecs, entities[i], ids[combinations[i][j]], &value);
+        }
+    }
+    report("archetype create", archetype_count*3, now() - start);
+
+    // Every transition follows an edge cached by the pass above.
+    start = now();
+    for (u32 i = 0; i < archetype_count; i++) {
+        entity_remove_component_id(ecs, entities[i], ids[combinations[i][2]]);
+        entity_add_component_id(ecs, entities[i], ids[combinations[i][2]], &value);
+    }
+    report("archetype move (edge)", archetype_count*2, now() - start);
+
+    // Reported per archetype of the world, not per matching one.
+    QueryDesc desc = {
+        .fields = {
+            ids[1],
+            ids[WIDE_COMPONENT_COUNT - 1],
+            Without(ids[2]),
+            QUERY_FIELDS_END,
+        },
+    };
+    size_t matched = 0;
+    start = now();
+    for (u32 i = 0; i < query_count; i++) {
+        Query query = ecs_query(ecs, desc);
+        matched += query.count;
+        ecs_query_free(ecs, query);
+    }
+    report("query match", archetype_count*query_count, now() - start);
+
+    if (matched == 0) {
+        printf("unexpected match count\n");
+    }
+
+    // Leaves a tenth of the archetypes populated, the intermediate ones of
+    // the first two components included.
+    for (u32 i = archetype_count/10; i < archetype_count; i++) {
+        ecs_entity_kill(ecs, entities[i]);
+    }
+    start = now();
+    size_t released = ecs_compact(ecs);
+    report("compact", archetype_count, now() - start);
+    printf("%-28s %8zu bytes\n", "compact released", released);
+
+    start = now();
+    for (u32 i = 0; i < query_count; i++) {
+        Query query = ecs_query(ecs, desc);
+        ecs_query_free(ecs, query);
+    }
+    report("query match (compacted)", archetype_count*query_count, now() - start);
+
+    free(combinations);
+    free(entities);
+    ecs_free(ecs);
+}
+
+#define CHURN_COMPONENT_COUNT 16
+
+// Adds and removes a component on entities carrying 'CHURN_COMPONENT_COUNT'
+// others, stored in the archetype and then in a sparse set.
+static void bench_churn(u32 count, u32 rounds) {
+    ECS *ecs = ecs_new();
+
+    static char names[CHURN_COMPONENT_COUNT][16];
+    ComponentColumn columns[CHURN_COMPONENT_COUNT];
+    Mat4 value = {0};
+    for (u32 i = 0; i < CHURN_COMPONENT_COUNT; i++) {
+        snprintf(names[i], sizeof(names[i]), "Churn%u", i);
+        columns[i] = (ComponentColumn) {
+            .id = _ecs_register_component(ecs, (Str) {(const u8 *) names[i], strlen(names[i])}, sizeof(Mat4), COMPONENT_STORAGE_TABLE),
+            .data = &value,
+            .fill = true,
+        };
+    }
+    ComponentId toggles[] = {
+        _ecs_register_component(ecs, str_lit("TableToggle"), sizeof(Rotation), COMPONENT_STORAGE_TABLE),
+        _ecs_register_component(ecs, str_lit("SparseToggle"), sizeof(Rotation), COMPONENT_STORAGE_SPARSE),
+    };
+    const char *labels[] = {"toggle (table)", "toggle (sparse)"};
+
+    Entity *entities = malloc(sizeof(Entity)*count);
+    ecs_spawn_batch_id(ecs, count, entities, columns, CHURN_COMPONENT_COUNT);
+
+    Rotation rotation = {0};
+    for (u32 i = 0; i < 2; i++) {
+        f64 start = now();
+        for (u32 j = 0; j < rounds; j++) {
+            for (u32 k = 0; k < count; k++) {
+                entity_add_component_id(ecs, entities[k], toggles[i], &rotation);
+            }
+            for (u32 k = 0; k < count; k++) {
+                entity_remove_component_id(ecs, entities[k], toggles[i]);
+            }
+        }
+        report(labels[i], count*rounds*2, now() - start);
+    }
+
+    free(entities);
+    ecs_free(ecs);
+}
+
+// Spawns waves of 'wave_size' entities, built component by component and
+// instantiated from a prefab.
+static void bench_instantiate(u32 wave_size, u32 waves) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+    ecs_register_component(ecs, Rotation);
+
+    Entity prefab = ecs_prefab(ecs);
+    entity_add_components(ecs, prefab,
+            component_data(Position, {0}),
+            component_data(Velocity, {1.0f, 1.0f}),
+            component_data(Rotation, {0.0f, 1.0f}));
+
+    Entity *entities = malloc(sizeof(Entity)*wave_size);
+    f64 start = now();
+    for (u32 i = 0; i < waves; i++) {
+        for (u32 j = 0; j < wave_size; j++) {
+            entities[j] = ecs_entity(ecs);
+            entity_add_components(ecs, entities[j],
+                    component_data(Position, {0}),
+                    component_data(Velocity, {1.0f, 1.0f}),
+                    component_data(Rotation, {0.0f, 1.0f}));
+        }
+        for (u32 j = 0; j < wave_size; j++) {
+            ecs_entity_kill(ecs, entities[j]);
+        }
+    }
+    report("wave (by hand)", wave_size*waves, now() - start);
+
+    start = now();
+    for (u32 i = 0; i < waves; i++) {
+        ecs_instantiate(ecs, prefab, wave_size, entities);
+        for (u32 j = 0; j < wave_size; j++) {
+            ecs_entity_kill(ecs, entities[j]);
+        }
+    }
+    report("wave (instantiate)", wave_size*waves, now() - start);
+
+    free(entities);
+    ecs_free(ecs);
+}
+
+static void register_components(ECS *ecs) {
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+    ecs_register_component(ecs, Rotation);
+    ecs_register_component(ecs, Scale);
+}
+
+// Writes a world of 'count' entities spread over two archetypes to a file
+// and reads it back into an empty world.
+static void bench_snapshot(u32 count) {
+    const char *path = "bench-ecs.snapshot";
+    ECS *ecs = ecs_new();
+    register_components(ecs);
+
+    Position *positions = malloc(sizeof(Position)*count);
+    for (u32 i = 0; i < count; i++) {
+        positions[i] = (Position) {.x = i};
+    }
+    ecs_spawn_batch(ecs, count/2, NULL,
+            component_column(Position, positions),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}));
+    ecs_spawn_batch(ecs, count - count/2, NULL,
+            component_column(Position, positions),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}),
+            component_fill(Rotation, {0.0f, 1.0f}));
+
+    f64 start = now();
+    b8 ok = ecs_snapshot_write(ecs, path);
+    report("snapshot write", count, now() - start);
+    ecs_free(ecs);
+
+    ecs = ecs_new();
+    register_components(ecs);
+    start = now();
+    ok &= ecs_snapshot_read(ecs, path);
+    report("snapshot read", count, now() - start);
+    if (!ok) {
+        printf("snapshot failed\n");
+    }
+
+    remove(path);
+    free(positions);
+    ecs_free(ecs);
+}
+
+static void drift_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    (void) user_ptr;
+    Position *pos = ecs_query_iter_get_field(iter, 0);
+    for (size_t i = 0; i < iter.count; i++) {
+        pos[i].x += 1.0f;
+    }
+}
+
+// Saves the state of 'count' entities every frame into a ring of 8, with
+// nothing, the entities of one archetype, or every entity having moved since
+// the previous save. Reported per frame.
+static void bench_rollback(u32 count, u32 frames) {
+    ECS *ecs = ecs_new();
+    ecs_register_component(ecs, Position);
+    ecs_register_component(ecs, Velocity);
+    ecs_register_component(ecs, Rotation);
+    ecs_set_rollback_frames(ecs, 8);
+
+    // A tenth of the entities move unless every one of them is made to.
+    ecs_spawn_batch(ecs, count/10, NULL,
+            component_fill(Position, {0}),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}));
+    ecs_spawn_batch(ecs, count - count/10, NULL,
+            component_fill(Position, {0}),
+            component_fill(Rotation, {0.0f, 1.0f}));
+
+    u64 checksum = 0;
+    QueryDesc move = {
+        .fields = {
+            ecs_id(ecs, Position),
+            ecs_id(ecs, Velocity),
+            QUERY_FIELDS_END,
+        },
+        .user_ptr = &checksum,
+    };
+    ecs_rollback_save(ecs);
+
+    f64 start = now();
+    for (u32 i = 0; i < frames; i++) {
+        ecs_rollback_save(ecs);
+    }
+    report("rollback save (idle)", frames, now() - start);
+
+    f64 elapsed = 0.0;
+    for (u32 i = 0; i < frames; i++) {
+        ecs_run_system(ecs, move_system, move);
+        start = now();
+        ecs_rollback_save(ecs);
+        elapsed += now() - start;
+    }
+    report("rollback save (10% moved)", frames, elapsed);
+
+    QueryDesc move_all = move;
+    move_all.fields[1] = QUERY_FIELDS_END;
+    elapsed = 0.0;
+    for (u32 i = 0; i < frames; i++) {
+        ecs_run_system(ecs, drift_system, move_all);
+        start = now();
+        ecs_rollback_save(ecs);
+        elapsed += now() - start;
+    }
+    report("rollback save (all moved)", frames, elapsed);
+
+    elapsed = 0.0;
+    for (u32 i = 0; i < frames; i++) {
+        ecs_run_system(ecs, drift_system, move_all);
+        ecs_rollback_save(ecs);
+        start = now();
+        ecs_rollback(ecs, 1);
+        elapsed += now() - start;
+    }
+    report("rollback restore", frames, elapsed);
+
+    ecs_free(ecs);
+}
+
+static void spawn_moving(ECS *ecs, u32 count) {
+    for (u32 i = 0; i < count; i++) {
+        Entity entity = ecs_entity(ecs);
+        entity_add_component(ecs, entity, Position, {0});
+        entity_add_component(ecs, entity, Velocity, {.x = 1.0f});
+        entity_add_component(ecs, entity, Rotation, {0.0f, 1.0f});
+    }
+}
+
+// Spawns 'count' entities one component at a time straight into a live
+// world, versus building them in a staging world and merging it.
+static void bench_merge(u32 count) {
+    ECS *live = ecs_new();
+    register_components(live);
+    f64 start = now();
+    spawn_moving(live, count);
+    report("spawn (live)", count, now() - start);
+    ecs_free(live);
+
+    live = ecs_new();
+    register_components(live);
+    ECS *staging = ecs_new_staging();
+    register_components(staging);
+    start = now();
+    spawn_moving(staging, count);
+    report("spawn (staging)", count, now() - start);
+
+    start = now();
+    b8 ok = ecs_merge(live, staging);
+    report("merge", count, now() - start);
+    if (!ok) {
+        printf("merge failed\n");
+    }
+
+    ecs_free(staging);
+    ecs_free(live);
+}
+
+// -- Checks -------------------------------------------------------------------
+// Cases that once went wrong, run before the benchmarks.
+
+static u32 check_failures;
+
+static void check(const char *name, b8 ok) {
+    if (!ok) {
+        printf("check failed: %s\n", name);
+        check_failures++;
+    }
+}
+
+static size_t count_entities(ECS *ecs, ComponentId component) {
+    Query query = ecs_query(ecs, (QueryDesc) {
+            .fields = {
+                component,
+                QUERY_FIELDS_END,
+            },
+        });
+    size_t count = 0;
+    for (size_t i = 0; i < query.count; i++) {
+        count += ecs_query_get_iter(query, i).count;
+    }
+    ecs_query_free(ecs, query);
+    return count;
+}
+
+static void add_velocity_observer(ECS *ecs, ObserverIter iter, void *user_ptr) {
+    (void) user_ptr;
+    for (size_t i = 0; i < iter.count; i++) {
+        entity_add_component(ecs, iter.entities[i], Velocity, {0});
+    }
+}
+
+// An observer records a change on an entity dying in the same playback.
+static void check_kill_observer(void) {
+    ECS *ecs = ecs_new();
+    register_components(ecs);
+    ecs_register_observer(ecs, add_velocity_observer, OBSERVER_ON_REMOVE, ecs_id(ecs, Position), NULL);
+
+    Entity ent = ecs_entity(ecs);
+    entity_add_component(ecs, ent, Position, {0});
+    ecs_entity_kill(ecs, ent);
+    check("kill with observer", !entity_alive(ecs, ent) && count_entities(ecs, ecs_id(ecs, Velocity)) == 0);
+
+    // The index is reused by the next entity.
+    Entity other = ecs_entity(ecs);
+    entity_add_component(ecs, other, Velocity, {0});
+    check("kill with observer (reused)", count_entities(ecs, ecs_id(ecs, Velocity)) == 1);
+
+    ecs_free(ecs);
+}
+
+static void target_remap(ECS *ecs, const EntityRemap *remap, void *components, size_t count) {
+    (void) ecs;
+    Target *targets = components;
+    for (size_t i = 0; i < count; i++) {
+        targets[i].entity = entity_remap(remap, targets[i].entity);
+    }
+}
+
+// Staged entities referring to a live entity and to a staged one with the
+// same index.
+static void check_merge_reference(void) {
+    ECS *live = ecs_new();
+    register_components(live);
+    ecs_register_component(live, Target);
+    ecs_register_remap_hook(live, Target, target_remap);
+    Entity player = ecs_entity(live);
+
+    ECS *staging = ecs_new_staging();
+    register_components(staging);
+    ecs_register_component(staging, Target);
+    Entity first = ecs_entity(staging);
+    entity_add_component(staging, first, Position, {0});
+    Entity to_live = ecs_entity(staging);
+    entity_add_component(staging, to_live, Target, {player});
+    Entity to_staged = ecs_entity(staging);
+    entity_add_components(staging, to_staged,
+            component_data(Position, {0}),
+            component_data(Target, {first}));
+
+    b8 ok = ecs_merge(live, staging);
+    size_t live_refs = 0;
+    size_t staged_refs = 0;
+    Query query = ecs_query(live, (QueryDesc) {
+            .fields = {
+                ecs_id(live, Target),
+                QUERY_FIELDS_END,
+            },
+        });
+    for (size_t i = 0; i < query.count; i++) {
+        QueryIter iter = ecs_query_get_iter(query, i);
+        const Target *targets = ecs_query_iter_get_field(iter, 0);
+        for (size_t j = 0; j < iter.count; j++) {
+            if (targets[j].entity == player) {
+                live_refs++;
+            } else if (entity_alive(live, targets[j].entity) &&
+                    entity_has_component(live, targets[j].entity, Position)) {
+                staged_refs++;
+            }
+        }
+    }
+    ecs_query_free(live, query);
+    check("merge reference", ok && live_refs == 1 && staged_refs == 1);
+
+    ecs_free(staging);
+    ecs_free(live);
+}
+
+typedef struct PrefabCheck PrefabCheck;
+struct PrefabCheck {
+    Entity prefab;
+    Entity instances[3];
+};
+
+static void instantiate_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) iter;
+    PrefabCheck *state = user_ptr;
+    if (state->prefab == 0) {
+        state->prefab = ecs_prefab(ecs);
+        entity_add_component(ecs, state->prefab, Position, {42.0f, 0.0f});
+    } else {
+        entity_add_component(ecs, state->prefab, Velocity, {1.0f, 0.0f});
+    }
+    ecs_instantiate(ecs, state->prefab, 3, state->instances);
+}
+
+static b8 instances_match(ECS *ecs, const PrefabCheck *state, b8 velocity) {
+    for (u32 i = 0; i < 3; i++) {
+        const Position *pos = entity_read_component(ecs, state->instances[i], Position);
+        if (pos == NULL || pos->x != 42.0f ||
+                entity_has_component(ecs, state->instances[i], Velocity) != velocity) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Instantiating from inside a system a prefab made, or changed, by the same
+// system.
+static void check_deferred_instantiate(void) {
+    ECS *ecs = ecs_new();
+    register_components(ecs);
+    ecs_spawn_batch(ecs, 1, NULL, component_fill(Rotation, {0}));
+
+    // Entity 0 is the one above, never a prefab.
+    PrefabCheck state = {0};
+    QueryDesc desc = {
+        .fields = {
+            ecs_id(ecs, Rotation),
+            QUERY_FIELDS_END,
+        },
+        .user_ptr = &state,
+    };
+    ecs_run_system(ecs, instantiate_system, desc);
+    check("instantiate new prefab", instances_match(ecs, &state, false));
+    ecs_run_system(ecs, instantiate_system, desc);
+    check("instantiate changed prefab", instances_match(ecs, &state, true));
+
+    ecs_free(ecs);
+}
+
+// A frame only reading components, like rendering, leaves nothing for the
+// next rollback save to copy.
+static void check_rollback_read_only(void) {
+    ECS *ecs = ecs_new();
+    register_components(ecs);
+    Entity first = ecs_entity(ecs);
+    entity_add_components(ecs, first,
+            component_data(Position, {0}),
+            component_data(Velocity, {1.0f, 0.0f}));
+    ecs_spawn_batch(ecs, 10000, NULL,
+            component_fill(Position, {0}),
+            component_fill(Velocity, {1.0f, 0.0f}));
+    ecs_set_rollback_frames(ecs, 2);
+    ecs_rollback_save(ecs);
+
+    f32 sum = 0.0f;
+    Query query = ecs_query(ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Position),
+                ecs_id(ecs, Velocity),
+                QUERY_FIELDS_END,
+            },
+            .access = {[0] = QUERY_ACCESS_READ, [1] = QUERY_ACCESS_READ},
+        });
+    for (size_t i = 0; i < query.count; i++) {
+        QueryIter iter = ecs_query_get_iter(query, i);
+        const Position *pos = ecs_query_iter_get_field(iter, 0);
+        const Velocity *vel = ecs_query_iter_get_field(iter, 1);
+        for (size_t j = 0; j < iter.count; j++) {
+            sum += pos[j].x + vel[j].x;
+        }
+    }
+    ecs_query_free(ecs, query);
+    const Position *pos = entity_read_component(ecs, first, Position);
+    sum += pos->x;
+    ecs_rollback_save(ecs);
+    check("rollback after read only frame", sum > 0.0f && ecs_stats(ecs).rollback_copied_chunks == 0);
+
+    entity_get_component(ecs, first, Position);
+    ecs_rollback_save(ecs);
+    check("rollback after write", ecs_stats(ecs).rollback_copied_chunks == 1);
+
+    ecs_free(ecs);
+}
+
+static void run_checks(void) {
+    check_kill_observer();
+    check_merge_reference();
+    check_deferred_instantiate();
+    check_rollback_read_only();
+}
+
+// -- Regression suite ---------------------------------------------------------
+
+#define SUITE_OPS 1000000
+#define SUITE_FRAGMENT_COUNT 10
+#define SUITE_ARCHETYPE_COUNT 1000
+
+typedef struct SuiteResult SuiteResult;
+struct SuiteResult {
+    u64 ops;
+    f64 seconds;
+};
+
+// Runs the case on a world of 'count' entities and returns the world for
+// its memory to be measured.
+typedef ECS *(*SuiteCase)(u32 count, SuiteResult *result);
+
+// Repeats the smaller sizes so every case times about 'SUITE_OPS' operations.
+static u32 suite_rounds(u32 count) {
+    return count >= SUITE_OPS ? 1 : SUITE_OPS/count;
+}
+
+// Bytes in use on the heap, 0 where the C library doesn't tell.
+static size_t heap_used(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+    struct mallinfo info = mallinfo();
+    return (size_t) (u32) info.uordblks + (size_t) (u32) info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static size_t peak_rss(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return (size_t) usage.ru_maxrss*1024;
+#endif
+}
+
+static ECS *suite_world(void) {
+    ECS *ecs = ecs_new();
+    register_components(ecs);
+    return ecs;
+}
+
+static ECS *case_spawn_kill(u32 count, SuiteResult *result) {
+    ECS *ecs = suite_world();
+    Entity *entities = malloc(sizeof(Entity)*count);
+    u32 rounds = suite_rounds(count);
+
+    f64 start = now();
+    for (u32 i = 0; i < rounds; i++) {
+        for (u32 j = 0; j < count; j++) {
+            entities[j] = ecs_entity(ecs);
+            entity_add_component(ecs, entities[j], Position, {.x = j});
+            entity_add_component(ecs, entities[j], Velocity, {.x = 1.0f});
+        }
+        for (u32 j = 0; j < count; j++) {
+            ecs_entity_kill(ecs, entities[j]);
+        }
+    }
+    result->seconds = now() - start;
+    result->ops = (u64) count*rounds;
+
+    free(entities);
+    return ecs;
+}
+
+static ECS *case_add_remove(u32 count, SuiteResult *result) {
+    ECS *ecs = suite_world();
+    Entity *entities = malloc(sizeof(Entity)*count);
+    ecs_spawn_batch(ecs, count, entities,
+            component_fill(Position, {0}),
+            component_fill(Velocity, {.x = 1.0f}));
+    u32 rounds = suite_rounds(count);
+
+    f64 start = now();
+    for (u32 i = 0; i < rounds; i++) {
+        for (u32 j = 0; j < count; j++) {
+            entity_add_component(ecs, entities[j], Rotation, {0.0f, 1.0f});
+        }
+        for (u32 j = 0; j < count; j++) {
+            entity_remove_component(ecs, entities[j], Rotation);
+        }
+    }
+    result->seconds = now() - start;
+    result->ops = (u64) count*rounds*2;
+
+    free(entities);
+    return ecs;
+}
+
+static ECS *case_get_component(u32 count, SuiteResult *result) {
+    ECS *ecs = suite_world();
+    Entity *entities = malloc(sizeof(Entity)*count);
+    ecs_spawn_batch(ecs, count, entities,
+            component_fill(Position, {1.0f, 0.0f}),
+            component_fill(Velocity, {0}));
+    u32 lookups = suite_rounds(count)*count;
+
+    f32 sum = 0.0f;
+    u32 rng = 0x9e3779b9;
+    f64 start = now();
+    for (u32 i = 0; i < lookups; i++) {
+        Position *pos = entity_get_component(ecs, entities[random_u32(&rng) % count], Position);
+        sum += pos->x;
+    }
+    result->seconds = now() - start;
+    result->ops = lookups;
+    if (sum == 0.0f) {
+        printf("unexpected sum\n");
+    }
+
+    free(entities);
+    return ecs;
+}
+
+static void iterate2_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    (void) user_ptr;
+    Position *pos = ecs_query_iter_get_field(iter, 0);
+    const Velocity *vel = ecs_query_iter_get_field(iter, 1);
+    for (size_t i = 0; i < iter.count; i++) {
+        pos[i].x += vel[i].x;
+        pos[i].y += vel[i].y;
+    }
+}
+
+static void iterate4_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) ecs;
+    (void) user_ptr;
+    Position *pos = ecs_query_iter_get_field(iter, 0);
+    const Velocity *vel = ecs_query_iter_get_field(iter, 1);
+    Rotation *rot = ecs_query_iter_get_field(iter, 2);
+    const Scale *scale = ecs_query_iter_get_field(iter, 3);
+    for (size_t i = 0; i < iter.count; i++) {
+        pos[i].x += vel[i].x*scale[i].x;
+        pos[i].y += vel[i].y*scale[i].y;
+        rot[i].angle += rot[i].speed;
+    }
+}
+
+// Iterates the first 'fields' of Position, Velocity, Rotation and Scale
+// through a cached query, leaving scheduling out of the measure.
+static ECS *suite_iterate(u32 count, u32 fields, SuiteResult *result) {
+    ECS *ecs = suite_world();
+    ecs_spawn_batch(ecs, count, NULL,
+            component_fill(Position, {0}),
+            component_fill(Velocity, {.x = 1.0f, .y = 1.0f}),
+            component_fill(Rotation, {0.0f, 1.0f}),
+            component_fill(Scale, {1.0f, 1.0f}));
+
+    QueryDesc desc = {
+        .fields = {
+            ecs_id(ecs, Position),
+            ecs_id(ecs, Velocity),
+            ecs_id(ecs, Rotation),
+            ecs_id(ecs, Scale),
+            QUERY_FIELDS_END,
+        },
+        .access = {
+            [1] = QUERY_ACCESS_READ,
+            [3] = QUERY_ACCESS_READ,
+        },
+    };
+    System systems[] = {sum_system, iterate2_system, NULL, iterate4_system};
+    if (fields < 4) {
+        desc.fields[fields] = QUERY_FIELDS_END;
+    }
+    if (fields == 1) {
+        desc.access[0] = QUERY_ACCESS_READ;
+    }
+    QueryCache *cache = ecs_query_cache_new(ecs, desc);
+    u32 rounds = suite_rounds(count);
+
+    f32 sum = 0.0f;
+    f64 start = now();
+    for (u32 i = 0; i < rounds; i++) {
+        Query query = ecs_query_cached(ecs, cache);
+        for (size_t j = 0; j < query.count; j++) {
+            systems[fields - 1](ecs, ecs_query_get_iter(query, j), &sum);
+        }
+        ecs_query_free(ecs, query);
+    }
+    result->seconds = now() - start;
+    result->ops = (u64) count*rounds;
+
+    return ecs;
+}
+
+static ECS *case_iterate1(u32 count, SuiteResult *result) {
+    return suite_iterate(count, 1, result);
+}
+
+static ECS *case_iterate2(u32 count, SuiteResult *result) {
+    return suite_iterate(count, 2, result);
+}
+
+static ECS *case_iterate4(u32 count, SuiteResult *result) {
+    return suite_iterate(count, 4, result);
+}
+
+// Replaces every entity it sees with a fresh one, leaving the world the same
+// size for the next frame.
+static void respawn_system(ECS *ecs, QueryIter iter, void *user_ptr) {
+    (void) user_ptr;
+    const Position *pos = ecs_query_iter_get_field(iter, 0);
+    for (size_t i = 0; i < iter.count; i++) {
+        ecs_entity_kill(ecs, iter.entities[i]);
+        Entity ent = ecs_entity(ecs);
+        entity_add_component(ecs, ent, Position, {pos[i].x + 1.0f, pos[i].y});
+        entity_add_component(ecs, ent, Velocity, {.x = 1.0f});
+    }
+}
+
+// Recording and playback of a kill, a spawn and two adds per entity.
+static ECS *case_deferred(u32 count, SuiteResult *result) {
+    ECS *ecs = suite_world();
+    ecs_spawn_batch(ecs, count, NULL,
+            component_fill(Position, {0}),
+            component_fill(Velocity, {.x = 1.0f}));
+    QueryDesc desc = {
+        .fields = {
+            ecs_id(ecs, Position),
+            QUERY_FIELDS_END,
+        },
+        .access = {
+            QUERY_ACCESS_READ,
+        },
+    };
+    u32 rounds = suite_rounds(count);
+
+    f64 start = now();
+    for (u32 i = 0; i < rounds; i++) {
+        ecs_run_system(ecs, respawn_system, desc);
+    }
+    result->seconds = now() - start;
+    result->ops = (u64) count*rounds;
+
+    return ecs;
+}
+
+// Spreads the entities evenly over 'SUITE_ARCHETYPE_COUNT' archetypes, all of
+// them with a Position, and iterates the positions.
+static ECS *case_fragmented(u32 count, SuiteResult *result) {
+    ECS *ecs = suite_world();
+
+    static char names[SUITE_FRAGMENT_COUNT][16];
+    ComponentColumn columns[SUITE_FRAGMENT_COUNT + 1];
+    ComponentId fragments[SUITE_FRAGMENT_COUNT];
+    f32 value = 1.0f;
+    Position position = {1.0f, 0.0f};
+    for (u32 i = 0; i < SUITE_FRAGMENT_COUNT; i++) {
+        snprintf(names[i], sizeof(names[i]), "Fragment%u", i);
+        fragments[i] = _ecs_register_component(ecs, (Str) {(const u8 *) names[i], strlen(names[i])}, sizeof(f32), COMPONENT_STORAGE_TABLE);
+    }
+
+    // Archetype 'i' holds the fragments of the bits set in 'i + 1'.
+    for (u32 i = 0; i < SUITE_ARCHETYPE_COUNT; i++) {
+        u32 len = 0;
+        columns[len++] = (ComponentColumn) {ecs_id(ecs, Position), &position, true};
+        for (u32 j = 0; j < SUITE_FRAGMENT_COUNT; j++) {
+            if ((i + 1) & (1u << j)) {
+                columns[len++] = (ComponentColumn) {fragments[j], &value, true};
+            }
+        }
+        u32 share = count/SUITE_ARCHETYPE_COUNT + (i < count % SUITE_ARCHETYPE_COUNT);
+        if (share > 0) {
+            ecs_spawn_batch_id(ecs, share, NULL, columns, len);
+        }
+    }
+
+    QueryCache *cache = ecs_query_cache_new(ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(ecs, Position),
+                QUERY_FIELDS_END,
+            },
+            .access = {
+                QUERY_ACCESS_READ,
+            },
+        });
+    u32 rounds = suite_rounds(count);
+
+    f32 sum = 0.0f;
+    f64 start = now();
+    for (u32 i = 0; i < rounds; i++) {
+        Query query = ecs_query_cached(ecs, cache);
+        for (size_t j = 0; j < query.count; j++) {
+            sum_system(ecs, ecs_query_get_iter(query, j), &sum);
+        }
+        ecs_query_free(ecs, query);
+    }
+    result->seconds = now() - start;
+    result->ops = (u64) count*rounds;
+    if (sum != (f32) count*rounds) {
+        printf("unexpected sum\n");
+    }
+
+    return ecs;
+}
+
+static const struct {
+    const char *name;
+    SuiteCase run;
+} suite_cases[] = {
+    {"spawn_kill", case_spawn_kill},
+    {"add_remove", case_add_remove},
+    {"get_component", case_get_component},
+    {"iterate_1", case_iterate1},
+    {"iterate_2", case_iterate2},
+    {"iterate_4", case_iterate4},
+    {"deferred", case_deferred},
+    {"fragmented_1k", case_fragmented},
+};
+
+static const u32 suite_sizes[] = {1000, 100000, 1000000};
+
+// Runs the case in a child process and reports it, preceded by 'separator'
+// in the JSON array.
+static b8 suite_run(FILE *json, const char *separator, u32 case_index, u32 count) {
+    fflush(stdout);
+    if (json != NULL) {
+        fflush(json);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+
+    if (pid == 0) {
+        size_t heap = heap_used();
+        SuiteResult result = {0};
+        ECS *ecs = suite_cases[case_index].run(count, &result);
+        size_t used = heap_used();
+        size_t allocated = used > heap ? used - heap : 0;
+        ecs_free(ecs);
+
+        const char *name = suite_cases[case_index].name;
+        f64 ns_per_op = result.seconds*1e9/result.ops;
+        size_t rss = peak_rss();
+        printf("%-16s %8u ents %10.2f ns/op %12zu bytes %12zu rss\n",
+                name, count, ns_per_op, allocated, rss);
+        if (json != NULL) {
+            fprintf(json, "%s  {\"case\": \"%s\", \"entities\": %u, \"ops\": %llu, \"ns_per_op\": %.3f, "
+                    "\"allocated_bytes\": %zu, \"peak_rss_bytes\": %zu}",
+                    separator, name, count, (unsigned long long) result.ops, ns_per_op, allocated, rss);
+            fflush(json);
+        }
+        fflush(stdout);
+        _exit(0);
+    }
+
+    i32 status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-16s %8u ents failed\n", suite_cases[case_index].name, count);
+        return false;
+    }
+    return true;
+}
+
+static void run_suite(const char *json_path) {
+    FILE *json = NULL;
+    if (json_path != NULL) {
+        json = fopen(json_path, "w");
+        if (json == NULL) {
+            perror(json_path);
+        } else {
+            fprintf(json, "[\n");
+        }
+    }
+
+    const char *separator = "";
+    for (u32 i = 0; i < sizeof(suite_cases)/sizeof(suite_cases[0]); i++) {
+        for (u32 j = 0; j < sizeof(suite_sizes)/sizeof(suite_sizes[0]); j++) {
+            if (suite_run(json, separator, i, suite_sizes[j])) {
+                separator = ",\n";
+            }
+        }
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n]\n");
+        fclose(json);
+    }
+    printf("\n");
+}
+
+i32 main(i32 argc, char **argv) {
+    const char *json_path = NULL;
+    for (i32 i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--json <path>]\n", argv[0]);
+            return 1;
+        }
+    }
+    run_checks();
+    run_suite(json_path);
+
+    bench_spawn_kill_iterate(100000);
+    bench_spawn_batch(100000);
+    bench_run_group(100000, 100);
+    bench_changed(100000, 10, 1000);
+    bench_enabled(100000, 16, 100);
+    bench_archetypes(10000, 1000);
+    bench_churn(10000, 10);
+    bench_instantiate(500, 200);
+    bench_snapshot(1000000);
+    bench_rollback(50000, 1000);
+    bench_merge(100000);
+    bench_get_component(100000, 1000000);
+    return check_failures > 0;
+}
@@ -7,16 +7,67 @@
 typedef struct ECS ECS;
 
 typedef uint64_t Entity;
+typedef size_t ComponentId;
 
 extern ECS *ecs_new(void);
 extern void ecs_free(ECS *ecs);
 
+// Component handles are resolved once when the component is registered and
+// stored in a global declared with 'ecs_declare_component()'. The macros
+// below use the handle directly so no name is hashed on the hot path.
+//
+// Handles are shared by every world of the process, the 'ecs' argument of
+// 'ecs_id()' is only there for symmetry. Every world must register its
+// components in the same order, which is asserted. The first world to
+// register a component sets its handle and the others only read it, so
+// worlds can be set up on other threads once one world has registered every
+// component on the main thread.
+#define ecs_declare_component(component) \
+    ComponentId _ecs_component_##component = -1
+#define ecs_extern_component(component) \
+    extern ComponentId _ecs_component_##component
+
+// Table components are stored in the archetype of an entity, packed with the
+// other entities having the same components, which makes them the fastest to
+// iterate. Adding or removing one moves the entity and all of its components
+// to another archetype.
+//
+// Sparse components are stored in a set of their own and aren't part of the
+// archetype, so adding or removing one costs the same no matter how many
+// other components the entity has. Suited for components that come and go
+// all the time. Queries join them with table components but visit entities
+// one at a time, 'count' of an iterator being 1, whenever a field is sparse.
+typedef enum {
+    COMPONENT_STORAGE_TABLE,
+    COMPONENT_STORAGE_SPARSE,
+} ComponentStorage;
+
 #define ecs_register_component(ecs, component) \
-    _ecs_register_component(ecs, str_lit(#component), sizeof(component))
-extern void _ecs_register_component(ECS *ecs, Str component_name,
-                                    size_t component_size);
+    ecs_register_component_storage(ecs, component, COMPONENT_STORAGE_TABLE)
+#define ecs_register_component_storage(ecs, component, storage) \
+    _ecs_register_component_handle(ecs, &_ecs_component_##component, \
+            str_lit(#component), sizeof(component), storage)
+// Registers a component without a handle, e.g. one made up at runtime.
+extern ComponentId _ecs_register_component(ECS *ecs, Str component_name,
+                                           size_t component_size,
+                                           ComponentStorage storage);
+extern ComponentId _ecs_register_component_handle(ECS *ecs, ComponentId *handle,
+                                                  Str component_name,
+                                                  size_t component_size,
+                                                  ComponentStorage storage);
+
+// Tags are components without data, C has no empty structs so a tag is only a
+// name declared with 'ecs_declare_component()'. They're part of the archetype
+// of an entity and can be queried like any other component but take up no
+// storage and are never copied. Pointers to a tag, from a query field or
+// 'entity_get_component()', only tell whether it's present.
+#define ecs_register_tag(ecs, tag) \
+    ecs_register_tag_storage(ecs, tag, COMPONENT_STORAGE_TABLE)
+#define ecs_register_tag_storage(ecs, tag, storage) \
+    _ecs_register_component_handle(ecs, &_ecs_component_##tag, str_lit(#tag), 0, storage)
 
-#define ecs_id(ecs, component) _ecs_id(ecs, str_lit(#component))
+#define ecs_id(ecs, component) ((Entity) _ecs_component_##component)
+// Name based lookup, meant for tooling rather than the hot path.
 extern Entity _ecs_id(ECS *ecs, Str component_name);
 
 // -- Entity -------------------------------------------------------------------
@@ -24,51 +75,426 @@ extern Entity ecs_entity(ECS *ecs);
 extern void ecs_entity_kill(ECS *ecs, Entity entity);
 
 #define entity_add_component(ecs, entity, component, ...) \
-    _entity_add_component(ecs, entity, str_lit(#component), &(component)__VA_ARGS__)
+    entity_add_component_id(ecs, entity, _ecs_component_##component, &(component)__VA_ARGS__)
+extern void entity_add_component_id(ECS *ecs, Entity entity,
+        ComponentId component_id, const void *data);
 extern void _entity_add_component(ECS *ecs, Entity entity, Str component_name,
         const void *data);
 
 #define entity_remove_component(ecs, entity, component) \
-    _entity_remove_component(ecs, entity, str_lit(#component))
+    entity_remove_component_id(ecs, entity, _ecs_component_##component)
+extern void entity_remove_component_id(ECS *ecs, Entity entity,
+        ComponentId component_id);
 extern void _entity_remove_component(ECS *ecs, Entity entity, Str component_name);
 
+// The returned component is writable and counts as changed for 'Changed()'.
 #define entity_get_component(ecs, entity, component) \
-    _entity_get_component(ecs, entity, str_lit(#component))
+    entity_get_component_id(ecs, entity, _ecs_component_##component)
+extern void *entity_get_component_id(ECS *ecs, Entity entity,
+        ComponentId component_id);
 extern void *_entity_get_component(ECS *ecs, Entity entity, Str component_name);
 
+// Same as 'entity_get_component()' without counting as changed, for lookups
+// that only read, so they don't dirty chunks for rollback and 'Changed()'.
+#define entity_read_component(ecs, entity, component) \
+    entity_read_component_id(ecs, entity, _ecs_component_##component)
+extern const void *entity_read_component_id(ECS *ecs, Entity entity,
+        ComponentId component_id);
+
+#define entity_has_component(ecs, entity, component) \
+    entity_has_component_id(ecs, entity, _ecs_component_##component)
+extern b8 entity_has_component_id(ECS *ecs, Entity entity,
+        ComponentId component_id);
+
+#define entity_add_tag(ecs, entity, tag) \
+    entity_add_component_id(ecs, entity, _ecs_component_##tag, NULL)
+#define entity_remove_tag(ecs, entity, tag) \
+    entity_remove_component_id(ecs, entity, _ecs_component_##tag)
+
+// -- Bundle -------------------------------------------------------------------
+// Adding or removing several components through a bundle moves the entity
+// once, straight into its final archetype, instead of once per component.
+#define MAX_BUNDLE_COMPONENTS 32
+
+typedef struct ComponentData ComponentData;
+struct ComponentData {
+    ComponentId id;
+    const void *data;
+};
+
+#define component_data(component, ...) \
+    ((ComponentData) {_ecs_component_##component, &(component)__VA_ARGS__})
+#define tag_data(tag) \
+    ((ComponentData) {_ecs_component_##tag, NULL})
+
+#define entity_add_components(ecs, entity, ...) \
+    entity_add_components_id(ecs, entity, (ComponentData[]) {__VA_ARGS__}, \
+            sizeof((ComponentData[]) {__VA_ARGS__})/sizeof(ComponentData))
+extern void entity_add_components_id(ECS *ecs, Entity entity,
+        const ComponentData *components, size_t count);
+
+#define entity_remove_components(ecs, entity, ...) \
+    entity_remove_components_id(ecs, entity, (ComponentId[]) {__VA_ARGS__}, \
+            sizeof((ComponentId[]) {__VA_ARGS__})/sizeof(ComponentId))
+extern void entity_remove_components_id(ECS *ecs, Entity entity,
+        const ComponentId *components, size_t count);
+
+// -- Batch --------------------------------------------------------------------
+// Spawns many entities straight into the archetype made up of the given
+// columns. A column holds either 'count' contiguous components or, when
+// 'fill' is set, a single component copied to every entity. Entity IDs are
+// written to 'out_entities' unless it's NULL. Inside a query the whole batch
+// is deferred as a single command.
+typedef struct ComponentColumn ComponentColumn;
+struct ComponentColumn {
+    ComponentId id;
+    const void *data;
+    b8 fill;
+};
+
+#define component_column(component, array) \
+    ((ComponentColumn) {_ecs_component_##component, (const component *) (array), false})
+#define component_fill(component, ...) \
+    ((ComponentColumn) {_ecs_component_##component, &(component)__VA_ARGS__, true})
+#define tag_column(tag) \
+    ((ComponentColumn) {_ecs_component_##tag, NULL, true})
+
+#define ecs_spawn_batch(ecs, count, out_entities, ...) \
+    ecs_spawn_batch_id(ecs, count, out_entities, (ComponentColumn[]) {__VA_ARGS__}, \
+            sizeof((ComponentColumn[]) {__VA_ARGS__})/sizeof(ComponentColumn))
+extern void ecs_spawn_batch_id(ECS *ecs, size_t count, Entity *out_entities,
+        const ComponentColumn *columns, size_t column_count);
+
+// -- Prefab -------------------------------------------------------------------
+// Prefabs are template entities carrying the builtin 'Prefab' tag, which
+// every query skips unless one of its fields mentions the tag. Instantiating
+// a prefab spawns entities with all of its other components, table and
+// sparse, the same way as a batch filling every column from the prefab.
+ecs_extern_component(Prefab);
+
+// Called for each instance once its components have been copied from the
+// prefab, 'index' counting the instances of the call from 0. 'user_data' is
+// a copy made when instantiating, since inside a query instances are only
+// created, and overridden, once the commands are played back.
+typedef void (*PrefabOverride)(ECS *ecs, Entity instance, size_t index, const void *user_data);
+
+// New entity with the 'Prefab' tag.
+extern Entity ecs_prefab(ECS *ecs);
+#define ecs_instantiate(ecs, prefab, count, out_entities) \
+    ecs_instantiate_with(ecs, prefab, count, out_entities, NULL, NULL, 0)
+extern void ecs_instantiate_with(ECS *ecs, Entity prefab, size_t count,
+        Entity *out_entities, PrefabOverride override,
+        const void *user_data, size_t user_data_size);
+
 extern b8 entity_alive(ECS *ecs, Entity entity);
 
+// Disabled entities keep their components and archetype but are skipped by
+// queries, unless 'include_disabled' is set. Flipping the state is a single
+// bit, entities start out enabled.
+extern void ecs_entity_set_enabled(ECS *ecs, Entity entity, b8 enabled);
+extern b8 entity_enabled(ECS *ecs, Entity entity);
+
 // extern void entity_add_entity(ECS *ecs, Entity self, Entity other);
 // extern void entity_remove_entity(ECS *ecs, Entity self, Entity other);
 
+// -- Observer -----------------------------------------------------------------
+// Observers are called when a component is added to, removed from or set on
+// entities, both by direct calls and during command playback. OnAdd and OnSet
+// run once the data is in place, OnSet also when an add overwrites the
+// component. OnRemove runs while the component can still be read, including
+// when the entity is killed.
+//
+// Entities spawned by a batch or instantiation are delivered together, one
+// run of consecutive columns of a chunk at a time. Everything else, and
+// sparse components, is delivered one entity at a time. Changes an observer
+// makes to the world are deferred like inside a query and applied once the
+// operation that triggered it has finished.
+typedef enum {
+    OBSERVER_ON_ADD,
+    OBSERVER_ON_REMOVE,
+    OBSERVER_ON_SET,
+    OBSERVER_EVENT_COUNT,
+} ObserverEvent;
+
+typedef struct ObserverIter ObserverIter;
+struct ObserverIter {
+    ObserverEvent event;
+    ComponentId component;
+    size_t count;
+    const Entity *entities;
+    // Component of each entity, valid for 'count' elements.
+    void *components;
+};
+
+typedef void (*Observer)(ECS *ecs, ObserverIter iter, void *user_ptr);
+
+extern void ecs_register_observer(ECS *ecs, Observer observer, ObserverEvent event,
+        ComponentId component, void *user_ptr);
+
+// -- Snapshot -----------------------------------------------------------------
+// A snapshot stores the whole world in one versioned binary file: the
+// component registry, every archetype with its entities and raw rows, the
+// sparse sets, and the entity generations and free list. Entity IDs are kept
+// as they are, so entities referring to each other still do after reading.
+//
+// Reading maps the file and copies every row straight into its archetype, one
+// chunk at a time. Components are matched by name, the world read into has
+// to register the same ones and can't have any entities yet.
+// Snapshots are only read on the machine and build that wrote them. If
+// reading fails, the world is left half read and should be freed.
+//
+// Components holding pointers register hooks. After the raw rows, 'save'
+// writes whatever a component points to. When reading, 'load' reads it back
+// and patches the raw copy of the component before it's placed.
+typedef struct Snapshot Snapshot;
+typedef void (*SnapshotSave)(ECS *ecs, Snapshot *snapshot, const void *component);
+typedef void (*SnapshotLoad)(ECS *ecs, Snapshot *snapshot, void *component);
+
+extern void snapshot_write(Snapshot *snapshot, const void *data, size_t size);
+// Zeroes 'data' and returns false when reading past what 'save' wrote.
+extern b8 snapshot_read(Snapshot *snapshot, void *data, size_t size);
+
+#define ecs_register_snapshot_hooks(ecs, component, save, load) \
+    ecs_register_snapshot_hooks_id(ecs, ecs_id(ecs, component), save, load)
+extern void ecs_register_snapshot_hooks_id(ECS *ecs, ComponentId component,
+        SnapshotSave save, SnapshotLoad load);
+// Both return false and log the reason on failure. Neither can be called
+// inside a query.
+extern b8 ecs_snapshot_write(ECS *ecs, const char *path);
+extern b8 ecs_snapshot_read(ECS *ecs, const char *path);
+
+// -- Rollback -----------------------------------------------------------------
+// In memory ring of the last saved states of the world, for rewinding the
+// simulation. Saving copies only the chunks written to, or having entities
+// added, removed, enabled or disabled, since the previous save. Every other
+// chunk shares its copy with the previous state. Sparse components are
+// copied whole.
+//
+// Restoring puts back the entities, IDs included, and the components as they
+// were, without calling observers. Components a rollback overwrote count as
+// changed. Rows are copied byte for byte so whatever a component points to
+// isn't restored.
+
+// Room for 'frames' saved states, 0 turns the ring off. Drops every state
+// saved so far.
+extern void ecs_set_rollback_frames(ECS *ecs, u32 frames);
+// Saves the current state, replacing the oldest one once the ring is full.
+extern void ecs_rollback_save(ECS *ecs);
+// Restores the state saved 'frames' saves ago, 0 being the latest one, and
+// drops every state saved after it. Returns false if the ring doesn't go back
+// that far. Neither can be called inside a query.
+extern b8 ecs_rollback(ECS *ecs, u32 frames);
+// Number of saved states.
+extern u32 ecs_rollback_count(ECS *ecs);
+
+// -- Merge --------------------------------------------------------------------
+// Entities can be built in a staging world, e.g. on another thread, and moved
+// into the live world in one go. Each archetype of the staging world is
+// appended to the matching archetype of the live one a chunk at a time, and
+// the entities get new IDs. Both worlds need the same components registered
+// in the same order, which should happen before the staging world is handed
+// to another thread since the handles are shared.
+//
+// Entities of a staging world carry a tag in their generation so they can't
+// be mistaken for entities of the live world. Components of staged entities
+// may refer to both. Those referring to other entities register a remap
+// hook on the live world. It's called on runs of components about to be
+// copied and rewrites their references with 'entity_remap()'.
+typedef struct EntityRemap EntityRemap;
+typedef void (*ComponentRemap)(ECS *ecs, const EntityRemap *remap, void *components, size_t count);
+
+// New ID of an entity of the staging world. Anything else, such as an entity
+// of the live world, a stale one or a prefab of the staging world, is
+// returned as is.
+extern Entity entity_remap(const EntityRemap *remap, Entity entity);
+
+#define ecs_register_remap_hook(ecs, component, remap) \
+    ecs_register_remap_hook_id(ecs, ecs_id(ecs, component), remap)
+extern void ecs_register_remap_hook_id(ECS *ecs, ComponentId component,
+        ComponentRemap remap);
+
+// World whose entities can be merged into a live world created with
+// 'ecs_new()'.
+extern ECS *ecs_new_staging(void);
+
+// Moves every entity of the staging world 'src' but its prefabs into the live
+// world 'dst', calling the observers of 'dst' as for a batch spawn.
+// Afterwards 'src' only holds its prefabs and can be reused. Returns false
+// and logs the reason if either world isn't of the right kind, the
+// components don't match or either world is inside a query.
+extern b8 ecs_merge(ECS *dst, ECS *src);
+
+// -- Compaction ---------------------------------------------------------------
+// Maintenance pass meant to run once a frame. Archetypes left empty for
+// 'empty_frames' passes are removed from the archetype graph and every query,
+// and free chunks past 'pooled_chunks' are released along with unused
+// capacity of sparse components. With a time budget the archetype scan stops
+// once it runs out and resumes there next time. A zero description removes
+// every empty archetype and releases everything. Archetypes with entities in
+// a state saved for rollback are kept.
+typedef struct CompactDesc CompactDesc;
+struct CompactDesc {
+    u32 empty_frames;
+    size_t pooled_chunks;
+    // In nanoseconds, 0 for no limit.
+    u64 budget_ns;
+};
+
+// Returns the number of bytes released. Must not be called inside a query.
+#define ecs_compact(ecs) ecs_compact_with(ecs, (CompactDesc) {0})
+extern size_t ecs_compact_with(ECS *ecs, CompactDesc desc);
+
+// -- Stats --------------------------------------------------------------------
+// Counters cheap enough to sample every frame, for an overlay or a time
+// series. Only reads the world so it can be called inside a query, but not
+// while systems run in parallel.
+typedef struct ECSStats ECSStats;
+struct ECSStats {
+    // Live entities, prefabs and deferred spawns included, and IDs waiting on
+    // the free list.
+    size_t entity_count;
+    size_t free_entity_count;
+    size_t component_count;
+    size_t archetype_count;
+    // Persistent queries, those of systems included.
+    size_t query_count;
+    // Chunks in use by archetypes, their bytes, and free chunks kept by the
+    // pool.
+    size_t chunk_count;
+    size_t chunk_bytes;
+    size_t pooled_chunk_count;
+    // Edges of the archetype graph, one per pair of archetypes differing by a
+    // single component, and cached bundle transitions.
+    size_t edge_count;
+    size_t bundle_edge_count;
+    // Components stored in sparse sets.
+    size_t sparse_count;
+    // Commands waiting for playback, and the most commands and payload bytes
+    // played back at once since the world was created.
+    size_t command_count;
+    size_t command_high_water;
+    size_t command_bytes_high_water;
+    // Chunks copied by the last rollback save, see 'ecs_rollback_save()'.
+    size_t rollback_copied_chunks;
+    // Share of used slots of the archetype lookup table and of the entity ID
+    // space held by the free list.
+    f32 archetype_table_load;
+    f32 free_list_load;
+};
+
+typedef struct ArchetypeStats ArchetypeStats;
+struct ArchetypeStats {
+    // Sorted components of the archetype, valid until the next structural
+    // change.
+    const ComponentId *components;
+    size_t component_count;
+    size_t entity_count;
+    size_t chunk_count;
+    // Bytes of the chunks of the archetype, and the part of it holding the
+    // entities and their components.
+    size_t capacity_bytes;
+    size_t used_bytes;
+    size_t edge_count;
+    size_t bundle_edge_count;
+    // Persistent queries matching the archetype.
+    size_t query_count;
+};
+
+extern ECSStats ecs_stats(ECS *ecs);
+// Fills 'stats' with up to 'capacity' archetypes in creation order, the root
+// archetype first. Returns the number of archetypes of the world.
+extern size_t ecs_archetype_stats(ECS *ecs, ArchetypeStats *stats, size_t capacity);
+
 // -- Query --------------------------------------------------------------------
 #define MAX_QUERY_FIELDS 128
 static const Entity QUERY_FIELDS_END = -1;
 
+// Terms stored in the upper bits of a field, e.g. 'Changed(ecs_id(ecs, T))'.
+// Fields without a term are required.
+//
+// Changed and Added fields match and are accessed like plain ones but chunks
+// where no entity had the component mutably accessed, or added, since the
+// query last began are skipped. Changes are tracked per chunk so every entity
+// of a passing chunk is visited. One-off queries have never run before and
+// see every chunk that has been touched at all.
+//
+// Without excludes archetypes having the component. Optional matches either
+// way. Consecutive Or fields form a group of which at least one component has
+// to be present. All three are resolved once per archetype and the field of
+// a missing component is NULL.
+#define QUERY_TERM_CHANGED ((Entity) 1 << 63)
+#define QUERY_TERM_ADDED ((Entity) 1 << 62)
+#define QUERY_TERM_WITHOUT ((Entity) 1 << 61)
+#define QUERY_TERM_OPTIONAL ((Entity) 1 << 60)
+#define QUERY_TERM_OR ((Entity) 1 << 59)
+#define QUERY_TERM_MASK (QUERY_TERM_CHANGED | QUERY_TERM_ADDED | \
+        QUERY_TERM_WITHOUT | QUERY_TERM_OPTIONAL | QUERY_TERM_OR)
+
+#define Changed(id) ((Entity) (id) | QUERY_TERM_CHANGED)
+#define Added(id) ((Entity) (id) | QUERY_TERM_ADDED)
+#define Without(id) ((Entity) (id) | QUERY_TERM_WITHOUT)
+#define Optional(id) ((Entity) (id) | QUERY_TERM_OPTIONAL)
+#define Or(id) ((Entity) (id) | QUERY_TERM_OR)
+
+typedef enum {
+    // The default, the system may modify the component.
+    QUERY_ACCESS_WRITE,
+    QUERY_ACCESS_READ,
+} QueryAccess;
+
 typedef struct QueryDesc QueryDesc;
 struct QueryDesc {
     Entity fields[MAX_QUERY_FIELDS];
+    // Access to each field. Systems registered in the same group whose
+    // accesses don't conflict may run concurrently. Getting a written field
+    // of an iterator marks the component as changed for its chunk. Parallel
+    // systems run by a group mark every chunk they visit up front instead.
+    QueryAccess access[MAX_QUERY_FIELDS];
+    // The system touches more than its own fields, e.g. components of other
+    // entities or shared state. It runs on the thread calling
+    // 'ecs_run_group()' while no other system is running.
+    b8 exclusive;
+    // Splits the matched archetypes into ranges of at most 'grain_size'
+    // entities, 1024 if 0, which a system registered to a group processes
+    // concurrently. The system is called once per range and must be safe to
+    // call from several threads at once.
+    b8 parallel;
+    size_t grain_size;
+    // Also visit disabled entities.
+    b8 include_disabled;
     void *user_ptr;
 };
 
+// Matching archetypes of a query, owned by the world and kept up to date as
+// new archetypes are created.
+typedef struct QueryCache QueryCache;
+
 typedef struct Query Query;
 struct Query {
     size_t count;
 
-    QueryDesc _desc;
-    size_t _field_count;
-    void **_archetypes;
+    QueryCache *_cache;
 };
 
 typedef struct QueryIter QueryIter;
 struct QueryIter {
     size_t count;
+    // Entity of each column, valid for 'count' elements.
+    const Entity *entities;
+    // Column of the archetype the iterator starts at. Fields and 'entities'
+    // already account for it.
+    size_t offset;
 
     Query _query;
     size_t _i;
 };
 
 extern Query ecs_query(ECS *ecs, QueryDesc desc);
+// Persistent queries only match archetypes once, so beginning one with
+// 'ecs_query_cached()' allocates nothing. End it with 'ecs_query_free()' like
+// any other query.
+extern QueryCache *ecs_query_cache_new(ECS *ecs, QueryDesc desc);
+extern Query ecs_query_cached(ECS *ecs, QueryCache *cache);
 extern QueryIter ecs_query_get_iter(Query query, size_t i);
 extern void *ecs_query_iter_get_field(QueryIter iter, size_t field);
 extern Entity ecs_query_iter_get_entity(QueryIter iter, size_t i);
@@ -80,5 +506,15 @@ typedef void (*System)(ECS *ecs, QueryIter iter, void *user_ptr);
 
 extern SystemGroup ecs_system_group(ECS *ecs);
 extern void ecs_register_system(ECS *ecs, System system, SystemGroup group, QueryDesc desc);
+// Runs the systems of a group on a pool of worker threads. A system waits for
+// every earlier system of the group it conflicts with, so the result is the
+// same as running them in registration order. Commands issued by systems are
+// played back in registration order once every system has finished.
+//
+// Non-exclusive systems must not begin queries of their own. Entities spawned
+// by a system aren't alive until the group has finished.
 extern void ecs_run_group(ECS *ecs, SystemGroup group);
+// Number of worker threads used besides the calling thread. Defaults to one
+// less than the number of CPUs, 0 runs every group serially.
+extern void ecs_set_worker_count(ECS *ecs, u32 count);
 extern void ecs_run_system(ECS *ecs, System system, QueryDesc desc);
@@ -2,24 +2,27 @@
 #include "ds.h"
 #include "internal.h"
 
+#include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void archetype_inspect(const Archetype *archetype) {
     printf("Archetype (%p)\n", archetype);
     printf("    Type: ");
     type_inspect(archetype->type);
     printf("    Entity count: %zu\n", archetype->current_index);
+    printf("    Chunk count: %zu (%zu entities each)\n", vec_len(archetype->chunks), archetype->chunk_capacity);
 
     printf("    Storage:\n");
     for (size_t i = 0; i < vec_len(archetype->type); i++) {
         printf("    [%zu] = {\n", i);
-        uint8_t *arr = archetype->storage[i];
         for (size_t j = 0; j < archetype->current_index; j++) {
+            uint8_t *component = archetype_component(archetype, i, j);
             printf("        ");
-            for (size_t k = 0; k < vec_element_size(arr); k++) {
-                printf("%.2x ", arr[(j*vec_element_size(arr))+k]);
+            for (size_t k = 0; k < archetype->row_sizes[i]; k++) {
+                printf("%.2x ", component[k]);
             }
             printf("\n");
         }
@@ -27,51 +30,408 @@ static void archetype_inspect(const Archetype *archetype) {
     }
 }
 
-Archetype *archetype_new(const ECS *ecs, Type type) {
+static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+Archetype *archetype_find(ECS *ecs, const Signature *signature, u64 hash) {
+    size_t mask = vec_len(ecs->archetype_table) - 1;
+    for (size_t slot = hash & mask; ecs->archetype_table[slot] != 0; slot = (slot + 1) & mask) {
+        u32 index = ecs->archetype_table[slot] - 1;
+        if (ecs->archetypes[index]->hash == hash &&
+                signature_equal(&ecs->archetype_signatures[index], signature)) {
+            return ecs->archetypes[index];
+        }
+    }
+    return NULL;
+}
+
+static void archetype_table_insert(ECS *ecs, Archetype *archetype) {
+    size_t mask = vec_len(ecs->archetype_table) - 1;
+    size_t slot = archetype->hash & mask;
+    while (ecs->archetype_table[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    ecs->archetype_table[slot] = archetype->index + 1;
+}
+
+// Keeps the table at most half full, rehashing every archetype when it
+// grows.
+static void archetype_table_add(ECS *ecs, Archetype *archetype, Signature signature) {
+    archetype->index = vec_len(ecs->archetypes);
+    archetype->hash = signature_hash(&signature);
+    vec_push(ecs->archetypes, archetype);
+    vec_push(ecs->archetype_signatures, signature);
+
+    if (vec_len(ecs->archetypes)*2 > vec_len(ecs->archetype_table)) {
+        size_t capacity = vec_len(ecs->archetype_table) > 0 ? vec_len(ecs->archetype_table)*2 : 64;
+        vec_free(ecs->archetype_table);
+        for (size_t i = 0; i < capacity; i++) {
+            vec_push(ecs->archetype_table, 0);
+        }
+        for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+            archetype_table_insert(ecs, ecs->archetypes[i]);
+        }
+    } else {
+        archetype_table_insert(ecs, archetype);
+    }
+}
+
+Archetype *archetype_new(ECS *ecs, Type type) {
     Archetype *archetype = malloc(sizeof(Archetype));
     *archetype = (Archetype) {
         .type = type_clone(type),
+        .empty_since = ecs->compact_frame,
     };
-    HashMapDesc entity_lookup_desc = hash_map_desc_default(archetype->entity_lookup);
-    Entity invalid = -1;
-    entity_lookup_desc.zero_value = &invalid;
-    hash_map_new(archetype->entity_lookup, entity_lookup_desc);
 
+    for (size_t i = 0; i < vec_len(ecs->components); i++) {
+        vec_push(archetype->component_lookup, ARCHETYPE_NO_ROW);
+    }
+
+    size_t row_size = sizeof(Entity);
     for (size_t i = 0; i < type_len(type); i++) {
-        vec_push(archetype->storage, vec_new(ecs->components[type[i]].size));
-        hash_map_insert(archetype->component_lookup, type[i], i);
-
-        HashSet(Archetype *) *archetype_set = hash_map_getp(ecs->component_archetype_set_map, type[i]);
-        if (archetype_set == NULL) {
-            HashSet(Archetype *) new_archetype_set = NULL;
-            hash_set_insert(new_archetype_set, archetype);
-            hash_map_insert(ecs->component_archetype_set_map, type[i], new_archetype_set);
-        } else {
-            hash_set_insert(*archetype_set, archetype);
+        vec_push(archetype->row_sizes, ecs->components[type[i]].size);
+        row_size += ecs->components[type[i]].size;
+        archetype->component_lookup[type[i]] = i;
+    }
+
+    // Fit as many entities as possible into a chunk while leaving room for
+    // aligning every row. Components too big for a single chunk get chunks
+    // holding one entity each. Tags have no row in the chunk at all.
+    size_t padding = CHUNK_ALIGN;
+    for (size_t i = 0; i < type_len(type); i++) {
+        if (archetype->row_sizes[i] > 0) {
+            padding += CHUNK_ALIGN;
         }
     }
+    archetype->chunk_size = CHUNK_SIZE;
+    archetype->chunk_capacity = (CHUNK_SIZE - padding) / row_size;
+    if (archetype->chunk_capacity == 0) {
+        archetype->chunk_size = row_size + padding;
+        archetype->chunk_capacity = 1;
+    }
+
+    size_t offset = sizeof(Entity)*archetype->chunk_capacity;
+    for (size_t i = 0; i < type_len(type); i++) {
+        if (archetype->row_sizes[i] == 0) {
+            vec_push(archetype->row_offsets, 0);
+            continue;
+        }
+        offset = align_up(offset, CHUNK_ALIGN);
+        vec_push(archetype->row_offsets, offset);
+        offset += archetype->row_sizes[i]*archetype->chunk_capacity;
+    }
+    assert(offset <= archetype->chunk_size);
+
+    archetype_table_add(ecs, archetype, signature_from_type(type));
+    query_cache_register_archetype(ecs, archetype);
 
     return archetype;
 }
 
 void archetype_free(Archetype *archetype) {
-    for (size_t i = 0; i < vec_len(archetype->storage); i++) {
-        vec_free(archetype->storage[i]);
+    for (size_t i = 0; i < vec_len(archetype->chunks); i++) {
+        free(archetype->chunks[i].data);
+        free(archetype->chunks[i].changed_ticks);
     }
-    vec_free(archetype->storage);
+    vec_free(archetype->chunks);
+    vec_free(archetype->row_offsets);
+    vec_free(archetype->row_sizes);
     type_free(archetype->type);
+    for (size_t i = hash_map_iter_new(archetype->edge_map);
+            hash_map_iter_valid(archetype->edge_map, i);
+            i = hash_map_iter_next(archetype->edge_map, i)) {
+        ArchetypeEdge *edge = &archetype->edge_map[i].value;
+        if (edge->add == archetype) {
+            vec_free(edge->add_remap);
+            vec_free(edge->remove_remap);
+        }
+    }
     hash_map_free(archetype->edge_map);
-    hash_map_free(archetype->component_lookup);
+    vec_free(archetype->component_lookup);
+    for (size_t i = 0; i < vec_len(archetype->bundle_edges); i++) {
+        type_free(archetype->bundle_edges[i].components);
+        vec_free(archetype->bundle_edges[i].remap);
+    }
+    vec_free(archetype->bundle_edges);
     free(archetype);
 }
 
-ArchetypeColumn archetype_add_entity(Archetype *archetype, Entity entity) {
-    size_t index = archetype->current_index++;
-    hash_map_insert(archetype->entity_lookup, index, entity);
+// Memory held by an archetype without any chunks, ignoring the slack of its
+// vectors.
+static size_t archetype_footprint(const Archetype *archetype) {
+    size_t size = sizeof(Archetype);
+    size += type_len(archetype->type)*(sizeof(ComponentId) + 2*sizeof(size_t));
+    size += vec_len(archetype->component_lookup)*sizeof(u32);
+    for (size_t i = 0; i < vec_len(archetype->bundle_edges); i++) {
+        size += sizeof(ArchetypeBundleEdge);
+        size += type_len(archetype->bundle_edges[i].components)*sizeof(ComponentId);
+        size += vec_len(archetype->bundle_edges[i].remap)*sizeof(ArchetypeRemap);
+    }
+    return size;
+}
+
+size_t archetype_remove_empty(ECS *ecs, Archetype **archetypes, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        assert(archetypes[i]->current_index == 0 && archetypes[i] != ecs->root_archetype);
+        signature_free(&ecs->archetype_signatures[archetypes[i]->index]);
+        archetypes[i]->index = ARCHETYPE_REMOVED;
+    }
+
+    // Close the gaps in creation order, giving the remaining archetypes their
+    // new index.
+    size_t len = 0;
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        Archetype *archetype = ecs->archetypes[i];
+        if (archetype->index == ARCHETYPE_REMOVED) {
+            continue;
+        }
+        archetype->index = len;
+        ecs->archetypes[len] = archetype;
+        ecs->archetype_signatures[len] = ecs->archetype_signatures[i];
+        len++;
+    }
+    while (vec_len(ecs->archetypes) > len) {
+        (void) vec_pop(ecs->archetypes);
+        (void) vec_pop(ecs->archetype_signatures);
+    }
+    for (size_t i = 0; i < vec_len(ecs->archetype_table); i++) {
+        ecs->archetype_table[i] = 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        archetype_table_insert(ecs, ecs->archetypes[i]);
+    }
+
+    query_cache_unregister_archetypes(ecs);
+
+    // Edges shared with remaining archetypes are dropped from their side.
+    // Those the removed archetype owns are freed along with it, the others
+    // here.
+    size_t released = 0;
+    for (size_t i = 0; i < count; i++) {
+        Archetype *archetype = archetypes[i];
+        for (size_t j = hash_map_iter_new(archetype->edge_map);
+                hash_map_iter_valid(archetype->edge_map, j);
+                j = hash_map_iter_next(archetype->edge_map, j)) {
+            ArchetypeEdge edge = archetype->edge_map[j].value;
+            Archetype *other = edge.add == archetype ? edge.remove : edge.add;
+            if (other->index == ARCHETYPE_REMOVED) {
+                continue;
+            }
+            hash_map_remove(other->edge_map, archetype->edge_map[j].key);
+            other->edge_count--;
+            if (edge.add == other) {
+                released += (vec_len(edge.add_remap) + vec_len(edge.remove_remap))*sizeof(ArchetypeRemap);
+                vec_free(edge.add_remap);
+                vec_free(edge.remove_remap);
+            }
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        Archetype *archetype = ecs->archetypes[i];
+        size_t j = 0;
+        while (j < vec_len(archetype->bundle_edges)) {
+            ArchetypeBundleEdge *edge = &archetype->bundle_edges[j];
+            if (edge->archetype->index != ARCHETYPE_REMOVED) {
+                j++;
+                continue;
+            }
+            released += sizeof(ArchetypeBundleEdge) + vec_len(edge->remap)*sizeof(ArchetypeRemap);
+            type_free(edge->components);
+            vec_free(edge->remap);
+            _vec_remove_fast((void **) &archetype->bundle_edges, j, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        released += archetype_footprint(archetypes[i]);
+        archetype_free(archetypes[i]);
+    }
+
+    ecs->structure_version++;
+    return released;
+}
+
+u8 *chunk_alloc(ECS *ecs, size_t size) {
+    if (size == CHUNK_SIZE && vec_len(ecs->chunk_pool) > 0) {
+        return vec_pop(ecs->chunk_pool);
+    }
+    return malloc(size);
+}
+
+void chunk_release(ECS *ecs, u8 *data, size_t size) {
+    if (size == CHUNK_SIZE) {
+        vec_push(ecs->chunk_pool, data);
+    } else {
+        free(data);
+    }
+}
+
+Chunk *archetype_push_chunk(ECS *ecs, Archetype *archetype) {
+    Chunk chunk = {
+        .data = chunk_alloc(ecs, archetype->chunk_size),
+        .layout_tick = ecs->tick,
+    };
+    size_t len = type_len(archetype->type);
+    size_t enabled_words = (archetype->chunk_capacity + 63) / 64;
+    chunk.changed_ticks = calloc(2*len + enabled_words, sizeof(u64));
+    chunk.added_ticks = chunk.changed_ticks + len;
+    chunk.enabled = chunk.changed_ticks + 2*len;
+    vec_push(archetype->chunks, chunk);
+    return &archetype->chunks[vec_len(archetype->chunks)-1];
+}
+
+void archetype_pop_chunk(ECS *ecs, Archetype *archetype) {
+    Chunk chunk = vec_pop(archetype->chunks);
+    chunk_release(ecs, chunk.data, archetype->chunk_size);
+    free(chunk.changed_ticks);
+    if (chunk.saved != NULL) {
+        rollback_chunk_release(ecs, chunk.saved);
+    }
+}
+
+// Appends uninitialized columns for 'entities', filling up the last chunk
+// before taking new ones from the pool. Returns the first column.
+static size_t archetype_reserve(ECS *ecs, Archetype *archetype, const Entity *entities, size_t count) {
+    size_t first_column = archetype->current_index;
+    size_t i = 0;
+    while (i < count) {
+        size_t column = archetype->current_index;
+        if (column == vec_len(archetype->chunks)*archetype->chunk_capacity) {
+            archetype_push_chunk(ecs, archetype);
+        }
+
+        Chunk *chunk = &archetype->chunks[column / archetype->chunk_capacity];
+        chunk->layout_tick = ecs->tick;
+        size_t n = archetype->chunk_capacity - chunk->count;
+        if (n > count - i) {
+            n = count - i;
+        }
+        memcpy(&((Entity *) chunk->data)[chunk->count], &entities[i], sizeof(Entity)*n);
+        for (size_t j = 0; j < n; j++) {
+            ecs->entity_records[(uint32_t) entities[i + j]] = (ArchetypeColumn) {
+                .archetype = archetype,
+                .index = column + j,
+            };
+            size_t index = chunk->count + j;
+            chunk->enabled[index / 64] |= (u64) 1 << (index % 64);
+        }
+
+        chunk->count += n;
+        archetype->current_index += n;
+        i += n;
+    }
+
+    ecs->structure_version++;
+    return first_column;
+}
+
+// Carries the ticks of a row over to the chunk a component is copied into.
+// Ticks only ever grow so the destination keeps its own changes too.
+static void chunk_merge_ticks(Chunk *dst, u32 dst_row, const Chunk *src, u32 src_row) {
+    if (dst->changed_ticks[dst_row] < src->changed_ticks[src_row]) {
+        dst->changed_ticks[dst_row] = src->changed_ticks[src_row];
+    }
+    if (dst->added_ticks[dst_row] < src->added_ticks[src_row]) {
+        dst->added_ticks[dst_row] = src->added_ticks[src_row];
+    }
+}
+
+// Marks a row written at the current tick, and added too when the entity
+// didn't have the component before.
+static void chunk_touch(ECS *ecs, Chunk *chunk, u32 row, b8 added) {
+    chunk->changed_ticks[row] = ecs->tick;
+    if (added) {
+        chunk->added_ticks[row] = ecs->tick;
+    }
+}
+
+static void chunk_write_enabled(Chunk *chunk, size_t index, b8 enabled) {
+    u64 bit = (u64) 1 << (index % 64);
+    if (enabled) {
+        chunk->enabled[index / 64] |= bit;
+    } else {
+        chunk->enabled[index / 64] &= ~bit;
+    }
+}
+
+void archetype_set_enabled(ECS *ecs, Archetype *archetype, size_t column, b8 enabled) {
+    Chunk *chunk = archetype_chunk(archetype, column);
+    size_t index = column % archetype->chunk_capacity;
+    if (chunk_enabled(chunk, index) == enabled) {
+        return;
+    }
+    chunk_write_enabled(chunk, index, enabled);
+    if (enabled) {
+        chunk->disabled--;
+    } else {
+        chunk->disabled++;
+    }
+    chunk->layout_tick = ecs->tick;
+    ecs->structure_version++;
+}
+
+// Moves the last column into 'column', releasing the last chunk once it's
+// empty.
+static void archetype_swap_remove(ECS *ecs, Archetype *archetype, size_t column) {
+    size_t last_column = archetype->current_index-1;
+    Chunk *chunk = archetype_chunk(archetype, column);
+    Chunk *last_chunk = archetype_chunk(archetype, last_column);
+    size_t index = column % archetype->chunk_capacity;
+    size_t last_index = last_column % archetype->chunk_capacity;
+    if (!chunk_enabled(chunk, index)) {
+        chunk->disabled--;
+    }
+    chunk->layout_tick = ecs->tick;
+    last_chunk->layout_tick = ecs->tick;
+
+    if (column != last_column) {
+        Entity last_entity = *archetype_entity(archetype, last_column);
+        *archetype_entity(archetype, column) = last_entity;
+        for (size_t i = 0; i < type_len(archetype->type); i++) {
+            if (chunk != last_chunk) {
+                chunk_merge_ticks(chunk, i, last_chunk, i);
+            }
+            if (archetype->row_sizes[i] == 0) {
+                continue;
+            }
+            memcpy(archetype_component(archetype, i, column),
+                    archetype_component(archetype, i, last_column),
+                    archetype->row_sizes[i]);
+        }
+        ecs->entity_records[(uint32_t) last_entity].index = column;
+
+        // The enabled bit follows the moved entity.
+        b8 enabled = chunk_enabled(last_chunk, last_index);
+        if (!enabled) {
+            last_chunk->disabled--;
+            chunk->disabled++;
+        }
+        chunk_write_enabled(chunk, index, enabled);
+    }
+    chunk_write_enabled(last_chunk, last_index, false);
+
+    archetype->current_index--;
+    if (archetype->current_index == 0) {
+        archetype->empty_since = ecs->compact_frame;
+    }
+    last_chunk->count--;
+    if (last_chunk->count == 0) {
+        archetype_pop_chunk(ecs, archetype);
+    }
+
+    ecs->structure_version++;
+}
+
+ArchetypeColumn archetype_add_entity(ECS *ecs, Archetype *archetype, Entity entity) {
+    size_t column = archetype_reserve(ecs, archetype, &entity, 1);
 
     return (ArchetypeColumn) {
         .archetype = archetype,
-        .index = index,
+        .index = column,
     };
 }
 
@@ -116,83 +476,357 @@ ArchetypeColumn archetype_add_entity(Archetype *archetype, Entity entity) {
 //     }
 // }
 
-static void archetype_move_entity(ECS *ecs, Archetype *current, Archetype *next, size_t current_column) {
-    // Swap place of the last entity and the one being moved.
-    Entity last_current_entity = hash_map_get(current->entity_lookup, current->current_index-1);
-    // It's crucial that we get the entity to move before doing all the swaping.
-    Entity entity_to_move = hash_map_get(current->entity_lookup, current_column);
+// Rows of 'src' that also exist in 'dst', i.e. every component copied when
+// an entity moves from one to the other.
+static Vec(ArchetypeRemap) archetype_remap_new(const Archetype *src, const Archetype *dst) {
+    Vec(ArchetypeRemap) remap = NULL;
+    for (size_t i = 0; i < type_len(dst->type); i++) {
+        u32 src_row = archetype_component_row(src, dst->type[i]);
+        if (src_row == ARCHETYPE_NO_ROW) {
+            continue;
+        }
+        vec_push(remap, ((ArchetypeRemap) {
+                .src_row = src_row,
+                .dst_row = i,
+                .src_offset = src->row_offsets[src_row],
+                .dst_offset = dst->row_offsets[i],
+                .size = dst->row_sizes[i],
+            }));
+    }
+    return remap;
+}
 
-    ArchetypeColumn column = {
-        .archetype = current,
-        .index = current_column,
-    };
-    hash_map_set(ecs->entity_map, last_current_entity, column);
-    hash_map_set(current->entity_lookup, current_column, last_current_entity);
-    hash_map_remove(current->entity_lookup, current->current_index-1);
-    current->current_index--;
-
-    // Place the entity in the next archetype.
-    size_t next_column = next->current_index++;
-    hash_map_insert(next->entity_lookup, next_column, entity_to_move);
-    column = (ArchetypeColumn) {
-        .archetype = next,
-        .index = next_column,
-    };
-    hash_map_set(ecs->entity_map, entity_to_move, column);
+// Moves an entity to the next archetype, copying the rows of 'remap'. Rows
+// of components only in the next archetype are left for the caller to
+// populate. Returns the column in the next archetype.
+static size_t archetype_move_entity(ECS *ecs, Archetype *current, Archetype *next, size_t current_column, const Vec(ArchetypeRemap) remap) {
+    Entity entity = *archetype_entity(current, current_column);
+    size_t next_column = archetype_reserve(ecs, next, &entity, 1);
 
-    // Move the entity storage to the next archetype.
-    if (type_len(current->type) < type_len(next->type)) {
-        for (size_t i = 0; i < type_len(current->type); i++) {
-            ComponentId comp = current->type[i];
-            size_t index = hash_map_get(next->component_lookup, comp);
-            size_t component_size = ecs->components[comp].size;
-            _vec_insert_fast(&next->storage[index], vec_len(next->storage[index]), current->storage[i] + component_size*current_column);
+    Chunk *next_chunk = archetype_chunk(next, next_column);
+    const Chunk *current_chunk = archetype_chunk(current, current_column);
+    size_t next_index = next_column % next->chunk_capacity;
+    size_t current_index = current_column % current->chunk_capacity;
+    if (!chunk_enabled(current_chunk, current_index)) {
+        archetype_set_enabled(ecs, next, next_column, false);
+    }
+    for (size_t i = 0; i < vec_len(remap); i++) {
+        ArchetypeRemap row = remap[i];
+        chunk_merge_ticks(next_chunk, row.dst_row, current_chunk, row.src_row);
+        if (row.size > 0) {
+            memcpy(next_chunk->data + row.dst_offset + row.size*next_index,
+                    current_chunk->data + row.src_offset + row.size*current_index,
+                    row.size);
         }
+    }
+
+    archetype_swap_remove(ecs, current, current_column);
+    return next_column;
+}
+
+Archetype *archetype_get_or_new(ECS *ecs, Type type) {
+    Signature signature = signature_from_type(type);
+    Archetype *archetype = archetype_find(ecs, &signature, signature_hash(&signature));
+    signature_free(&signature);
+    if (archetype == NULL) {
+        archetype = archetype_new(ecs, type);
+    }
+    return archetype;
+}
+
+// Archetype of 'archetype' with one component added or removed. Components
+// stored inline are probed for with a copy of the signature, only the
+// overflow needs the full type.
+static Archetype *archetype_neighbour(ECS *ecs, Archetype *archetype, ComponentId component, b8 add) {
+    if (component < SIGNATURE_WORDS*64) {
+        Signature signature = ecs->archetype_signatures[archetype->index];
+        if (add) {
+            signature.words[component / 64] |= (u64) 1 << (component % 64);
+        } else {
+            signature.words[component / 64] &= ~((u64) 1 << (component % 64));
+        }
+        Archetype *neighbour = archetype_find(ecs, &signature, signature_hash(&signature));
+        if (neighbour != NULL) {
+            return neighbour;
+        }
+    }
+
+    Type type = type_clone(archetype->type);
+    if (add) {
+        type_add(&type, component);
     } else {
-        for (size_t i = 0; i < type_len(next->type); i++) {
-            ComponentId comp = next->type[i];
-            size_t index = hash_map_get(current->component_lookup, comp);
-            size_t component_size = ecs->components[comp].size;
-            _vec_insert_fast(&next->storage[i], vec_len(next->storage[i]), current->storage[index] + component_size*next_column);
+        type_remove(&type, component);
+    }
+    Archetype *neighbour = archetype_get_or_new(ecs, type);
+    type_free(type);
+    return neighbour;
+}
+
+// Sorts the IDs of a bundle and drops duplicates. Returns the number of
+// unique IDs written to 'sorted'. For duplicates, 'order' keeps the index of
+// the last occurrence so that the last data given for a component wins.
+static size_t bundle_sort(const ComponentId *ids, size_t count, ComponentId *sorted, size_t *order) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t j = 0;
+        while (j < len && sorted[j] < ids[i]) {
+            j++;
+        }
+        if (j < len && sorted[j] == ids[i]) {
+            order[j] = i;
+            continue;
+        }
+        memmove(&sorted[j+1], &sorted[j], (len-j)*sizeof(ComponentId));
+        memmove(&order[j+1], &order[j], (len-j)*sizeof(size_t));
+        sorted[j] = ids[i];
+        order[j] = i;
+        len++;
+    }
+    return len;
+}
+
+static const ArchetypeBundleEdge *archetype_bundle_edge(ECS *ecs, Archetype *archetype, const ComponentId *sorted, size_t count, b8 add) {
+    for (size_t i = 0; i < vec_len(archetype->bundle_edges); i++) {
+        const ArchetypeBundleEdge *edge = &archetype->bundle_edges[i];
+        if (edge->add == add &&
+                type_len(edge->components) == count &&
+                memcmp(edge->components, sorted, count*sizeof(ComponentId)) == 0) {
+            return edge;
+        }
+    }
+
+    Type type = type_clone(archetype->type);
+    for (size_t i = 0; i < count; i++) {
+        if (add) {
+            type_add(&type, sorted[i]);
+        } else {
+            type_remove(&type, sorted[i]);
+        }
+    }
+    Archetype *next = archetype_get_or_new(ecs, type);
+    type_free(type);
+
+    Type components = NULL;
+    vec_insert_arr(components, 0, sorted, count);
+    vec_push(archetype->bundle_edges, ((ArchetypeBundleEdge) {
+            .components = components,
+            .add = add,
+            .archetype = next,
+            .remap = archetype_remap_new(archetype, next),
+        }));
+
+    return &archetype->bundle_edges[vec_len(archetype->bundle_edges)-1];
+}
+
+void archetype_move_entity_bundle(ECS *ecs, Entity entity, const ComponentId *remove, size_t remove_count, const ComponentData *add, size_t add_count) {
+    assert(remove_count <= MAX_BUNDLE_COMPONENTS);
+    assert(add_count <= MAX_BUNDLE_COMPONENTS);
+
+    ComponentId sorted_remove[MAX_BUNDLE_COMPONENTS];
+    size_t order[MAX_BUNDLE_COMPONENTS];
+    remove_count = bundle_sort(remove, remove_count, sorted_remove, order);
+
+    ComponentId ids[MAX_BUNDLE_COMPONENTS];
+    for (size_t i = 0; i < add_count; i++) {
+        ids[i] = add[i].id;
+    }
+    ComponentId sorted_add[MAX_BUNDLE_COMPONENTS];
+    add_count = bundle_sort(ids, add_count, sorted_add, order);
+
+    ArchetypeColumn record = ecs->entity_records[(uint32_t) entity];
+    Archetype *current = record.archetype;
+
+    for (size_t i = 0; current != NULL && i < remove_count; i++) {
+        u32 row = archetype_component_row(current, sorted_remove[i]);
+        if (row != ARCHETYPE_NO_ROW) {
+            _ecs_notify(ecs, OBSERVER_ON_REMOVE, sorted_remove[i], &entity, 1,
+                    archetype_component(current, row, record.index));
+        }
+    }
+
+    // Walk the bundle edges to the final archetype without moving the entity
+    // in between. A single edge has its remap cached, taking two needs one
+    // made for the occasion.
+    Archetype *next = current;
+    const ArchetypeBundleEdge *remove_edge = NULL;
+    const ArchetypeBundleEdge *add_edge = NULL;
+    if (next == NULL) {
+        next = ecs->root_archetype;
+    } else if (remove_count > 0) {
+        remove_edge = archetype_bundle_edge(ecs, next, sorted_remove, remove_count, false);
+        next = remove_edge->archetype;
+    }
+    if (add_count > 0) {
+        add_edge = archetype_bundle_edge(ecs, next, sorted_add, add_count, true);
+        next = add_edge->archetype;
+    }
+
+    size_t column = record.index;
+    if (current == NULL) {
+        column = archetype_reserve(ecs, next, &entity, 1);
+    } else if (next != current && add_edge == NULL) {
+        column = archetype_move_entity(ecs, current, next, column, remove_edge->remap);
+    } else if (next != current && remove_edge == NULL) {
+        column = archetype_move_entity(ecs, current, next, column, add_edge->remap);
+    } else if (next != current) {
+        Vec(ArchetypeRemap) remap = archetype_remap_new(current, next);
+        column = archetype_move_entity(ecs, current, next, column, remap);
+        vec_free(remap);
+    }
+
+    // Populates the rows of new components and overwrites the ones the entity
+    // already had.
+    Chunk *chunk = archetype_chunk(next, column);
+    b8 added[MAX_BUNDLE_COMPONENTS];
+    for (size_t i = 0; i < add_count; i++) {
+        u32 index = archetype_component_row(next, sorted_add[i]);
+        if (next->row_sizes[index] > 0) {
+            memcpy(archetype_component(next, index, column), add[order[i]].data, next->row_sizes[index]);
+        }
+        added[i] = current == NULL || archetype_component_row(current, sorted_add[i]) == ARCHETYPE_NO_ROW;
+        chunk_touch(ecs, chunk, index, added[i]);
+    }
+
+    // Observers only run once every component is in place.
+    for (size_t i = 0; i < add_count; i++) {
+        void *component = archetype_component(next, archetype_component_row(next, sorted_add[i]), column);
+        if (added[i]) {
+            _ecs_notify(ecs, OBSERVER_ON_ADD, sorted_add[i], &entity, 1, component);
+        }
+        _ecs_notify(ecs, OBSERVER_ON_SET, sorted_add[i], &entity, 1, component);
+    }
+}
+
+size_t archetype_spawn_rows(ECS *ecs, Archetype *archetype, const Entity *entities, size_t count, const ComponentColumn *columns) {
+    size_t first_column = archetype_reserve(ecs, archetype, entities, count);
+    size_t column_count = type_len(archetype->type);
+
+    // Copy each column one chunk at a time.
+    for (size_t i = 0; i < column_count; i++) {
+        ComponentColumn column = columns[i];
+        assert(column.id == archetype->type[i]);
+        size_t component_size = archetype->row_sizes[i];
+        const u8 *data = column.data;
+
+        size_t j = 0;
+        while (j < count) {
+            size_t chunk_column = (first_column + j) % archetype->chunk_capacity;
+            size_t n = archetype->chunk_capacity - chunk_column;
+            if (n > count - j) {
+                n = count - j;
+            }
+
+            // Tags only need their ticks.
+            chunk_touch(ecs, archetype_chunk(archetype, first_column + j), i, true);
+            u8 *dst = archetype_component(archetype, i, first_column + j);
+            if (component_size > 0 && column.fill) {
+                // Doubles the filled part of the row with every copy.
+                memcpy(dst, data, component_size);
+                for (size_t filled = 1; filled < n; filled *= 2) {
+                    size_t copy = filled < n - filled ? filled : n - filled;
+                    memcpy(dst + component_size*filled, dst, component_size*copy);
+                }
+            } else if (component_size > 0) {
+                memcpy(dst, data + component_size*j, component_size*n);
+            }
+            j += n;
         }
     }
 
-    // Remove the moved entity column and place the last entity column into the
-    // now empty column.
-    for (size_t i = 0; i < type_len(current->type); i++) {
-        _vec_remove_fast(&current->storage[i], current_column, NULL);
+    // Observers get the new entities one chunk run at a time, after every
+    // column is in place.
+    for (size_t i = 0; i < column_count; i++) {
+        ComponentId id = archetype->type[i];
+        b8 observed = vec_len(ecs->components[id].observers[OBSERVER_ON_ADD]) > 0 ||
+            vec_len(ecs->components[id].observers[OBSERVER_ON_SET]) > 0;
+        if (!observed) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < count) {
+            size_t chunk_column = (first_column + j) % archetype->chunk_capacity;
+            size_t n = archetype->chunk_capacity - chunk_column;
+            if (n > count - j) {
+                n = count - j;
+            }
+            const Entity *run = archetype_entity(archetype, first_column + j);
+            void *components = archetype_component(archetype, i, first_column + j);
+            _ecs_notify(ecs, OBSERVER_ON_ADD, id, run, n, components);
+            _ecs_notify(ecs, OBSERVER_ON_SET, id, run, n, components);
+            j += n;
+        }
     }
+
+    return first_column;
+}
+
+void archetype_spawn_batch(ECS *ecs, const Entity *entities, size_t count, const ComponentColumn *columns, size_t column_count) {
+    assert(column_count <= MAX_BUNDLE_COMPONENTS);
+
+    ComponentId ids[MAX_BUNDLE_COMPONENTS];
+    for (size_t i = 0; i < column_count; i++) {
+        ids[i] = columns[i].id;
+    }
+    ComponentId sorted[MAX_BUNDLE_COMPONENTS];
+    size_t order[MAX_BUNDLE_COMPONENTS];
+    column_count = bundle_sort(ids, column_count, sorted, order);
+
+    // Going through the root archetype's bundle edges caches the lookup for
+    // every following batch of the same components.
+    Archetype *archetype = archetype_bundle_edge(ecs, ecs->root_archetype, sorted, column_count, true)->archetype;
+
+    ComponentColumn rows[MAX_BUNDLE_COMPONENTS];
+    for (size_t i = 0; i < column_count; i++) {
+        rows[i] = columns[order[i]];
+    }
+    archetype_spawn_rows(ecs, archetype, entities, count, rows);
+}
+
+// Links two archetypes differing by a single component in both directions.
+static ArchetypeEdge archetype_edge_new(Archetype *left, Archetype *right, ComponentId component_id) {
+    ArchetypeEdge edge = {
+        .add = right,
+        .remove = left,
+        .add_remap = archetype_remap_new(left, right),
+        .remove_remap = archetype_remap_new(right, left),
+    };
+    hash_map_insert(left->edge_map, component_id, edge);
+    hash_map_insert(right->edge_map, component_id, edge);
+    left->edge_count++;
+    right->edge_count++;
+    return edge;
 }
 
 void archetype_move_entity_right(ECS *ecs, Archetype *left, const void *component_data, ComponentId component_id, size_t left_column) {
+    // Adding a component the entity already has overwrites it.
+    u32 row = archetype_component_row(left, component_id);
+    if (row != ARCHETYPE_NO_ROW) {
+        void *component = archetype_component(left, row, left_column);
+        if (left->row_sizes[row] > 0) {
+            memcpy(component, component_data, left->row_sizes[row]);
+        }
+        chunk_touch(ecs, archetype_chunk(left, left_column), row, false);
+        _ecs_notify(ecs, OBSERVER_ON_SET, component_id, archetype_entity(left, left_column), 1, component);
+        return;
+    }
+
     ArchetypeEdge edge = hash_map_get(left->edge_map, component_id);
-    Archetype *right = edge.add;
     if (edge.add == NULL) {
-        Type right_type = type_clone(left->type);
-        type_add(right_type, component_id);
-        right = hash_map_get(ecs->archetype_map, right_type);
-        if (right == NULL) {
-            right = archetype_new(ecs, right_type);
-            hash_map_insert(ecs->archetype_map, right->type, right);
-        }
-        type_free(right_type);
-
-        ArchetypeEdge edge = {
-            .add = right,
-            .remove = left,
-        };
-        hash_map_insert(left->edge_map, component_id, edge);
-        hash_map_insert(right->edge_map, component_id, edge);
-
-        // create_edges(ecs->archetypes[0], new_archetype);
-    } else {
+        edge = archetype_edge_new(left, archetype_neighbour(ecs, left, component_id, true), component_id);
     }
+    Archetype *right = edge.add;
 
-    archetype_move_entity(ecs, left, right, left_column);
+    size_t right_column = archetype_move_entity(ecs, left, right, left_column, edge.add_remap);
 
     // Populate the empty row with data of the component being added.
-    size_t index = hash_map_get(right->component_lookup, component_id);
-    _vec_insert_fast(&right->storage[index], vec_len(right->storage[index]), component_data);
+    size_t index = archetype_component_row(right, component_id);
+    void *component = archetype_component(right, index, right_column);
+    if (right->row_sizes[index] > 0) {
+        memcpy(component, component_data, right->row_sizes[index]);
+    }
+    chunk_touch(ecs, archetype_chunk(right, right_column), index, true);
+    _ecs_notify(ecs, OBSERVER_ON_ADD, component_id, archetype_entity(right, right_column), 1, component);
+    _ecs_notify(ecs, OBSERVER_ON_SET, component_id, archetype_entity(right, right_column), 1, component);
 
     // printf("-- MOVE ------------------------------------------------------------------------\n");
     // archetype_inspect(left);
@@ -201,46 +835,21 @@ void archetype_move_entity_right(ECS *ecs, Archetype *left, const void *componen
 }
 
 void archetype_move_entity_left(ECS *ecs, Archetype *right, ComponentId component_id, size_t right_column) {
+    u32 row = archetype_component_row(right, component_id);
+    if (row == ARCHETYPE_NO_ROW) {
+        return;
+    }
+    _ecs_notify(ecs, OBSERVER_ON_REMOVE, component_id, archetype_entity(right, right_column), 1,
+            archetype_component(right, row, right_column));
+
     ArchetypeEdge edge = hash_map_get(right->edge_map, component_id);
-    Archetype *left = edge.remove;
     if (edge.add == NULL) {
-        Type left_type = type_clone(right->type);
-        type_remove(left_type, component_id);
-        left = hash_map_get(ecs->archetype_map, left_type);
-        if (left == NULL) {
-            left = archetype_new(ecs, left_type);
-            hash_map_insert(ecs->archetype_map, left->type, left);
-        }
-        type_free(left_type);
-
-        ArchetypeEdge edge = {
-            .add = right,
-            .remove = left,
-        };
-        hash_map_insert(left->edge_map, component_id, edge);
-        hash_map_insert(right->edge_map, component_id, edge);
-
-        // create_edges(ecs->archetypes[0], new_archetype);
+        edge = archetype_edge_new(archetype_neighbour(ecs, right, component_id, false), right, component_id);
     }
 
-    archetype_move_entity(ecs, right, left, right_column);
+    archetype_move_entity(ecs, right, edge.remove, right_column, edge.remove_remap);
 }
 
 void archetype_remove_entity(ECS *ecs, Archetype *archetype, size_t column) {
-    // Swap place of the last entity and the one being removed.
-    Entity last_entity = hash_map_get(archetype->entity_lookup, archetype->current_index-1);
-    ArchetypeColumn new_column = {
-        .archetype = archetype,
-        .index = column,
-    };
-    hash_map_set(ecs->entity_map, last_entity, new_column);
-    hash_map_set(archetype->entity_lookup, column, last_entity);
-    hash_map_remove(archetype->entity_lookup, archetype->current_index-1);
-    archetype->current_index--;
-
-    // Remove the moved entity column and place the last entity column into the
-    // now empty column.
-    for (size_t i = 0; i < type_len(archetype->type); i++) {
-        _vec_remove_fast(&archetype->storage[i], column, NULL);
-    }
+    archetype_swap_remove(ecs, archetype, column);
 }
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include "ecs.h"
 #include "core.h"
 #include "internal.h"
@@ -5,10 +7,15 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "ds.h"
 #include "str.h"
 
+// Builtin components have the same ID in every world. Their handles are
+// constant, 'ecs_new()' registers them without writing to them.
+ComponentId _ecs_component_Prefab = 0;
+
 ECS *ecs_new(void) {
     ECS *ecs = malloc(sizeof(ECS));
     *ecs = (ECS) {0};
@@ -20,81 +27,379 @@ ECS *ecs_new(void) {
     component_map_desc.zero_value = &null_component;
     hash_map_new(ecs->component_map, component_map_desc);
 
-    HashMapDesc archetype_map_desc = hash_map_desc_default(ecs->archetype_map);
-    archetype_map_desc.cmp = type_cmp;
-    archetype_map_desc.hash = type_hash;
-    hash_map_new(ecs->archetype_map, archetype_map_desc);
-
+    // Tick 0 stands for never, ticks of queries that haven't run yet.
+    ecs->tick = 1;
     ecs->root_archetype = archetype_new(ecs, NULL);
-    hash_map_insert(ecs->archetype_map, NULL, ecs->root_archetype);
+    // Builtin components come first so their IDs are the same in every
+    // world.
+    ComponentId prefab = _ecs_register_component(ecs, str_lit("Prefab"), 0, COMPONENT_STORAGE_TABLE);
+    assert(prefab == _ecs_component_Prefab);
+    (void) prefab;
+
+    pthread_mutex_init(&ecs->entity_lock, NULL);
+    ecs->worker_count = thread_pool_cpu_count() - 1;
+
+    return ecs;
+}
 
+ECS *ecs_new_staging(void) {
+    ECS *ecs = ecs_new();
+    ecs->entity_generation_tag = ENTITY_GENERATION_STAGED;
     return ecs;
 }
 
 void ecs_free(ECS *ecs) {
     hash_map_free(ecs->component_map);
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        sparse_set_free(&ecs->components[ecs->sparse_components[i]].sparse);
+    }
+    for (size_t i = 0; i < vec_len(ecs->components); i++) {
+        for (size_t j = 0; j < OBSERVER_EVENT_COUNT; j++) {
+            vec_free(ecs->components[i].observers[j]);
+        }
+    }
     vec_free(ecs->components);
+    vec_free(ecs->sparse_components);
 
-    for (size_t i = hash_map_iter_new(ecs->archetype_map);
-            hash_map_iter_valid(ecs->archetype_map, i);
-            i = hash_map_iter_next(ecs->archetype_map, i)) {
-        archetype_free(ecs->archetype_map[i].value);
+    rollback_free(ecs);
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        archetype_free(ecs->archetypes[i]);
+        signature_free(&ecs->archetype_signatures[i]);
     }
-    hash_map_free(ecs->archetype_map);
+    vec_free(ecs->archetypes);
+    vec_free(ecs->archetype_signatures);
+    vec_free(ecs->archetype_table);
+    for (size_t i = 0; i < vec_len(ecs->chunk_pool); i++) {
+        free(ecs->chunk_pool[i]);
+    }
+    vec_free(ecs->chunk_pool);
 
-    hash_map_free(ecs->entity_map);
+    vec_free(ecs->entity_records);
     vec_free(ecs->entity_generation);
     vec_free(ecs->entity_free_list);
+    pthread_mutex_destroy(&ecs->entity_lock);
 
-    for (size_t i = hash_map_iter_new(ecs->component_archetype_set_map);
-            hash_map_iter_valid(ecs->component_archetype_set_map, i);
-            i = hash_map_iter_next(ecs->component_archetype_set_map, i)) {
-        hash_set_free(ecs->component_archetype_set_map[i].value);
+    for (size_t i = 0; i < vec_len(ecs->query_caches); i++) {
+        query_cache_free(ecs->query_caches[i]);
     }
-    hash_map_free(ecs->component_archetype_set_map);
+    vec_free(ecs->query_caches);
 
     for (size_t i = 0; i < vec_len(ecs->systems); i++) {
+        for (size_t j = 0; j < vec_len(ecs->systems[i]); j++) {
+            InternalSystem *system = &ecs->systems[i][j];
+            vec_free(system->dependents);
+            vec_free(system->ranges);
+            for (size_t k = 0; k < vec_len(system->commands); k++) {
+                vec_free(system->commands[k].commands);
+                free(system->commands[k].arena);
+            }
+            vec_free(system->commands);
+        }
         vec_free(ecs->systems[i]);
     }
+    vec_free(ecs->systems);
+    vec_free(ecs->systems_ready);
+    if (ecs->thread_pool != NULL) {
+        thread_pool_free(ecs->thread_pool);
+    }
+
+    vec_free(ecs->command_buffer.commands);
+    free(ecs->command_buffer.arena);
+    vec_free(ecs->playback_buffer.commands);
+    free(ecs->playback_buffer.arena);
+    vec_free(ecs->pending_lookup);
+    vec_free(ecs->pending);
+    vec_free(ecs->pending_add);
+    vec_free(ecs->pending_remove);
 
     free(ecs);
 }
 
-void _ecs_register_component(ECS *ecs, Str component_name, size_t component_size) {
-    hash_map_insert(ecs->component_map, component_name, vec_len(ecs->components));
+ComponentId _ecs_register_component(ECS *ecs, Str component_name, size_t component_size, ComponentStorage storage) {
+    ComponentId id = vec_len(ecs->components);
+    hash_map_insert(ecs->component_map, component_name, id);
     Component comp = {
+        .name = component_name,
         .size = component_size,
+        .storage = storage,
+        .sparse = {
+            .component_size = component_size,
+        },
     };
     vec_push(ecs->components, comp);
+    if (storage == COMPONENT_STORAGE_SPARSE) {
+        vec_push(ecs->sparse_components, id);
+    }
+    return id;
+}
+
+ComponentId _ecs_register_component_handle(ECS *ecs, ComponentId *handle, Str component_name, size_t component_size, ComponentStorage storage) {
+    ComponentId id = _ecs_register_component(ecs, component_name, component_size, storage);
+    // Only the first world registering a component writes its handle, the
+    // others read it.
+    if (*handle == (ComponentId) -1) {
+        *handle = id;
+    }
+    assert(*handle == id && "Component registered in a different order than in another world.");
+    return id;
+}
+
+static b8 _ecs_component_sparse(ECS *ecs, ComponentId component_id) {
+    return ecs->components[component_id].storage == COMPONENT_STORAGE_SPARSE;
+}
+
+void ecs_register_observer(ECS *ecs, Observer observer, ObserverEvent event, ComponentId component, void *user_ptr) {
+    assert(component < vec_len(ecs->components) && "Observe non-existent component.");
+    assert(event < OBSERVER_EVENT_COUNT);
+    vec_push(ecs->components[component].observers[event], ((ComponentObserver) {
+            .func = observer,
+            .user_ptr = user_ptr,
+        }));
+}
+
+void _ecs_notify_observers(ECS *ecs, ObserverEvent event, ComponentId component, const Entity *entities, size_t count, void *components) {
+    ObserverIter iter = {
+        .event = event,
+        .component = component,
+        .count = count,
+        .entities = entities,
+        .components = components,
+    };
+
+    // Whatever the observers do is deferred until the change that triggered
+    // them is complete. They may register more observers, so the vector is
+    // looked up again every time.
+    ecs->active_queries++;
+    for (size_t i = 0; i < vec_len(ecs->components[component].observers[event]); i++) {
+        ComponentObserver observer = ecs->components[component].observers[event][i];
+        observer.func(ecs, iter, observer.user_ptr);
+    }
+    ecs->active_queries--;
+}
+
+// Plays back what observers deferred during a direct change.
+static void _ecs_flush_observers(ECS *ecs) {
+    if (ecs->active_queries == 0 && vec_len(ecs->command_buffer.commands) > 0) {
+        _ecs_process_command_queue(ecs);
+    }
+}
+
+void _ecs_sparse_insert(ECS *ecs, ComponentId component_id, Entity entity, const void *data) {
+    SparseSet *set = &ecs->components[component_id].sparse;
+    b8 added = sparse_set_index(set, entity) == SPARSE_SET_NONE;
+    sparse_set_insert(set, entity, data, ecs->tick);
+
+    Component *component = &ecs->components[component_id];
+    if (vec_len(component->observers[OBSERVER_ON_ADD]) == 0 && vec_len(component->observers[OBSERVER_ON_SET]) == 0) {
+        return;
+    }
+    void *stored = sparse_set_component(set, sparse_set_index(set, entity));
+    if (added) {
+        _ecs_notify(ecs, OBSERVER_ON_ADD, component_id, &entity, 1, stored);
+    }
+    _ecs_notify(ecs, OBSERVER_ON_SET, component_id, &entity, 1, stored);
+}
+
+static void _ecs_sparse_remove(ECS *ecs, ComponentId component_id, Entity entity) {
+    SparseSet *set = &ecs->components[component_id].sparse;
+    if (vec_len(ecs->components[component_id].observers[OBSERVER_ON_REMOVE]) > 0) {
+        u32 index = sparse_set_index(set, entity);
+        if (index == SPARSE_SET_NONE) {
+            return;
+        }
+        _ecs_notify(ecs, OBSERVER_ON_REMOVE, component_id, &entity, 1, sparse_set_component(set, index));
+    }
+    sparse_set_remove(set, entity);
+}
+
+// Applies a bundle, sparse components going straight to their sets and the
+// rest through a single archetype transition. The transition also places an
+// entity that hasn't been yet.
+static void _ecs_move_entity_bundle(ECS *ecs, Entity entity, const ComponentId *remove, size_t remove_count, const ComponentData *add, size_t add_count) {
+    if (vec_len(ecs->sparse_components) == 0) {
+        archetype_move_entity_bundle(ecs, entity, remove, remove_count, add, add_count);
+        return;
+    }
+
+    ComponentId table_remove[MAX_BUNDLE_COMPONENTS];
+    size_t table_remove_count = 0;
+    for (size_t i = 0; i < remove_count; i++) {
+        if (!_ecs_component_sparse(ecs, remove[i])) {
+            table_remove[table_remove_count++] = remove[i];
+        }
+    }
+    ComponentData table_add[MAX_BUNDLE_COMPONENTS];
+    size_t table_add_count = 0;
+    for (size_t i = 0; i < add_count; i++) {
+        if (!_ecs_component_sparse(ecs, add[i].id)) {
+            table_add[table_add_count++] = add[i];
+        }
+    }
+
+    ArchetypeColumn record = ecs->entity_records[(uint32_t) entity];
+    if (record.archetype == NULL || table_remove_count > 0 || table_add_count > 0) {
+        archetype_move_entity_bundle(ecs, entity, table_remove, table_remove_count, table_add, table_add_count);
+    }
+
+    for (size_t i = 0; i < remove_count; i++) {
+        if (_ecs_component_sparse(ecs, remove[i])) {
+            _ecs_sparse_remove(ecs, remove[i], entity);
+        }
+    }
+    for (size_t i = 0; i < add_count; i++) {
+        if (_ecs_component_sparse(ecs, add[i].id)) {
+            _ecs_sparse_insert(ecs, add[i].id, entity, add[i].data);
+        }
+    }
+}
+
+// Places a batch in the archetype of its table columns and copies every
+// sparse column into its set.
+static void _ecs_spawn_batch(ECS *ecs, const Entity *entities, size_t count, const ComponentColumn *columns, size_t column_count) {
+    if (vec_len(ecs->sparse_components) == 0) {
+        archetype_spawn_batch(ecs, entities, count, columns, column_count);
+        return;
+    }
+
+    assert(column_count <= MAX_BUNDLE_COMPONENTS);
+    ComponentColumn table_columns[MAX_BUNDLE_COMPONENTS] = {0};
+    size_t table_column_count = 0;
+    for (size_t i = 0; i < column_count; i++) {
+        if (!_ecs_component_sparse(ecs, columns[i].id)) {
+            table_columns[table_column_count++] = columns[i];
+        }
+    }
+    archetype_spawn_batch(ecs, entities, count, table_columns, table_column_count);
+
+    for (size_t i = 0; i < column_count; i++) {
+        if (!_ecs_component_sparse(ecs, columns[i].id)) {
+            continue;
+        }
+        size_t component_size = ecs->components[columns[i].id].size;
+        const u8 *data = columns[i].data;
+        for (size_t j = 0; j < count; j++) {
+            _ecs_sparse_insert(ecs, columns[i].id, entities[j], columns[i].fill ? data : data + component_size*j);
+        }
+    }
 }
 
 Entity _ecs_id(ECS *ecs, Str component_name) {
     return hash_map_get(ecs->component_map, component_name);
 }
 
+#define COMMAND_ARENA_ALIGN 16
+
+// Reserves 'size' bytes in the arena of a command buffer and returns their
+// offset.
+static size_t _ecs_command_alloc(CommandBuffer *buffer, size_t size) {
+    size_t offset = (buffer->arena_size + COMMAND_ARENA_ALIGN-1) & ~(size_t) (COMMAND_ARENA_ALIGN-1);
+    if (offset + size > buffer->arena_capacity) {
+        size_t capacity = buffer->arena_capacity > 0 ? buffer->arena_capacity : 4096;
+        while (capacity < offset + size) {
+            capacity *= 2;
+        }
+        buffer->arena = realloc(buffer->arena, capacity);
+        buffer->arena_capacity = capacity;
+    }
+    buffer->arena_size = offset + size;
+    return offset;
+}
+
+// Systems running in parallel record into their own buffer.
+static __thread CommandBuffer *_ecs_thread_command_buffer;
+
+static CommandBuffer *_ecs_command_buffer(ECS *ecs) {
+    if (_ecs_thread_command_buffer != NULL) {
+        return _ecs_thread_command_buffer;
+    }
+    return &ecs->command_buffer;
+}
+
+static void _ecs_command_push(ECS *ecs, CommandType type, Entity entity, ComponentId component_id, size_t offset) {
+    vec_push(_ecs_command_buffer(ecs)->commands, ((Command) {
+            .type = type,
+            .entity = entity,
+            .component_id = component_id,
+            .offset = offset,
+        }));
+}
+
+static void _ecs_command_add(ECS *ecs, Entity entity, ComponentId component_id, const void *data) {
+    CommandBuffer *buffer = _ecs_command_buffer(ecs);
+    size_t component_size = ecs->components[component_id].size;
+    size_t offset = _ecs_command_alloc(buffer, component_size);
+    if (component_size > 0) {
+        memcpy(&buffer->arena[offset], data, component_size);
+    }
+    _ecs_command_push(ecs, COMMAND_ENTITY_COMPONENT_ADD, entity, component_id, offset);
+}
+
 static void _ecs_internal_entity_spawn(ECS *ecs, Entity id) {
-    ArchetypeColumn column = archetype_add_entity(ecs->root_archetype, id);
-    hash_map_insert(ecs->entity_map, id, column);
+    archetype_add_entity(ecs, ecs->root_archetype, id);
 }
 
-Entity ecs_entity(ECS *ecs) {
-    uint32_t index = 0;
-    uint32_t generation = 0;
-    if (vec_len(ecs->entity_free_list) > 0) {
-        index = vec_pop(ecs->entity_free_list);
-        generation = ecs->entity_generation[index];
-    } else {
-        index = ecs->entity_current_id++;
-        vec_push(ecs->entity_generation, 0);
+// Allocates IDs for 'count' entities, recycling freed indices first. The
+// entities aren't placed in any archetype.
+void _ecs_allocate_entities(ECS *ecs, Entity *entities, size_t count) {
+    if (ecs->parallel) {
+        pthread_mutex_lock(&ecs->entity_lock);
+        size_t i = 0;
+        for (; i < count && vec_len(ecs->entity_free_list) > 0; i++) {
+            uint32_t index = vec_pop(ecs->entity_free_list);
+            uint32_t generation = ecs->entity_generation[index];
+            entities[i] = index | (uint64_t) generation << 32;
+        }
+        for (; i < count; i++) {
+            entities[i] = (ecs->entity_current_id + ecs->entity_reserved_count++) |
+                (uint64_t) ecs->entity_generation_tag << 32;
+        }
+        pthread_mutex_unlock(&ecs->entity_lock);
+        return;
+    }
+
+    size_t i = 0;
+    for (; i < count && vec_len(ecs->entity_free_list) > 0; i++) {
+        uint32_t index = vec_pop(ecs->entity_free_list);
+        uint32_t generation = ecs->entity_generation[index];
+        entities[i] = index | (uint64_t) generation << 32;
+    }
+
+    for (; i < count; i++) {
+        uint32_t index = ecs->entity_current_id++;
+        vec_push(ecs->entity_generation, ecs->entity_generation_tag);
+        vec_push(ecs->entity_records, ((ArchetypeColumn) {0}));
+        entities[i] = index | (uint64_t) ecs->entity_generation_tag << 32;
+    }
+}
+
+// Gives the entities reserved during a parallel run their slot in the entity
+// vectors.
+static void _ecs_commit_reserved_entities(ECS *ecs) {
+    for (uint32_t i = 0; i < ecs->entity_reserved_count; i++) {
+        vec_push(ecs->entity_generation, ecs->entity_generation_tag);
+        vec_push(ecs->entity_records, ((ArchetypeColumn) {0}));
+    }
+    ecs->entity_current_id += ecs->entity_reserved_count;
+    ecs->entity_reserved_count = 0;
+}
+
+// Checks the generation of an entity that commands are recorded for, which
+// may be one reserved during a parallel run.
+static b8 _ecs_entity_valid(ECS *ecs, Entity entity) {
+    uint32_t index = entity;
+    uint32_t generation = entity >> 32;
+    if (index >= ecs->entity_current_id) {
+        return generation == ecs->entity_generation_tag;
     }
+    return ecs->entity_generation[index] == generation;
+}
 
-    Entity id = index | (uint64_t) generation << 32;
+Entity ecs_entity(ECS *ecs) {
+    Entity id;
+    _ecs_allocate_entities(ecs, &id, 1);
 
     if (ecs->active_queries > 0) {
-        vec_push(ecs->command_queue, ((Command) {
-                .type = COMMAND_ENTITY_SPAWN,
-                .entity = id,
-            }));
+        _ecs_command_push(ecs, COMMAND_ENTITY_SPAWN, id, 0, 0);
     } else {
         _ecs_internal_entity_spawn(ecs, id);
     }
@@ -102,6 +407,60 @@ Entity ecs_entity(ECS *ecs) {
     return id;
 }
 
+void ecs_spawn_batch_id(ECS *ecs, size_t count, Entity *out_entities, const ComponentColumn *columns, size_t column_count) {
+    if (count == 0) {
+        return;
+    }
+
+    if (ecs->active_queries > 0) {
+        CommandBuffer *buffer = _ecs_command_buffer(ecs);
+        size_t offset = _ecs_command_alloc(buffer, sizeof(SpawnBatch) + sizeof(Entity)*count + sizeof(SpawnBatchColumn)*column_count);
+        *(SpawnBatch *) &buffer->arena[offset] = (SpawnBatch) {
+            .count = count,
+            .column_count = column_count,
+        };
+
+        Entity *entities = (Entity *) &buffer->arena[offset + sizeof(SpawnBatch)];
+        _ecs_allocate_entities(ecs, entities, count);
+        if (out_entities != NULL) {
+            memcpy(out_entities, entities, sizeof(Entity)*count);
+        }
+
+        for (size_t i = 0; i < column_count; i++) {
+            assert(columns[i].id < vec_len(ecs->components) && "Spawn with non-existent component.");
+            size_t component_size = ecs->components[columns[i].id].size;
+            size_t column_size = columns[i].fill ? component_size : component_size*count;
+            size_t data_offset = _ecs_command_alloc(buffer, column_size);
+            if (column_size > 0) {
+                memcpy(&buffer->arena[data_offset], columns[i].data, column_size);
+            }
+
+            // The arena may have moved.
+            SpawnBatchColumn *batch_columns = (SpawnBatchColumn *) &buffer->arena[offset + sizeof(SpawnBatch) + sizeof(Entity)*count];
+            batch_columns[i] = (SpawnBatchColumn) {
+                .id = columns[i].id,
+                .fill = columns[i].fill,
+                .offset = data_offset - offset,
+            };
+        }
+
+        _ecs_command_push(ecs, COMMAND_ENTITY_SPAWN_BATCH, 0, 0, offset);
+    } else {
+        Entity *entities = out_entities;
+        if (entities == NULL) {
+            entities = malloc(sizeof(Entity)*count);
+        }
+
+        _ecs_allocate_entities(ecs, entities, count);
+        _ecs_spawn_batch(ecs, entities, count, columns, column_count);
+
+        if (out_entities == NULL) {
+            free(entities);
+        }
+        _ecs_flush_observers(ecs);
+    }
+}
+
 static void _ecs_internal_kill(ECS *ecs, Entity entity) {
     if (!entity_alive(ecs, entity)) {
         return;
@@ -109,107 +468,346 @@ static void _ecs_internal_kill(ECS *ecs, Entity entity) {
 
     uint32_t index = entity;
 
-    ecs->entity_generation[index]++;
+    // Observers still see the entity alive with all of its components.
+    ArchetypeColumn column = ecs->entity_records[index];
+    if (column.archetype != NULL) {
+        for (size_t i = 0; i < type_len(column.archetype->type); i++) {
+            _ecs_notify(ecs, OBSERVER_ON_REMOVE, column.archetype->type[i], &entity, 1,
+                    archetype_component(column.archetype, i, column.index));
+        }
+    }
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        _ecs_sparse_remove(ecs, ecs->sparse_components[i], entity);
+    }
+
+    ecs->entity_generation[index] = (ecs->entity_generation[index] + 1) | ecs->entity_generation_tag;
     vec_push(ecs->entity_free_list, index);
 
-    HashMapIter iter = hash_map_remove(ecs->entity_map, entity);
-    ArchetypeColumn column = ecs->entity_map[iter].value;
-    archetype_remove_entity(ecs, column.archetype, column.index);
+    // A deferred spawn may be killed before ever being placed.
+    if (column.archetype != NULL) {
+        archetype_remove_entity(ecs, column.archetype, column.index);
+    }
+    ecs->entity_records[index] = (ArchetypeColumn) {0};
 }
 
-void ecs_entity_kill(ECS *ecs, Entity entity) {
-    if (!entity_alive(ecs, entity)) {
+static void _ecs_internal_set_enabled(ECS *ecs, Entity entity, b8 enabled) {
+    ArchetypeColumn *column = _ecs_entity_record(ecs, entity);
+    if (column != NULL) {
+        archetype_set_enabled(ecs, column->archetype, column->index, enabled);
+    }
+}
+
+void ecs_entity_set_enabled(ECS *ecs, Entity entity, b8 enabled) {
+    if (!_ecs_entity_valid(ecs, entity)) {
         return;
     }
 
-    uint32_t index = entity;
-    uint32_t generation = entity >> 32;
-    assert(ecs->entity_generation[index] == generation);
+    if (ecs->active_queries > 0) {
+        _ecs_command_push(ecs, COMMAND_ENTITY_SET_ENABLED, entity, enabled, 0);
+    } else {
+        _ecs_internal_set_enabled(ecs, entity, enabled);
+    }
+}
+
+b8 entity_enabled(ECS *ecs, Entity entity) {
+    ArchetypeColumn *column = _ecs_entity_record(ecs, entity);
+    if (column == NULL) {
+        return false;
+    }
+    return chunk_enabled(archetype_chunk(column->archetype, column->index),
+            column->index % column->archetype->chunk_capacity);
+}
+
+void ecs_entity_kill(ECS *ecs, Entity entity) {
+    if (!_ecs_entity_valid(ecs, entity)) {
+        return;
+    }
 
     if (ecs->active_queries > 0) {
-        vec_push(ecs->command_queue, ((Command) {
-                .type = COMMAND_ENTITY_KILL,
-                .entity = entity,
-            }));
+        _ecs_command_push(ecs, COMMAND_ENTITY_KILL, entity, 0, 0);
     } else {
         _ecs_internal_kill(ecs, entity);
+        _ecs_flush_observers(ecs);
+    }
+}
+
+Entity ecs_prefab(ECS *ecs) {
+    Entity prefab = ecs_entity(ecs);
+    entity_add_tag(ecs, prefab, Prefab);
+    return prefab;
+}
+
+// Spawns already allocated entities as copies of a prefab. Its components
+// become fill columns of a single batch, reading straight from the prefab.
+static void _ecs_instantiate(ECS *ecs, Entity prefab, const Entity *entities, size_t count, PrefabOverride override, const void *user_data) {
+    ArchetypeColumn *record = _ecs_entity_record(ecs, prefab);
+    if (record == NULL) {
+        log_error("Instantiating stale or unplaced prefab: %zu, %u, %u", prefab, (u32) prefab, (u32) (prefab >> 32));
+        for (size_t i = 0; i < count; i++) {
+            _ecs_internal_kill(ecs, entities[i]);
+        }
+        return;
+    }
+
+    const Archetype *archetype = record->archetype;
+    ComponentColumn columns[MAX_BUNDLE_COMPONENTS];
+    size_t column_count = 0;
+    for (size_t i = 0; i < type_len(archetype->type); i++) {
+        if (archetype->type[i] == _ecs_component_Prefab) {
+            continue;
+        }
+        assert(column_count < MAX_BUNDLE_COMPONENTS);
+        columns[column_count++] = (ComponentColumn) {
+            .id = archetype->type[i],
+            .data = archetype_component(archetype, i, record->index),
+            .fill = true,
+        };
+    }
+
+    // Sparse components are copied out first as filling their own set may
+    // move them.
+    size_t sparse_size = 0;
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        const SparseSet *set = &ecs->components[ecs->sparse_components[i]].sparse;
+        if (sparse_set_index(set, prefab) != SPARSE_SET_NONE) {
+            sparse_size += set->component_size;
+        }
+    }
+    u8 *sparse_data = sparse_size > 0 ? malloc(sparse_size) : NULL;
+    size_t sparse_offset = 0;
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        ComponentId id = ecs->sparse_components[i];
+        const SparseSet *set = &ecs->components[id].sparse;
+        u32 index = sparse_set_index(set, prefab);
+        if (index == SPARSE_SET_NONE) {
+            continue;
+        }
+        assert(column_count < MAX_BUNDLE_COMPONENTS);
+        if (set->component_size > 0) {
+            memcpy(sparse_data + sparse_offset, sparse_set_component(set, index), set->component_size);
+        }
+        columns[column_count++] = (ComponentColumn) {
+            .id = id,
+            .data = sparse_data + sparse_offset,
+            .fill = true,
+        };
+        sparse_offset += set->component_size;
+    }
+
+    _ecs_spawn_batch(ecs, entities, count, columns, column_count);
+    free(sparse_data);
+
+    if (override != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            override(ecs, entities[i], i, user_data);
+        }
+    }
+}
+
+void ecs_instantiate_with(ECS *ecs, Entity prefab, size_t count, Entity *out_entities, PrefabOverride override, const void *user_data, size_t user_data_size) {
+    if (count == 0) {
+        return;
+    }
+
+    if (ecs->active_queries > 0) {
+        CommandBuffer *buffer = _ecs_command_buffer(ecs);
+        size_t offset = _ecs_command_alloc(buffer, sizeof(PrefabInstantiate) + sizeof(Entity)*count);
+        Entity *entities = (Entity *) &buffer->arena[offset + sizeof(PrefabInstantiate)];
+        _ecs_allocate_entities(ecs, entities, count);
+        if (out_entities != NULL) {
+            memcpy(out_entities, entities, sizeof(Entity)*count);
+        }
+
+        size_t user_data_offset = _ecs_command_alloc(buffer, user_data_size);
+        if (user_data_size > 0) {
+            memcpy(&buffer->arena[user_data_offset], user_data, user_data_size);
+        }
+
+        // The arena may have moved.
+        *(PrefabInstantiate *) &buffer->arena[offset] = (PrefabInstantiate) {
+            .prefab = prefab,
+            .count = count,
+            .override = override,
+            .user_data_offset = user_data_offset - offset,
+        };
+
+        _ecs_command_push(ecs, COMMAND_ENTITY_INSTANTIATE, 0, 0, offset);
+    } else {
+        Entity *entities = out_entities;
+        if (entities == NULL) {
+            entities = malloc(sizeof(Entity)*count);
+        }
+
+        _ecs_allocate_entities(ecs, entities, count);
+        _ecs_instantiate(ecs, prefab, entities, count, override, user_data);
+
+        if (out_entities == NULL) {
+            free(entities);
+        }
+        _ecs_flush_observers(ecs);
     }
 }
 
 static void _entity_internal_add_component(ECS *ecs, Entity entity, ComponentId component_id, const void *data) {
-    ArchetypeColumn column = hash_map_get(ecs->entity_map, entity);
+    if (_ecs_component_sparse(ecs, component_id)) {
+        _ecs_sparse_insert(ecs, component_id, entity, data);
+        return;
+    }
+
+    ArchetypeColumn column = ecs->entity_records[(uint32_t) entity];
     Archetype *left_archetype = column.archetype;
 
     archetype_move_entity_right(ecs, left_archetype, data, component_id, column.index);
 }
 
-void _entity_add_component(ECS *ecs, Entity entity, Str component_name, const void *data) {
-    uint32_t index = entity;
-    uint32_t generation = entity >> 32;
-    assert(ecs->entity_generation[index] == generation);
-
-    ComponentId component_id = hash_map_get(ecs->component_map, component_name);
-    assert(component_id != (ComponentId) -1 && "Add non-existent component.");
+void entity_add_component_id(ECS *ecs, Entity entity, ComponentId component_id, const void *data) {
+    assert(_ecs_entity_valid(ecs, entity));
+    assert(component_id < vec_len(ecs->components) && "Add non-existent component.");
 
     if (ecs->active_queries > 0) {
-        u64 component_size = ecs->components[component_id].size;
-        void *data_copy = malloc(component_size);
-        memcpy(data_copy, data, component_size);
-        vec_push(ecs->command_queue, ((Command) {
-                .type = COMMAND_ENTITY_COMPONENT_ADD,
-                .entity = entity,
-                .component_id = component_id,
-                .data = data_copy,
-            }));
+        _ecs_command_add(ecs, entity, component_id, data);
     } else {
         _entity_internal_add_component(ecs, entity, component_id, data);
+        _ecs_flush_observers(ecs);
     }
 }
 
 static void _entity_internal_remove_component(ECS *ecs, Entity entity, ComponentId component_id) {
-    ArchetypeColumn *column = hash_map_getp(ecs->entity_map, entity);
+    if (_ecs_component_sparse(ecs, component_id)) {
+        _ecs_sparse_remove(ecs, component_id, entity);
+        return;
+    }
+
+    ArchetypeColumn *column = &ecs->entity_records[(uint32_t) entity];
     Archetype *right_archetype = column->archetype;
 
     archetype_move_entity_left(ecs, right_archetype, component_id, column->index);
 }
 
-void _entity_remove_component(ECS *ecs, Entity entity, Str component_name) {
-    uint32_t index = entity;
-    uint32_t generation = entity >> 32;
-    assert(ecs->entity_generation[index] == generation);
-
-    ComponentId component_id = hash_map_get(ecs->component_map, component_name);
-    assert(component_id != (ComponentId) -1 && "Remove non-existent component.");
+void entity_remove_component_id(ECS *ecs, Entity entity, ComponentId component_id) {
+    assert(_ecs_entity_valid(ecs, entity));
+    assert(component_id < vec_len(ecs->components) && "Remove non-existent component.");
 
     if (ecs->active_queries > 0) {
-        vec_push(ecs->command_queue, ((Command) {
-                .type = COMMAND_ENTITY_COMPONENT_REMOVE,
-                .entity = entity,
-                .component_id = component_id,
-            }));
+        _ecs_command_push(ecs, COMMAND_ENTITY_COMPONENT_REMOVE, entity, component_id, 0);
     } else {
         _entity_internal_remove_component(ecs, entity, component_id);
+        _ecs_flush_observers(ecs);
     }
 }
 
-void *_entity_get_component(ECS *ecs, Entity entity, Str component_name) {
+void entity_add_components_id(ECS *ecs, Entity entity, const ComponentData *components, size_t count) {
+    assert(_ecs_entity_valid(ecs, entity));
+
+    if (ecs->active_queries > 0) {
+        // Playback coalesces the commands of an entity so the bundle still
+        // ends up as a single transition.
+        for (size_t i = 0; i < count; i++) {
+            assert(components[i].id < vec_len(ecs->components) && "Add non-existent component.");
+            _ecs_command_add(ecs, entity, components[i].id, components[i].data);
+        }
+    } else {
+        _ecs_move_entity_bundle(ecs, entity, NULL, 0, components, count);
+        _ecs_flush_observers(ecs);
+    }
+}
+
+void entity_remove_components_id(ECS *ecs, Entity entity, const ComponentId *components, size_t count) {
+    assert(_ecs_entity_valid(ecs, entity));
+
+    if (ecs->active_queries > 0) {
+        for (size_t i = 0; i < count; i++) {
+            _ecs_command_push(ecs, COMMAND_ENTITY_COMPONENT_REMOVE, entity, components[i], 0);
+        }
+    } else {
+        _ecs_move_entity_bundle(ecs, entity, components, count, NULL, 0);
+        _ecs_flush_observers(ecs);
+    }
+}
+
+ArchetypeColumn *_ecs_entity_record(ECS *ecs, Entity entity) {
     uint32_t index = entity;
     uint32_t generation = entity >> 32;
-    assert(ecs->entity_generation[index] == generation);
+    if (index >= ecs->entity_current_id ||
+            ecs->entity_generation[index] != generation) {
+        return NULL;
+    }
+
+    ArchetypeColumn *column = &ecs->entity_records[index];
+    if (column->archetype == NULL) {
+        return NULL;
+    }
+    return column;
+}
 
-    ArchetypeColumn *column = hash_map_getp(ecs->entity_map, entity);
+// Looks up a component of an entity, marking it changed if 'write' is set.
+static void *_ecs_entity_component(ECS *ecs, Entity entity, ComponentId component_id, b8 write) {
+    ArchetypeColumn *column = _ecs_entity_record(ecs, entity);
     if (column == NULL) {
-        log_error("Column retrieved is null: %zu, %u, %u", entity, (u32) entity, (u32) (entity >> 32));
+        log_error("Getting component of stale or unplaced entity: %zu, %u, %u", entity, (u32) entity, (u32) (entity >> 32));
+        return NULL;
     }
-    ComponentId component_id = hash_map_get(ecs->component_map, component_name);
-    assert(component_id != (ComponentId) -1 && "Get non-existent component.");
-    size_t *row = hash_map_getp(column->archetype->component_lookup, component_id);
+    if (_ecs_component_sparse(ecs, component_id)) {
+        SparseSet *set = &ecs->components[component_id].sparse;
+        u32 index = sparse_set_index(set, entity);
+        if (index == SPARSE_SET_NONE) {
+            return NULL;
+        }
+        if (write) {
+            set->changed_ticks[index] = ecs->tick;
+        }
+        return sparse_set_component(set, index);
+    }
+    u32 row = archetype_component_row(column->archetype, component_id);
     // Archetype doesn't have component.
-    if (row == NULL) {
+    if (row == ARCHETYPE_NO_ROW) {
         return NULL;
     }
-    size_t component_size = ecs->components[component_id].size;
-    return column->archetype->storage[*row] + component_size*column->index;
+    if (write) {
+        archetype_chunk(column->archetype, column->index)->changed_ticks[row] = ecs->tick;
+    }
+    return archetype_component(column->archetype, row, column->index);
+}
+
+void *entity_get_component_id(ECS *ecs, Entity entity, ComponentId component_id) {
+    assert(component_id < vec_len(ecs->components) && "Get non-existent component.");
+    return _ecs_entity_component(ecs, entity, component_id, true);
+}
+
+const void *entity_read_component_id(ECS *ecs, Entity entity, ComponentId component_id) {
+    assert(component_id < vec_len(ecs->components) && "Read non-existent component.");
+    return _ecs_entity_component(ecs, entity, component_id, false);
+}
+
+b8 entity_has_component_id(ECS *ecs, Entity entity, ComponentId component_id) {
+    assert(component_id < vec_len(ecs->components) && "Check non-existent component.");
+
+    ArchetypeColumn *column = _ecs_entity_record(ecs, entity);
+    if (column == NULL) {
+        return false;
+    }
+    if (_ecs_component_sparse(ecs, component_id)) {
+        return sparse_set_index(&ecs->components[component_id].sparse, entity) != SPARSE_SET_NONE;
+    }
+    return archetype_component_row(column->archetype, component_id) != ARCHETYPE_NO_ROW;
+}
+
+void _entity_add_component(ECS *ecs, Entity entity, Str component_name, const void *data) {
+    ComponentId component_id = hash_map_get(ecs->component_map, component_name);
+    assert(component_id != (ComponentId) -1 && "Add non-existent component.");
+    entity_add_component_id(ecs, entity, component_id, data);
+}
+
+void _entity_remove_component(ECS *ecs, Entity entity, Str component_name) {
+    ComponentId component_id = hash_map_get(ecs->component_map, component_name);
+    assert(component_id != (ComponentId) -1 && "Remove non-existent component.");
+    entity_remove_component_id(ecs, entity, component_id);
+}
+
+void *_entity_get_component(ECS *ecs, Entity entity, Str component_name) {
+    ComponentId component_id = hash_map_get(ecs->component_map, component_name);
+    assert(component_id != (ComponentId) -1 && "Get non-existent component.");
+    return entity_get_component_id(ecs, entity, component_id);
 }
 
 b8 entity_alive(ECS *ecs, Entity entity) {
@@ -218,57 +816,547 @@ b8 entity_alive(ECS *ecs, Entity entity) {
     return index < ecs->entity_current_id && ecs->entity_generation[index] == generation;
 }
 
+static u64 _ecs_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+size_t ecs_compact_with(ECS *ecs, CompactDesc desc) {
+    if (ecs->active_queries > 0) {
+        log_error("Compacting inside a query.");
+        return 0;
+    }
+
+    u64 start = desc.budget_ns > 0 ? _ecs_time_ns() : 0;
+    ecs->compact_frame++;
+    size_t released = 0;
+
+    while (vec_len(ecs->chunk_pool) > desc.pooled_chunks) {
+        free(vec_pop(ecs->chunk_pool));
+        released += CHUNK_SIZE;
+    }
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        released += sparse_set_shrink(&ecs->components[ecs->sparse_components[i]].sparse);
+    }
+
+    // Walks the archetypes from where the last pass stopped, checking the
+    // clock every few of them.
+    Vec(Archetype *) empty = NULL;
+    size_t count = vec_len(ecs->archetypes);
+    size_t cursor = ecs->compact_cursor < count ? ecs->compact_cursor : 0;
+    for (size_t i = 0; i < count; i++) {
+        if (desc.budget_ns > 0 && i % 64 == 63 && _ecs_time_ns() - start > desc.budget_ns) {
+            break;
+        }
+        Archetype *archetype = ecs->archetypes[cursor];
+        if (archetype != ecs->root_archetype &&
+                archetype->current_index == 0 &&
+                archetype->rollback_refs == 0 &&
+                ecs->compact_frame - archetype->empty_since >= desc.empty_frames) {
+            vec_push(empty, archetype);
+        }
+        cursor = (cursor + 1) % count;
+    }
+
+    // Archetypes before the cursor close the gaps left by removed ones.
+    size_t removed_before = 0;
+    for (size_t i = 0; i < vec_len(empty); i++) {
+        removed_before += empty[i]->index < cursor;
+    }
+    ecs->compact_cursor = cursor - removed_before;
+
+    released += archetype_remove_empty(ecs, empty, vec_len(empty));
+    vec_free(empty);
+
+    return released;
+}
+
 SystemGroup ecs_system_group(ECS *ecs) {
     SystemGroup group = vec_len(ecs->systems);
     vec_push(ecs->systems, NULL);
     return group;
 }
 
+static b8 _ecs_systems_conflict(const QueryCache *a, const QueryCache *b) {
+    if (a->desc.exclusive || b->desc.exclusive) {
+        return true;
+    }
+
+    // Without terms never touch the component.
+    for (size_t i = 0; i < a->field_count; i++) {
+        if (a->desc.fields[i] & QUERY_TERM_WITHOUT) {
+            continue;
+        }
+        for (size_t j = 0; j < b->field_count; j++) {
+            if (b->desc.fields[j] & QUERY_TERM_WITHOUT) {
+                continue;
+            }
+            if (query_term_id(a->desc.fields[i]) == query_term_id(b->desc.fields[j]) &&
+                    (a->desc.access[i] == QUERY_ACCESS_WRITE ||
+                     b->desc.access[j] == QUERY_ACCESS_WRITE)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 void ecs_register_system(ECS *ecs, System system, SystemGroup group, QueryDesc desc) {
     assert(group < vec_len(ecs->systems));
+    assert(!(desc.parallel && desc.exclusive) && "Exclusive systems can't run in parallel.");
 
-    vec_push(ecs->systems[group], ((InternalSystem) {
-            .func = system,
-            .desc = desc,
-        }));
+    InternalSystem new_system = {
+        .func = system,
+        .query = ecs_query_cache_new(ecs, desc),
+        .user_ptr = desc.user_ptr,
+    };
+
+    // Order the new system after every conflicting system already in the
+    // group.
+    u32 index = vec_len(ecs->systems[group]);
+    for (u32 i = 0; i < index; i++) {
+        InternalSystem *other = &ecs->systems[group][i];
+        if (_ecs_systems_conflict(other->query, new_system.query)) {
+            vec_push(other->dependents, index);
+            new_system.dependency_count++;
+        }
+    }
+
+    vec_push(ecs->systems[group], new_system);
+}
+
+static void _ecs_run_query(ECS *ecs, System system, Query query, void *user_ptr) {
+    for (size_t i = 0; i < query.count; i++) {
+        QueryIter iter = ecs_query_get_iter(query, i);
+        system(ecs, iter, user_ptr);
+    }
+    ecs_query_free(ecs, query);
+}
+
+void ecs_set_worker_count(ECS *ecs, u32 count) {
+    if (ecs->thread_pool != NULL && count != ecs->worker_count) {
+        thread_pool_free(ecs->thread_pool);
+        ecs->thread_pool = NULL;
+    }
+    ecs->worker_count = count;
+}
+
+typedef struct GroupRun GroupRun;
+struct GroupRun {
+    ECS *ecs;
+    InternalSystem *systems;
+    size_t count;
+    size_t finished;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Splits a system that has become ready into tasks. Its tick was taken
+// before the group started, see 'ecs_run_group()'.
+static void _ecs_prepare_system(ECS *ecs, InternalSystem *system) {
+    QueryCache *cache = system->query;
+    query_cache_refresh(ecs, cache);
+
+    vec_clear(system->ranges);
+    system->task_count = 1;
+
+    // Parallel systems get ranges of consecutive runs of the query holding
+    // up to 'grain_size' entities, or a single run if it holds more. The
+    // runs of a chunk with disabled entities, or visited through a sparse
+    // set, can end up in different ranges so the written components of
+    // every chunk are marked changed here rather than by the tasks.
+    if (cache->desc.parallel) {
+        query_cache_mark_written(cache);
+        size_t grain_size = cache->desc.grain_size > 0 ? cache->desc.grain_size : DEFAULT_GRAIN_SIZE;
+        size_t range_entities = 0;
+        for (size_t i = 0; i < vec_len(cache->chunks); i++) {
+            size_t count = cache->chunks[i].count;
+            if (vec_len(system->ranges) == 0 || range_entities + count > grain_size) {
+                vec_push(system->ranges, ((QueryRange) {
+                        .first = i,
+                    }));
+                range_entities = 0;
+            }
+            system->ranges[vec_len(system->ranges)-1].count++;
+            range_entities += count;
+        }
+        // Keep a single, empty, task for systems without any entities.
+        if (vec_len(system->ranges) > 0) {
+            system->task_count = vec_len(system->ranges);
+        }
+    }
+
+    system->tasks_started = 0;
+    system->tasks_left = system->task_count;
+    while (vec_len(system->commands) < system->task_count) {
+        vec_push(system->commands, ((CommandBuffer) {0}));
+    }
+}
+
+static void _ecs_run_task(ECS *ecs, InternalSystem *system, u32 task) {
+    Query query = {
+        .count = vec_len(system->query->chunks),
+        ._cache = system->query,
+    };
+
+    size_t first = 0;
+    size_t count = query.count;
+    if (system->query->desc.parallel) {
+        first = 0;
+        count = 0;
+        if (task < vec_len(system->ranges)) {
+            first = system->ranges[task].first;
+            count = system->ranges[task].count;
+        }
+    }
+
+    _ecs_thread_command_buffer = &system->commands[task];
+    for (size_t i = first; i < first + count; i++) {
+        system->func(ecs, ecs_query_get_iter(query, i), system->user_ptr);
+    }
+    _ecs_thread_command_buffer = NULL;
+}
+
+// Pulls tasks of ready systems until every system of the group has run.
+// Exclusive systems are left for the calling thread.
+static void _ecs_run_group_worker(void *data, u32 thread_index) {
+    GroupRun *run = data;
+    ECS *ecs = run->ecs;
+
+    pthread_mutex_lock(&run->lock);
+    while (run->finished < run->count) {
+        // Prefer the earliest registered system.
+        size_t slot = vec_len(ecs->systems_ready);
+        for (size_t i = 0; i < vec_len(ecs->systems_ready); i++) {
+            InternalSystem *system = &run->systems[ecs->systems_ready[i]];
+            if (system->query->desc.exclusive && thread_index != 0) {
+                continue;
+            }
+            if (slot == vec_len(ecs->systems_ready) ||
+                    ecs->systems_ready[i] < ecs->systems_ready[slot]) {
+                slot = i;
+            }
+        }
+        if (slot == vec_len(ecs->systems_ready)) {
+            pthread_cond_wait(&run->cond, &run->lock);
+            continue;
+        }
+        InternalSystem *system = &run->systems[ecs->systems_ready[slot]];
+        u32 task = system->tasks_started++;
+        if (system->tasks_started == system->task_count) {
+            _vec_remove_fast((void **) &ecs->systems_ready, slot, NULL);
+        }
+        pthread_mutex_unlock(&run->lock);
+
+        _ecs_run_task(ecs, system, task);
+
+        pthread_mutex_lock(&run->lock);
+        system->tasks_left--;
+        if (system->tasks_left > 0) {
+            continue;
+        }
+        run->finished++;
+        for (size_t i = 0; i < vec_len(system->dependents); i++) {
+            InternalSystem *dependent = &run->systems[system->dependents[i]];
+            dependent->waiting--;
+            if (dependent->waiting == 0) {
+                _ecs_prepare_system(ecs, dependent);
+                vec_push(ecs->systems_ready, system->dependents[i]);
+            }
+        }
+        pthread_cond_broadcast(&run->cond);
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+// Appends the commands of 'src' to 'dst' and resets 'src'.
+static void _ecs_command_buffer_append(CommandBuffer *dst, CommandBuffer *src) {
+    size_t base = 0;
+    if (src->arena_size > 0) {
+        base = _ecs_command_alloc(dst, src->arena_size);
+        memcpy(&dst->arena[base], src->arena, src->arena_size);
+    }
+    for (size_t i = 0; i < vec_len(src->commands); i++) {
+        Command cmd = src->commands[i];
+        cmd.offset += base;
+        vec_push(dst->commands, cmd);
+    }
+
+    vec_clear(src->commands);
+    src->arena_size = 0;
 }
 
 void ecs_run_group(ECS *ecs, SystemGroup group) {
     assert(group < vec_len(ecs->systems));
 
-    for (size_t i = 0; i < vec_len(ecs->systems[group]); i++) {
-        InternalSystem system = ecs->systems[group][i];
-        ecs_run_system(ecs, system.func, system.desc);
+    Vec(InternalSystem) systems = ecs->systems[group];
+
+    // Groups run from within a query, and worlds without workers, run in
+    // registration order on the calling thread. Commands are still played
+    // back once the whole group has run, same as a parallel run.
+    if (ecs->active_queries > 0 || ecs->worker_count == 0) {
+        ecs->active_queries++;
+        for (size_t i = 0; i < vec_len(systems); i++) {
+            InternalSystem system = systems[i];
+            _ecs_run_query(ecs, system.func, ecs_query_cached(ecs, system.query), system.user_ptr);
+        }
+        ecs->active_queries--;
+        if (ecs->active_queries == 0) {
+            _ecs_process_command_queue(ecs);
+        }
+        return;
+    }
+
+    if (ecs->thread_pool == NULL) {
+        ecs->thread_pool = thread_pool_new(ecs->worker_count);
+    }
+
+    GroupRun run = {
+        .ecs = ecs,
+        .systems = systems,
+        .count = vec_len(systems),
+    };
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+
+    // Every system takes its tick up front, in registration order, so
+    // 'ecs->tick' stays put while tasks read it to mark their writes.
+    for (u32 i = 0; i < vec_len(systems); i++) {
+        query_cache_tick(ecs, systems[i].query);
+    }
+
+    vec_clear(ecs->systems_ready);
+    for (u32 i = 0; i < vec_len(systems); i++) {
+        systems[i].waiting = systems[i].dependency_count;
+        if (systems[i].waiting == 0) {
+            _ecs_prepare_system(ecs, &systems[i]);
+            vec_push(ecs->systems_ready, i);
+        }
+    }
+
+    ecs->active_queries++;
+    ecs->parallel = true;
+    thread_pool_run(ecs->thread_pool, _ecs_run_group_worker, &run);
+    ecs->parallel = false;
+
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+
+    _ecs_commit_reserved_entities(ecs);
+    for (size_t i = 0; i < vec_len(systems); i++) {
+        for (u32 j = 0; j < systems[i].task_count; j++) {
+            _ecs_command_buffer_append(&ecs->command_buffer, &systems[i].commands[j]);
+        }
+    }
+
+    ecs->active_queries--;
+    if (ecs->active_queries == 0) {
+        _ecs_process_command_queue(ecs);
     }
 }
 
 void ecs_run_system(ECS *ecs, System system, QueryDesc desc) {
-    Query query = ecs_query(ecs, desc);
-    for (size_t i = 0; i < query.count; i++) {
-        QueryIter iter = ecs_query_get_iter(query, i);
-        system(ecs, iter, desc.user_ptr);
+    _ecs_run_query(ecs, system, ecs_query(ecs, desc), desc.user_ptr);
+}
+
+static void _ecs_play_spawn_batch(ECS *ecs, CommandBuffer *buffer, size_t offset) {
+    SpawnBatch batch = *(SpawnBatch *) &buffer->arena[offset];
+    assert(batch.column_count <= MAX_BUNDLE_COMPONENTS);
+    Entity *entities = (Entity *) &buffer->arena[offset + sizeof(SpawnBatch)];
+    SpawnBatchColumn *batch_columns = (SpawnBatchColumn *) &entities[batch.count];
+
+    ComponentColumn columns[MAX_BUNDLE_COMPONENTS];
+    for (size_t i = 0; i < batch.column_count; i++) {
+        columns[i] = (ComponentColumn) {
+            .id = batch_columns[i].id,
+            .data = &buffer->arena[offset + batch_columns[i].offset],
+            .fill = batch_columns[i].fill,
+        };
     }
-    ecs_query_free(ecs, query);
+
+    _ecs_spawn_batch(ecs, entities, batch.count, columns, batch.column_count);
 }
 
-void _ecs_process_command_queue(ECS *ecs) {
-    for (u32 i = 0; i < vec_len(ecs->command_queue); i++) {
-        Command cmd = ecs->command_queue[i];
+static void _ecs_play_instantiate(ECS *ecs, CommandBuffer *buffer, size_t offset) {
+    PrefabInstantiate instantiate = *(PrefabInstantiate *) &buffer->arena[offset];
+    const Entity *entities = (const Entity *) &buffer->arena[offset + sizeof(PrefabInstantiate)];
+    _ecs_instantiate(ecs, instantiate.prefab, entities, instantiate.count, instantiate.override,
+            &buffer->arena[offset + instantiate.user_data_offset]);
+}
+
+static void _ecs_flush_pending(ECS *ecs, Entity entity) {
+    _ecs_move_entity_bundle(ecs, entity,
+            ecs->pending_remove, vec_len(ecs->pending_remove),
+            ecs->pending_add, vec_len(ecs->pending_add));
+    vec_clear(ecs->pending_remove);
+    vec_clear(ecs->pending_add);
+}
+
+// Folds every command of an entity into one set of components to remove and
+// one to add, applied in a single archetype transition. A kill drops whatever
+// came before it. Only the last enabled state matters, it's set once the
+// entity is in its final archetype.
+static void _ecs_play_entity(ECS *ecs, CommandBuffer *buffer, Entity entity, u32 first) {
+    // The entity may have died since its commands were recorded, e.g. killed
+    // while an observer of one of its components recorded a change.
+    if (!entity_alive(ecs, entity)) {
+        return;
+    }
+    vec_clear(ecs->pending_remove);
+    vec_clear(ecs->pending_add);
+    i32 enabled = -1;
+
+    for (u32 i = first; i != COMMAND_NONE; i = buffer->commands[i].next) {
+        Command cmd = buffer->commands[i];
         switch (cmd.type) {
             case COMMAND_ENTITY_SPAWN:
-                _ecs_internal_entity_spawn(ecs, cmd.entity);
-                 break;
+            case COMMAND_ENTITY_SPAWN_BATCH:
+            case COMMAND_ENTITY_INSTANTIATE:
+                break;
             case COMMAND_ENTITY_KILL:
-                _ecs_internal_kill(ecs, cmd.entity);
-                 break;
-            case COMMAND_ENTITY_COMPONENT_ADD:
-                _entity_internal_add_component(ecs, cmd.entity, cmd.component_id, cmd.data);
-                free(cmd.data);
-                 break;
-            case COMMAND_ENTITY_COMPONENT_REMOVE:
-                _entity_internal_remove_component(ecs, cmd.entity, cmd.component_id);
-                 break;
-        }
-    }
-    vec_free(ecs->command_queue);
+                _ecs_internal_kill(ecs, entity);
+                return;
+            case COMMAND_ENTITY_SET_ENABLED:
+                enabled = cmd.component_id;
+                break;
+            case COMMAND_ENTITY_COMPONENT_ADD: {
+                for (size_t j = 0; j < vec_len(ecs->pending_remove); j++) {
+                    if (ecs->pending_remove[j] == cmd.component_id) {
+                        _vec_remove_fast((void **) &ecs->pending_remove, j, NULL);
+                        break;
+                    }
+                }
+
+                ComponentData data = {
+                    .id = cmd.component_id,
+                    .data = &buffer->arena[cmd.offset],
+                };
+                size_t j = 0;
+                while (j < vec_len(ecs->pending_add) && ecs->pending_add[j].id != cmd.component_id) {
+                    j++;
+                }
+                if (j < vec_len(ecs->pending_add)) {
+                    ecs->pending_add[j] = data;
+                } else {
+                    if (vec_len(ecs->pending_add) == MAX_BUNDLE_COMPONENTS) {
+                        _ecs_flush_pending(ecs, entity);
+                    }
+                    vec_push(ecs->pending_add, data);
+                }
+            } break;
+            case COMMAND_ENTITY_COMPONENT_REMOVE: {
+                for (size_t j = 0; j < vec_len(ecs->pending_add); j++) {
+                    if (ecs->pending_add[j].id == cmd.component_id) {
+                        _vec_remove_fast((void **) &ecs->pending_add, j, NULL);
+                        break;
+                    }
+                }
+
+                size_t j = 0;
+                while (j < vec_len(ecs->pending_remove) && ecs->pending_remove[j] != cmd.component_id) {
+                    j++;
+                }
+                if (j == vec_len(ecs->pending_remove)) {
+                    if (vec_len(ecs->pending_remove) == MAX_BUNDLE_COMPONENTS) {
+                        _ecs_flush_pending(ecs, entity);
+                    }
+                    vec_push(ecs->pending_remove, cmd.component_id);
+                }
+            } break;
+        }
+    }
+
+    ArchetypeColumn record = ecs->entity_records[(uint32_t) entity];
+    if (record.archetype == NULL ||
+            vec_len(ecs->pending_remove) > 0 ||
+            vec_len(ecs->pending_add) > 0) {
+        _ecs_flush_pending(ecs, entity);
+    }
+    if (enabled != -1) {
+        _ecs_internal_set_enabled(ecs, entity, enabled);
+    }
+}
+
+// Plays the commands chained so far for an entity ahead of the others. Those
+// recorded later start a new chain.
+static void _ecs_play_pending(ECS *ecs, CommandBuffer *buffer, Entity entity) {
+    u32 index = entity;
+    if (index >= vec_len(ecs->pending_lookup) || ecs->pending_lookup[index] == COMMAND_NONE) {
+        return;
+    }
+    PendingEntity *pending = &ecs->pending[ecs->pending_lookup[index]];
+    u32 first = pending->first;
+    pending->first = COMMAND_NONE;
+    ecs->pending_lookup[index] = COMMAND_NONE;
+    _ecs_play_entity(ecs, buffer, pending->entity, first);
+}
+
+static void _ecs_play_commands(ECS *ecs, CommandBuffer *buffer) {
+    while (vec_len(ecs->pending_lookup) < ecs->entity_current_id) {
+        vec_push(ecs->pending_lookup, COMMAND_NONE);
+    }
+
+    // Batches and instances are placed right away, instances once the
+    // commands recorded for their prefab before them have been played. Every
+    // other command is chained to the previous command of its entity.
+    for (u32 i = 0; i < vec_len(buffer->commands); i++) {
+        Command *cmd = &buffer->commands[i];
+        cmd->next = COMMAND_NONE;
+        if (cmd->type == COMMAND_ENTITY_SPAWN_BATCH) {
+            _ecs_play_spawn_batch(ecs, buffer, cmd->offset);
+            continue;
+        }
+        if (cmd->type == COMMAND_ENTITY_INSTANTIATE) {
+            _ecs_play_pending(ecs, buffer, ((PrefabInstantiate *) &buffer->arena[cmd->offset])->prefab);
+            _ecs_play_instantiate(ecs, buffer, cmd->offset);
+            continue;
+        }
+
+        // Dropped here rather than when playing the chain, which may also
+        // hold commands of a newer entity with the same index.
+        if (!entity_alive(ecs, cmd->entity)) {
+            continue;
+        }
+        u32 index = cmd->entity;
+        u32 pending = ecs->pending_lookup[index];
+        if (pending == COMMAND_NONE) {
+            ecs->pending_lookup[index] = vec_len(ecs->pending);
+            vec_push(ecs->pending, ((PendingEntity) {
+                    .entity = cmd->entity,
+                    .first = i,
+                    .last = i,
+                }));
+        } else {
+            buffer->commands[ecs->pending[pending].last].next = i;
+            ecs->pending[pending].last = i;
+        }
+    }
+
+    for (size_t i = 0; i < vec_len(ecs->pending); i++) {
+        PendingEntity pending = ecs->pending[i];
+        ecs->pending_lookup[(uint32_t) pending.entity] = COMMAND_NONE;
+        if (pending.first != COMMAND_NONE) {
+            _ecs_play_entity(ecs, buffer, pending.entity, pending.first);
+        }
+    }
+
+    vec_clear(ecs->pending);
+    vec_clear(buffer->commands);
+    buffer->arena_size = 0;
+}
+
+// Commands recorded during playback, by observers or prefab overrides, go to
+// the other buffer and are played in the next round.
+void _ecs_process_command_queue(ECS *ecs) {
+    ecs->active_queries++;
+    while (vec_len(ecs->command_buffer.commands) > 0) {
+        CommandBuffer buffer = ecs->command_buffer;
+        ecs->command_buffer = ecs->playback_buffer;
+        ecs->command_high_water = max(ecs->command_high_water, vec_len(buffer.commands));
+        ecs->command_bytes_high_water = max(ecs->command_bytes_high_water, buffer.arena_size);
+        _ecs_play_commands(ecs, &buffer);
+        ecs->playback_buffer = buffer;
+    }
+    ecs->active_queries--;
 }
@@ -3,14 +3,14 @@
 #include "ecs.h"
 #include "ds.h"
 
-typedef size_t ComponentId;
+#include <pthread.h>
 
 // -- Type ---------------------------------------------------------------------
 // A set of unique component IDs.
 typedef Vec(ComponentId) Type;
 
-extern void type_add(Type type, ComponentId component);
-extern void type_remove(Type type, ComponentId component);
+extern void type_add(Type *type, ComponentId component);
+extern void type_remove(Type *type, ComponentId component);
 extern Type type_clone(const Type type);
 extern size_t type_hash(const void *data, size_t size);
 extern int type_cmp(const void *a, const void *b, size_t size);
@@ -20,95 +20,591 @@ extern bool type_is_proper_subset(const Type a, const Type b,
         ComponentId *diff_component);
 extern void type_inspect(const Type type);
 
+// -- Signature ----------------------------------------------------------------
+// Bitset of the components of an archetype. Components with an ID below
+// SIGNATURE_WORDS*64 are stored inline, higher ones in 'overflow' which only
+// grows as far as the highest component.
+#define SIGNATURE_WORDS 4
+
+typedef struct Signature Signature;
+struct Signature {
+    u64 words[SIGNATURE_WORDS];
+    u64 *overflow;
+    u32 overflow_count;
+};
+
+extern Signature signature_from_type(const Type type);
+extern void signature_set(Signature *signature, ComponentId component);
+extern b8 signature_test(const Signature *signature, ComponentId component);
+extern void signature_free(Signature *signature);
+extern u64 signature_hash(const Signature *signature);
+extern b8 signature_equal(const Signature *a, const Signature *b);
+// Whether the signature has every component of 'with' and none of 'without'.
+extern b8 signature_match(const Signature *signature, const Signature *with, const Signature *without);
+// Pushes the index of every matching signature onto 'matches'.
+extern void signature_match_all(const Signature *signatures, size_t count, const Signature *with, const Signature *without, Vec(u32) *matches);
+
 // -- Archetype -----------------------------------------------------------------
 // Node in an archetype graph. Storage for component data; each column
 // corresponding to an entity.
 typedef struct Archetype Archetype;
 
+// Row of one archetype copied to a row of another when an entity moves
+// between them, with the offsets of both rows within their chunks.
+typedef struct ArchetypeRemap ArchetypeRemap;
+struct ArchetypeRemap {
+    u32 src_row;
+    u32 dst_row;
+    u32 src_offset;
+    u32 dst_offset;
+    u32 size;
+};
+
+// The same edge is stored in the edge maps of both archetypes and owned by
+// 'add'. The remaps list the rows copied when moving along it in either
+// direction.
 typedef struct ArchetypeEdge ArchetypeEdge;
 struct ArchetypeEdge {
     Archetype *add;
     Archetype *remove;
+    Vec(ArchetypeRemap) add_remap;
+    Vec(ArchetypeRemap) remove_remap;
 };
 
+// Edge taken when adding or removing several components at once, keyed by the
+// sorted set of components.
+typedef struct ArchetypeBundleEdge ArchetypeBundleEdge;
+struct ArchetypeBundleEdge {
+    Type components;
+    b8 add;
+    Archetype *archetype;
+    Vec(ArchetypeRemap) remap;
+};
+
+// Archetypes store their columns in chunks of CHUNK_SIZE bytes taken from a
+// pool shared by the world. A chunk holds the entities of its columns
+// followed by every row of components (SoA), each row starting at a
+// CHUNK_ALIGN aligned offset. Every chunk but the last one is full.
+#define CHUNK_SIZE (16*1024)
+#define CHUNK_ALIGN 16
+
+typedef struct RollbackChunk RollbackChunk;
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    size_t count;
+    u8 *data;
+    // World tick of the last mutable access to each row and of the last time
+    // an entity of the chunk gained the component.
+    u64 *changed_ticks;
+    u64 *added_ticks;
+    // One bit per column, set for enabled entities and clear past 'count',
+    // along with the number of disabled entities. The ticks and the bits
+    // live in one allocation starting at 'changed_ticks'.
+    u64 *enabled;
+    size_t disabled;
+    // World tick of the last time entities were added to, removed from,
+    // enabled or disabled in the chunk.
+    u64 layout_tick;
+    // Copy kept by the rollback ring of the chunk as it was when last saved
+    // or restored, NULL if there isn't one. Holds a reference.
+    RollbackChunk *saved;
+};
+
+static inline b8 chunk_enabled(const Chunk *chunk, size_t index) {
+    return (chunk->enabled[index / 64] >> (index % 64)) & 1;
+}
+
 struct Archetype {
     Type type;
     size_t current_index;
+    // Index into the archetype table of the world and hash of the signature
+    // stored there.
+    u32 index;
+    u64 hash;
 
-    // Rows of components.
-    Vec(Vec(void)) storage;
+    Vec(Chunk) chunks;
+    size_t chunk_capacity;
+    // Only differs from CHUNK_SIZE when a single column doesn't fit.
+    size_t chunk_size;
+    // Offset into a chunk and component size of each row.
+    Vec(size_t) row_offsets;
+    Vec(size_t) row_sizes;
 
     HashMap(ComponentId, ArchetypeEdge) edge_map;
-    // Component to row lookup table.
-    HashMap(ComponentId, size_t) component_lookup;
-    // Column to entity lookup table.
-    HashMap(size_t, Entity) entity_lookup;
+    u32 edge_count;
+    // Only a handful of distinct bundles are applied to an archetype so a
+    // linear search beats hashing the component set.
+    Vec(ArchetypeBundleEdge) bundle_edges;
+    // Component to row lookup table, indexed by component ID. Components
+    // registered after the archetype was created are never part of it and
+    // fall outside the table.
+    Vec(u32) component_lookup;
+    // Compaction pass during which the archetype last became empty.
+    u64 empty_since;
+    // Number of saved states of the rollback ring in which the archetype has
+    // entities. Compaction leaves it alone until it's 0.
+    u32 rollback_refs;
 };
 
+#define ARCHETYPE_NO_ROW ((u32) -1)
+// Index of an archetype being removed by compaction.
+#define ARCHETYPE_REMOVED ((u32) -1)
+
+static inline u32 archetype_component_row(const Archetype *archetype, ComponentId component) {
+    if (component >= vec_len(archetype->component_lookup)) {
+        return ARCHETYPE_NO_ROW;
+    }
+    return archetype->component_lookup[component];
+}
+
+static inline Chunk *archetype_chunk(const Archetype *archetype, size_t column) {
+    return &archetype->chunks[column / archetype->chunk_capacity];
+}
+
+static inline Entity *archetype_entity(const Archetype *archetype, size_t column) {
+    const Chunk *chunk = &archetype->chunks[column / archetype->chunk_capacity];
+    return &((Entity *) chunk->data)[column % archetype->chunk_capacity];
+}
+
+static inline void *archetype_component(const Archetype *archetype, u32 row, size_t column) {
+    const Chunk *chunk = &archetype->chunks[column / archetype->chunk_capacity];
+    return chunk->data + archetype->row_offsets[row] + archetype->row_sizes[row]*(column % archetype->chunk_capacity);
+}
+
 typedef struct ArchetypeColumn ArchetypeColumn;
 struct ArchetypeColumn {
     Archetype *archetype;
     size_t index;
 };
 
-extern Archetype *archetype_new(const ECS *ecs, Type type);
+// Chunks of the standard size are recycled through the pool of the world.
+extern u8 *chunk_alloc(ECS *ecs, size_t size);
+extern void chunk_release(ECS *ecs, u8 *data, size_t size);
+// Appends an empty chunk to an archetype, or releases its last one.
+extern Chunk *archetype_push_chunk(ECS *ecs, Archetype *archetype);
+extern void archetype_pop_chunk(ECS *ecs, Archetype *archetype);
+
+// Creates the archetype of 'type' and adds it to the archetype table.
+extern Archetype *archetype_new(ECS *ecs, Type type);
 extern void archetype_free(Archetype *archetype);
+// Hash probe for the archetype with the given signature, NULL if it doesn't
+// exist.
+extern Archetype *archetype_find(ECS *ecs, const Signature *signature, u64 hash);
 // This should only be called on the root archetype that doesn't have any
 // component storage.
-extern ArchetypeColumn archetype_add_entity(Archetype *archetype, Entity entity);
+extern ArchetypeColumn archetype_add_entity(ECS *ecs, Archetype *archetype, Entity entity);
 extern void archetype_move_entity_right(ECS *ecs, Archetype *left, const void *component_data, ComponentId component_id, size_t left_column);
 extern void archetype_move_entity_left(ECS *ecs, Archetype *right, ComponentId component_id, size_t right_column);
+// Removes and adds every component of a bundle in a single transition,
+// copying each column once. An entity that hasn't been placed yet goes
+// straight from nothing to its final archetype.
+extern void archetype_move_entity_bundle(ECS *ecs, Entity entity, const ComponentId *remove, size_t remove_count, const ComponentData *add, size_t add_count);
 extern void archetype_remove_entity(ECS *ecs, Archetype *archetype, size_t column);
+extern void archetype_set_enabled(ECS *ecs, Archetype *archetype, size_t column, b8 enabled);
+extern Archetype *archetype_get_or_new(ECS *ecs, Type type);
+// Places freshly allocated entities directly in the archetype made up of the
+// components of 'columns'.
+extern void archetype_spawn_batch(ECS *ecs, const Entity *entities, size_t count, const ComponentColumn *columns, size_t column_count);
+// Same as above for a known archetype, with one column per component in the
+// order of its type. Returns the first column of the new entities.
+extern size_t archetype_spawn_rows(ECS *ecs, Archetype *archetype, const Entity *entities, size_t count, const ComponentColumn *columns);
+// Unlinks empty archetypes from the graph, the archetype table and every
+// persistent query, then frees them. Returns the bytes released.
+extern size_t archetype_remove_empty(ECS *ecs, Archetype **archetypes, size_t count);
+
+// -- Sparse set ---------------------------------------------------------------
+// Storage of a sparse component. Components are packed in the order of
+// 'dense' and 'sparse' maps the index of an entity to its position + 1, 0
+// meaning the entity doesn't have the component.
+#define SPARSE_SET_NONE ((u32) -1)
+
+typedef struct SparseSet SparseSet;
+struct SparseSet {
+    size_t component_size;
+    Vec(u32) sparse;
+    Vec(Entity) dense;
+    u8 *data;
+    size_t capacity;
+    // World tick of the last mutable access to, and of the addition of, each
+    // component in dense order.
+    Vec(u64) changed_ticks;
+    Vec(u64) added_ticks;
+};
+
+static inline u32 sparse_set_index(const SparseSet *set, Entity entity) {
+    u32 index = entity;
+    if (index >= vec_len(set->sparse)) {
+        return SPARSE_SET_NONE;
+    }
+    return set->sparse[index] - 1;
+}
+
+// Tags have no data, their pointer is the one of the entity in 'dense' which
+// is only good for telling whether it's present.
+static inline void *sparse_set_component(const SparseSet *set, u32 index) {
+    if (set->component_size == 0) {
+        return &set->dense[index];
+    }
+    return set->data + set->component_size*index;
+}
+
+// Adds the component of an entity, or overwrites it if it already has one.
+// Marks it changed, and added if it's new, at 'tick'.
+extern void sparse_set_insert(SparseSet *set, Entity entity, const void *data, u64 tick);
+// Swap removes the component of an entity, if it has one.
+extern void sparse_set_remove(SparseSet *set, Entity entity);
+// Replaces every component of the set, marking them changed at 'tick'.
+extern void sparse_set_assign(SparseSet *set, const Entity *dense, const void *data, const u64 *added_ticks, size_t count, u64 tick);
+// Halves the component storage while it's less than a quarter full. Returns
+// the bytes released.
+extern size_t sparse_set_shrink(SparseSet *set);
+extern void sparse_set_free(SparseSet *set);
+
+// -- Query --------------------------------------------------------------------
+// Columns of a chunk of a matched archetype, the archetype and chunk as
+// indices. Queries without sparse fields take whole chunks.
+typedef struct QueryChunk QueryChunk;
+struct QueryChunk {
+    u32 archetype;
+    u32 chunk;
+    u32 first;
+    u32 count;
+};
+
+static inline ComponentId query_term_id(Entity field) {
+    return field & ~QUERY_TERM_MASK;
+}
+
+struct QueryCache {
+    ECS *ecs;
+    QueryDesc desc;
+    size_t field_count;
+    Vec(Archetype *) archetypes;
+    // Chunks of the matched archetypes which queries iterate over. Rebuilt
+    // when a query begins after the layout of the world has changed, or every
+    // time for queries with Changed or Added terms or sparse fields.
+    Vec(QueryChunk) chunks;
+    u64 version;
+    b8 filtered;
+    // Components every matching archetype has, and has none of. Or groups
+    // can't be expressed as a mask and are checked separately.
+    Signature with;
+    Signature without;
+    b8 has_or;
+    // Sparse components aren't part of the masks and are checked for each
+    // entity. Entities are visited one by one, or in runs of consecutive
+    // columns when sparse fields are only excluded. 'archetype_lookup' holds
+    // the index + 1 into 'archetypes' of every matched archetype, indexed by
+    // archetype index.
+    b8 sparse;
+    b8 sparse_fetched;
+    b8 sparse_fields[MAX_QUERY_FIELDS];
+    Vec(u32) archetype_lookup;
+    // World tick at which the query began this time and the time before.
+    u64 this_run;
+    u64 last_run;
+    // Persistent caches are owned by the world, others by the query using it.
+    b8 persistent;
+};
+
+// Adds a newly created archetype to every persistent query it matches.
+extern void query_cache_register_archetype(ECS *ecs, Archetype *archetype);
+// Drops archetypes marked with ARCHETYPE_REMOVED from every persistent query.
+extern void query_cache_unregister_archetypes(ECS *ecs);
+extern void query_cache_refresh(ECS *ecs, QueryCache *cache);
+// Takes a new tick for the query, the one its writes are marked with.
+extern void query_cache_tick(ECS *ecs, QueryCache *cache);
+// Takes a new tick for the query and refreshes its chunks.
+extern void query_cache_begin(ECS *ecs, QueryCache *cache);
+// Marks the written fields of every chunk of the query as changed, for
+// parallel systems whose iterators don't, see 'ecs_query_iter_get_field()'.
+extern void query_cache_mark_written(QueryCache *cache);
+extern void query_cache_free(QueryCache *cache);
+
+// -- Thread pool --------------------------------------------------------------
+// Fixed set of worker threads that all run the same function, together with
+// the calling thread, until it returns. The calling thread has index 0.
+typedef struct ThreadPool ThreadPool;
+typedef void (*ThreadPoolFunc)(void *data, u32 thread_index);
+
+extern u32 thread_pool_cpu_count(void);
+extern ThreadPool *thread_pool_new(u32 worker_count);
+extern void thread_pool_free(ThreadPool *pool);
+extern void thread_pool_run(ThreadPool *pool, ThreadPoolFunc func, void *data);
+
+// -- Rollback -----------------------------------------------------------------
+// Copy of a chunk, shared by consecutive saved states as long as the chunk
+// isn't written to. Followed by a copy of the ticks and enabled bits of the
+// chunk, in the same layout.
+struct RollbackChunk {
+    u32 refs;
+    size_t count;
+    size_t disabled;
+    size_t size;
+    u8 *data;
+    u64 ticks[];
+};
+
+typedef struct RollbackArchetype RollbackArchetype;
+struct RollbackArchetype {
+    Archetype *archetype;
+    size_t count;
+    // Range of 'chunks' of the saved state.
+    size_t first_chunk;
+    size_t chunk_count;
+};
+
+// Sparse sets are copied whole, the entities, added ticks and components of
+// each one packed into 'sparse_data' at 'offset'.
+typedef struct RollbackSparse RollbackSparse;
+struct RollbackSparse {
+    size_t count;
+    size_t offset;
+};
+
+typedef struct RollbackFrame RollbackFrame;
+struct RollbackFrame {
+    Vec(RollbackArchetype) archetypes;
+    Vec(RollbackChunk *) chunks;
+    // One per sparse component of the world at the time, in the same order.
+    Vec(RollbackSparse) sparse;
+    Vec(u8) sparse_data;
+    Vec(u32) entity_generation;
+    Vec(u32) entity_free_list;
+    u32 entity_current_id;
+};
+
+// Ring of 'capacity' saved states, 'count' of them starting at 'first' being
+// in use. Frames keep their memory when reused. A chunk whose row and layout
+// ticks aren't past 'tick', the world tick of the last save or restore, holds
+// the same data as its 'saved' copy.
+typedef struct Rollback Rollback;
+struct Rollback {
+    RollbackFrame *frames;
+    u32 capacity;
+    u32 first;
+    u32 count;
+    u64 tick;
+    // Chunks copied by the last save, the others being shared.
+    size_t copied_chunks;
+    Vec(u32) archetype_lookup;
+};
+
+extern void rollback_chunk_release(ECS *ecs, RollbackChunk *chunk);
+// Drops every saved state and the copies held by chunks.
+extern void rollback_free(ECS *ecs);
 
 // -- ECS ----------------------------------------------------------------------
+// Generation bit set on every entity of a staging world, telling its entities
+// apart from those of a live world with the same index.
+#define ENTITY_GENERATION_STAGED (1u << 31)
+
 // The central structure connecting every other internal part.
+typedef struct ComponentObserver ComponentObserver;
+struct ComponentObserver {
+    Observer func;
+    void *user_ptr;
+};
+
 typedef struct Component Component;
 struct Component {
+    Str name;
     size_t size;
-};
-
-typedef struct InternalSystem InternalSystem;
-struct InternalSystem {
-    System func;
-    QueryDesc desc;
+    ComponentStorage storage;
+    // Only used by sparse components.
+    SparseSet sparse;
+    Vec(ComponentObserver) observers[OBSERVER_EVENT_COUNT];
+    SnapshotSave snapshot_save;
+    SnapshotLoad snapshot_load;
+    ComponentRemap remap;
 };
 
 typedef enum {
     COMMAND_ENTITY_SPAWN,
+    COMMAND_ENTITY_SPAWN_BATCH,
+    COMMAND_ENTITY_INSTANTIATE,
     COMMAND_ENTITY_KILL,
+    COMMAND_ENTITY_SET_ENABLED,
     COMMAND_ENTITY_COMPONENT_ADD,
     COMMAND_ENTITY_COMPONENT_REMOVE,
 } CommandType;
 
+// A deferred batch spawn is stored in the command arena as this header
+// followed by 'count' entities and 'column_count' columns.
+typedef struct SpawnBatch SpawnBatch;
+struct SpawnBatch {
+    size_t count;
+    size_t column_count;
+};
+
+// A deferred instantiation is stored as this header followed by 'count'
+// entities and the user data of the override.
+typedef struct PrefabInstantiate PrefabInstantiate;
+struct PrefabInstantiate {
+    Entity prefab;
+    size_t count;
+    PrefabOverride override;
+    size_t user_data_offset;
+};
+
+typedef struct SpawnBatchColumn SpawnBatchColumn;
+struct SpawnBatchColumn {
+    ComponentId id;
+    b8 fill;
+    size_t offset;
+};
+
+#define COMMAND_NONE ((u32) -1)
+
 typedef struct Command Command;
 struct Command {
     CommandType type;
     Entity entity;
     ComponentId component_id;
-    void *data;
+    // Offset of the payload in the arena of the command buffer.
+    size_t offset;
+    // Next command of the same entity. Only valid during playback.
+    u32 next;
+};
+
+// Payloads are written into a linear arena and referred to by offset since
+// the arena moves when it grows. Both the commands and the arena are reset
+// after playback, keeping their memory for the next frame.
+typedef struct CommandBuffer CommandBuffer;
+struct CommandBuffer {
+    Vec(Command) commands;
+    u8 *arena;
+    size_t arena_size;
+    size_t arena_capacity;
+};
+
+// Chain of commands targeting the same entity, gathered during playback.
+typedef struct PendingEntity PendingEntity;
+struct PendingEntity {
+    Entity entity;
+    u32 first;
+    u32 last;
+};
+
+// Consecutive entries of 'QueryCache.chunks' processed by one task of a
+// parallel system.
+typedef struct QueryRange QueryRange;
+struct QueryRange {
+    size_t first;
+    size_t count;
+};
+
+#define DEFAULT_GRAIN_SIZE 1024
+
+typedef struct InternalSystem InternalSystem;
+struct InternalSystem {
+    System func;
+    QueryCache *query;
+    void *user_ptr;
+
+    // Later systems of the group conflicting with this one and the number of
+    // earlier systems this one has to wait for.
+    Vec(u32) dependents;
+    u32 dependency_count;
+
+    // State of a parallel run. A system is split into tasks, one per range
+    // for parallel systems and a single one otherwise.
+    u32 waiting;
+    Vec(QueryRange) ranges;
+    u32 task_count;
+    u32 tasks_started;
+    u32 tasks_left;
+    // Deferred commands recorded by each task, merged in registration and
+    // task order afterwards.
+    Vec(CommandBuffer) commands;
 };
 
 struct ECS {
     HashMap(Str, ComponentId) component_map;
     Vec(Component) components;
+    Vec(ComponentId) sparse_components;
 
     Archetype * root_archetype;
-    HashMap(Type, Archetype *) archetype_map;
+    // Every archetype in creation order together with its signature, kept in
+    // a separate array so queries can scan them without touching the
+    // archetypes. 'archetype_table' is an open addressing hash table of
+    // indices + 1 keyed by signature hash, 0 being an empty slot.
+    Vec(Archetype *) archetypes;
+    Vec(Signature) archetype_signatures;
+    Vec(u32) archetype_table;
+    // Free chunks of CHUNK_SIZE bytes.
+    Vec(u8 *) chunk_pool;
+    // Bumped whenever an entity is added to or removed from an archetype, or
+    // enabled or disabled.
+    u64 structure_version;
+    // Every query takes the current tick when it begins and bumps it, so
+    // changes made outside of queries are always newer than any query that
+    // has begun.
+    u64 tick;
+    // Number of compaction passes so far and the archetype the next one
+    // starts scanning at.
+    u64 compact_frame;
+    size_t compact_cursor;
+    Rollback rollback;
 
-    HashMap(Entity, ArchetypeColumn) entity_map;
+    // Where each entity lives, indexed by the lower 32 bits (the index) of
+    // the entity id. Stale handles are rejected by comparing the upper 32 bits
+    // against 'entity_generation'. An entity that has been allocated but not
+    // yet placed, i.e. a deferred spawn, has a NULL archetype.
+    Vec(ArchetypeColumn) entity_records;
     Vec(uint32_t) entity_generation;
     Vec(uint32_t) entity_free_list;
     uint32_t entity_current_id;
+    // Or'ed into every generation, ENTITY_GENERATION_STAGED in a staging
+    // world and 0 otherwise.
+    uint32_t entity_generation_tag;
+    // While systems run in parallel the entity vectors can't grow, so new
+    // entities are given indices past 'entity_current_id' and get their slot
+    // once the systems have finished.
+    b8 parallel;
+    pthread_mutex_t entity_lock;
+    uint32_t entity_reserved_count;
 
-    HashMap(ComponentId, HashSet(Archetype *)) component_archetype_set_map;
+    Vec(QueryCache *) query_caches;
 
     Vec(Vec(InternalSystem)) systems;
+    u32 worker_count;
+    ThreadPool *thread_pool;
+    Vec(u32) systems_ready;
 
     // Commands are deferred and executed once a query has finished because
     // it's not safe to modify the data which is being executed upon within
     // a query/system.
     u32 active_queries; 
-    Vec(Command) command_queue;
+    CommandBuffer command_buffer;
+    // Buffer being played back, swapped with 'command_buffer' so commands
+    // recorded during playback are kept for the next round.
+    CommandBuffer playback_buffer;
+    // Most commands and arena bytes played back in one round.
+    size_t command_high_water;
+    size_t command_bytes_high_water;
+
+    // Scratch memory used for coalescing commands per entity. The lookup is
+    // indexed by entity index and holds COMMAND_NONE for untouched entities.
+    Vec(u32) pending_lookup;
+    Vec(PendingEntity) pending;
+    Vec(ComponentData) pending_add;
+    Vec(ComponentId) pending_remove;
 };
 
 extern void _ecs_process_command_queue(ECS *ecs);
+extern void _ecs_notify_observers(ECS *ecs, ObserverEvent event, ComponentId component, const Entity *entities, size_t count, void *components);
+
+// Calls the observers of a component, if it has any.
+static inline void _ecs_notify(ECS *ecs, ObserverEvent event, ComponentId component, const Entity *entities, size_t count, void *components) {
+    if (vec_len(ecs->components[component].observers[event]) > 0) {
+        _ecs_notify_observers(ecs, event, component, entities, count, components);
+    }
+}
+// Allocates IDs for 'count' entities without placing them.
+extern void _ecs_allocate_entities(ECS *ecs, Entity *entities, size_t count);
+// Adds or overwrites a sparse component, calling its observers.
+extern void _ecs_sparse_insert(ECS *ecs, ComponentId component_id, Entity entity, const void *data);
+// Returns the record of a live and placed entity, otherwise NULL.
+extern ArchetypeColumn *_ecs_entity_record(ECS *ecs, Entity entity);
@@ -0,0 +1,197 @@
+#include "core.h"
+#include "ds.h"
+#include "internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MERGE_NONE ((Entity) -1)
+
+// New ID of every entity of the staging world indexed by entity index,
+// MERGE_NONE for those staying behind.
+struct EntityRemap {
+    const ECS *src;
+    const Entity *entities;
+};
+
+Entity entity_remap(const EntityRemap *remap, Entity entity) {
+    u32 index = entity;
+    u32 generation = entity >> 32;
+    if (!(generation & ENTITY_GENERATION_STAGED) ||
+            index >= remap->src->entity_current_id ||
+            remap->src->entity_generation[index] != generation ||
+            remap->entities[index] == MERGE_NONE) {
+        return entity;
+    }
+    return remap->entities[index];
+}
+
+void ecs_register_remap_hook_id(ECS *ecs, ComponentId component, ComponentRemap remap) {
+    assert(component < vec_len(ecs->components) && "Remap hook for non-existent component.");
+    ecs->components[component].remap = remap;
+}
+
+static b8 merge_components_match(const ECS *dst, const ECS *src) {
+    if (vec_len(src->components) > vec_len(dst->components)) {
+        log_error("Merging a world with %zu components into one with %zu.", vec_len(src->components), vec_len(dst->components));
+        return false;
+    }
+    for (size_t i = 0; i < vec_len(src->components); i++) {
+        const Component *a = &dst->components[i];
+        const Component *b = &src->components[i];
+        if (str_cmp(&a->name, &b->name, sizeof(Str)) != 0 ||
+                a->size != b->size || a->storage != b->storage) {
+            log_error("Merging component '%.*s' into '%.*s', components must be registered in the same order.",
+                    str_arg(b->name), str_arg(a->name));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Prefabs stay in the staging world so it can instantiate them again.
+static b8 merge_archetype_moves(const Archetype *archetype) {
+    return archetype->current_index > 0 &&
+        archetype_component_row(archetype, _ecs_component_Prefab) == ARCHETYPE_NO_ROW;
+}
+
+// Appends the archetype to its counterpart in 'dst', 'ids' holding the new ID
+// of each of its entities in column order.
+static void merge_archetype(ECS *dst, const EntityRemap *remap, Archetype *archetype, const Entity *ids, Vec(ComponentColumn) *columns) {
+    Archetype *target = archetype_get_or_new(dst, archetype->type);
+    size_t len = type_len(archetype->type);
+
+    for (size_t i = 0; i < vec_len(archetype->chunks); i++) {
+        Chunk *chunk = &archetype->chunks[i];
+        vec_clear(*columns);
+        for (size_t j = 0; j < len; j++) {
+            ComponentId id = archetype->type[j];
+            void *components = archetype_component(archetype, j, i*archetype->chunk_capacity);
+            ComponentRemap hook = dst->components[id].remap;
+            if (hook != NULL && archetype->row_sizes[j] > 0) {
+                hook(dst, remap, components, chunk->count);
+            }
+            vec_push(*columns, (ComponentColumn) {
+                    .id = id,
+                    .data = components,
+                });
+        }
+
+        size_t first = archetype_spawn_rows(dst, target, &ids[i*archetype->chunk_capacity], chunk->count, *columns);
+        for (size_t j = 0; j < chunk->count && chunk->disabled > 0; j++) {
+            if (!chunk_enabled(chunk, j)) {
+                archetype_set_enabled(dst, target, first + j, false);
+            }
+        }
+    }
+}
+
+static void merge_sparse(ECS *dst, ECS *src, const EntityRemap *remap, ComponentId component) {
+    SparseSet *set = &src->components[component].sparse;
+    ComponentRemap hook = dst->components[component].remap;
+    for (size_t i = 0; i < vec_len(set->dense); i++) {
+        Entity entity = remap->entities[(u32) set->dense[i]];
+        if (entity == MERGE_NONE) {
+            continue;
+        }
+        void *data = sparse_set_component(set, i);
+        if (hook != NULL && set->component_size > 0) {
+            hook(dst, remap, data, 1);
+        }
+        _ecs_sparse_insert(dst, component, entity, set->component_size > 0 ? data : NULL);
+    }
+
+    // Walking backwards only ever swaps in components already visited.
+    for (size_t i = vec_len(set->dense); i > 0; i--) {
+        Entity entity = set->dense[i - 1];
+        if (remap->entities[(u32) entity] != MERGE_NONE) {
+            sparse_set_remove(set, entity);
+        }
+    }
+}
+
+b8 ecs_merge(ECS *dst, ECS *src) {
+    assert(dst != src && "Merging a world into itself.");
+    if (dst->active_queries > 0 || src->active_queries > 0) {
+        log_error("Merging worlds inside a query.");
+        return false;
+    }
+    if (src->entity_generation_tag != ENTITY_GENERATION_STAGED || dst->entity_generation_tag != 0) {
+        log_error("Merging needs a staging world, from 'ecs_new_staging()', merged into a live one.");
+        return false;
+    }
+    if (!merge_components_match(dst, src)) {
+        return false;
+    }
+
+    // Every moving entity gets its new ID up front so references between
+    // them can be remapped before anything is copied.
+    Entity *entities = malloc(sizeof(Entity)*(src->entity_current_id + 1));
+    for (u32 i = 0; i < src->entity_current_id; i++) {
+        entities[i] = MERGE_NONE;
+    }
+    Vec(Entity) moved = NULL;
+    for (size_t i = 0; i < vec_len(src->archetypes); i++) {
+        Archetype *archetype = src->archetypes[i];
+        if (!merge_archetype_moves(archetype)) {
+            continue;
+        }
+        for (size_t j = 0; j < archetype->current_index; j++) {
+            vec_push(moved, *archetype_entity(archetype, j));
+        }
+    }
+    size_t count = vec_len(moved);
+    Entity *ids = malloc(sizeof(Entity)*(count + 1));
+    _ecs_allocate_entities(dst, ids, count);
+    for (size_t i = 0; i < count; i++) {
+        entities[(u32) moved[i]] = ids[i];
+    }
+    EntityRemap remap = {
+        .src = src,
+        .entities = entities,
+    };
+
+    Vec(ComponentColumn) columns = NULL;
+    size_t offset = 0;
+    for (size_t i = 0; i < vec_len(src->archetypes); i++) {
+        Archetype *archetype = src->archetypes[i];
+        if (merge_archetype_moves(archetype)) {
+            merge_archetype(dst, &remap, archetype, &ids[offset], &columns);
+            offset += archetype->current_index;
+        }
+    }
+    for (size_t i = 0; i < vec_len(src->sparse_components); i++) {
+        merge_sparse(dst, src, &remap, src->sparse_components[i]);
+    }
+
+    // The staging world drops the moved entities wholesale.
+    for (size_t i = 0; i < vec_len(src->archetypes); i++) {
+        Archetype *archetype = src->archetypes[i];
+        if (!merge_archetype_moves(archetype)) {
+            continue;
+        }
+        while (vec_len(archetype->chunks) > 0) {
+            archetype_pop_chunk(src, archetype);
+        }
+        archetype->current_index = 0;
+        archetype->empty_since = src->compact_frame;
+    }
+    for (size_t i = 0; i < count; i++) {
+        u32 index = moved[i];
+        src->entity_generation[index] = (src->entity_generation[index] + 1) | ENTITY_GENERATION_STAGED;
+        vec_push(src->entity_free_list, index);
+        src->entity_records[index] = (ArchetypeColumn) {0};
+    }
+    src->structure_version++;
+
+    vec_free(columns);
+    vec_free(moved);
+    free(ids);
+    free(entities);
+
+    if (vec_len(dst->command_buffer.commands) > 0) {
+        _ecs_process_command_queue(dst);
+    }
+    return true;
+}
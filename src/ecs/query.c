@@ -3,90 +3,486 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-Query ecs_query(ECS *ecs, QueryDesc desc) {
-    ecs->active_queries++;
-
+static size_t query_field_count(const QueryDesc *desc) {
     size_t field_count = 0;
-    Vec(HashSet(Archetype *)) sets = NULL;
     for (; field_count < MAX_QUERY_FIELDS; field_count++) {
-        if (desc.fields[field_count] == QUERY_FIELDS_END) {
+        if (desc->fields[field_count] == QUERY_FIELDS_END) {
             break;
         }
+    }
+    return field_count;
+}
 
-        HashSet(Archetype *) set = hash_map_get(ecs->component_archetype_set_map, desc.fields[field_count]);
-        if (set == NULL) {
-            return (Query) {0};
+// A chunk passes the Changed and Added terms if every one of them has been
+// touched since the query last began.
+static b8 query_cache_chunk_passes(const QueryCache *cache, const Archetype *archetype, const Chunk *chunk) {
+    for (size_t i = 0; i < cache->field_count; i++) {
+        Entity field = cache->desc.fields[i];
+        if ((field & (QUERY_TERM_CHANGED | QUERY_TERM_ADDED)) == 0 || cache->sparse_fields[i]) {
+            continue;
+        }
+        // A missing component has neither changed nor been added.
+        u32 row = archetype_component_row(archetype, query_term_id(field));
+        if (row == ARCHETYPE_NO_ROW) {
+            return false;
+        }
+        if ((field & QUERY_TERM_CHANGED) && chunk->changed_ticks[row] <= cache->last_run) {
+            return false;
+        }
+        if ((field & QUERY_TERM_ADDED) && chunk->added_ticks[row] <= cache->last_run) {
+            return false;
         }
-        vec_push(sets, set);
     }
+    return true;
+}
+
+// Or groups of consecutive fields need at least one of their components. Any
+// entity of the archetype might have a sparse one.
+static b8 query_cache_match_or(const QueryCache *cache, const Archetype *archetype) {
+    b8 or_matched = false;
+    for (size_t i = 0; i < cache->field_count; i++) {
+        Entity field = cache->desc.fields[i];
+        if (!(field & QUERY_TERM_OR)) {
+            continue;
+        }
 
-    if (vec_len(sets) == 0) {
-        return (Query) {0};
-    } else if (vec_len(sets) == 1) {
-        Vec(Archetype *) archetypes = hash_set_to_vec(sets[0]);
-        return (Query) {
-            .count = vec_len(archetypes),
-            ._desc = desc,
-            ._field_count = field_count,
-            ._archetypes = (void **) archetypes,
-        };
+        or_matched |= cache->sparse_fields[i] ||
+            archetype_component_row(archetype, query_term_id(field)) != ARCHETYPE_NO_ROW;
+        // End of the group.
+        if (i + 1 == cache->field_count || !(cache->desc.fields[i + 1] & QUERY_TERM_OR)) {
+            if (!or_matched) {
+                return false;
+            }
+            or_matched = false;
+        }
     }
+    return true;
+}
+
+// Checks the sparse fields of an entity of a matched archetype, along with
+// the Or groups they're part of.
+static b8 query_cache_entity_passes(const QueryCache *cache, const Archetype *archetype, Entity entity) {
+    b8 or_matched = false;
+    for (size_t i = 0; i < cache->field_count; i++) {
+        Entity field = cache->desc.fields[i];
+        b8 present;
+        if (cache->sparse_fields[i]) {
+            const SparseSet *set = &cache->ecs->components[query_term_id(field)].sparse;
+            u32 index = sparse_set_index(set, entity);
+            present = index != SPARSE_SET_NONE;
+            if (field & QUERY_TERM_WITHOUT) {
+                if (present) {
+                    return false;
+                }
+                continue;
+            }
+            if (!(field & (QUERY_TERM_OPTIONAL | QUERY_TERM_OR)) && !present) {
+                return false;
+            }
+            if ((field & QUERY_TERM_CHANGED) && (!present || set->changed_ticks[index] <= cache->last_run)) {
+                return false;
+            }
+            if ((field & QUERY_TERM_ADDED) && (!present || set->added_ticks[index] <= cache->last_run)) {
+                return false;
+            }
+        } else if (field & QUERY_TERM_OR) {
+            present = archetype_component_row(archetype, query_term_id(field)) != ARCHETYPE_NO_ROW;
+        } else {
+            continue;
+        }
 
-    HashSet(Archetype *) intersection = sets[0];
-    for (size_t i = 1; i < vec_len(sets); i++) {
-        HashSet(Archetype *) old_intersection = intersection;
-        intersection = hash_set_intersect(intersection, sets[i]);
-        // Don't free the first one since that hash set lives inside
-        // component_archetype_set_map.
-        if (i != 1) {
-            hash_set_free(old_intersection);
+        if (!(field & QUERY_TERM_OR)) {
+            continue;
+        }
+        or_matched |= present;
+        if (i + 1 == cache->field_count || !(cache->desc.fields[i + 1] & QUERY_TERM_OR)) {
+            if (!or_matched) {
+                return false;
+            }
+            or_matched = false;
+        }
+    }
+    return true;
+}
+
+static b8 query_cache_match(ECS *ecs, const QueryCache *cache, const Archetype *archetype) {
+    if (cache->field_count == 0) {
+        return false;
+    }
+    if (!signature_match(&ecs->archetype_signatures[archetype->index], &cache->with, &cache->without)) {
+        return false;
+    }
+    return !cache->has_or || query_cache_match_or(cache, archetype);
+}
+
+// Sets up the masks of a cache from its description. Prefabs are excluded
+// unless a field mentions them.
+static void query_cache_init(ECS *ecs, QueryCache *cache) {
+    cache->ecs = ecs;
+    cache->field_count = query_field_count(&cache->desc);
+    cache->version = -1;
+    b8 prefabs = false;
+    for (size_t i = 0; i < cache->field_count; i++) {
+        Entity field = cache->desc.fields[i];
+        ComponentId id = query_term_id(field);
+        assert(id < vec_len(ecs->components) && "Query non-existent component.");
+        prefabs |= id == _ecs_component_Prefab;
+        if (field & (QUERY_TERM_CHANGED | QUERY_TERM_ADDED)) {
+            cache->filtered = true;
+        }
+        if (ecs->components[id].storage == COMPONENT_STORAGE_SPARSE) {
+            cache->sparse = true;
+            cache->sparse_fields[i] = true;
+            cache->sparse_fetched |= !(field & QUERY_TERM_WITHOUT);
+            cache->has_or |= (field & QUERY_TERM_OR) != 0;
+            continue;
+        }
+        if (field & QUERY_TERM_OR) {
+            cache->has_or = true;
+        } else if (field & QUERY_TERM_WITHOUT) {
+            signature_set(&cache->without, id);
+        } else if (!(field & QUERY_TERM_OPTIONAL)) {
+            signature_set(&cache->with, id);
         }
     }
-    vec_free(sets);
+    if (!prefabs) {
+        signature_set(&cache->without, _ecs_component_Prefab);
+    }
+}
 
-    Vec(Archetype *) archetypes = hash_set_to_vec(intersection);
-    hash_set_free(intersection);
+static void query_cache_add_archetype(QueryCache *cache, Archetype *archetype) {
+    vec_push(cache->archetypes, archetype);
+    if (!cache->sparse) {
+        return;
+    }
+    while (vec_len(cache->archetype_lookup) <= archetype->index) {
+        vec_push(cache->archetype_lookup, 0);
+    }
+    cache->archetype_lookup[archetype->index] = vec_len(cache->archetypes);
+}
+
+// Matches every existing archetype by scanning the signature table.
+static void query_cache_match_all(ECS *ecs, QueryCache *cache) {
+    if (cache->field_count == 0) {
+        return;
+    }
+
+    Vec(u32) matches = NULL;
+    signature_match_all(ecs->archetype_signatures, vec_len(ecs->archetype_signatures),
+            &cache->with, &cache->without, &matches);
+    for (size_t i = 0; i < vec_len(matches); i++) {
+        Archetype *archetype = ecs->archetypes[matches[i]];
+        if (!cache->has_or || query_cache_match_or(cache, archetype)) {
+            query_cache_add_archetype(cache, archetype);
+        }
+    }
+    vec_free(matches);
+}
+
+void query_cache_register_archetype(ECS *ecs, Archetype *archetype) {
+    for (size_t i = 0; i < vec_len(ecs->query_caches); i++) {
+        QueryCache *cache = ecs->query_caches[i];
+        if (query_cache_match(ecs, cache, archetype)) {
+            query_cache_add_archetype(cache, archetype);
+        }
+    }
+}
+
+void query_cache_unregister_archetypes(ECS *ecs) {
+    for (size_t i = 0; i < vec_len(ecs->query_caches); i++) {
+        QueryCache *cache = ecs->query_caches[i];
+        Vec(Archetype *) archetypes = cache->archetypes;
+        vec_free(cache->archetype_lookup);
+        cache->archetypes = NULL;
+        cache->archetype_lookup = NULL;
+        for (size_t j = 0; j < vec_len(archetypes); j++) {
+            if (archetypes[j]->index != ARCHETYPE_REMOVED) {
+                query_cache_add_archetype(cache, archetypes[j]);
+            }
+        }
+        vec_free(archetypes);
+        // Chunks refer to archetypes by position.
+        cache->version = -1;
+    }
+}
+
+// Pushes the runs of enabled columns of a chunk, skipping 64 columns at a
+// time where every entity is disabled, or enabled.
+static void query_cache_push_enabled(QueryCache *cache, u32 archetype_index, u32 chunk_index, const Chunk *chunk) {
+    size_t column = 0;
+    while (column < chunk->count) {
+        u64 enabled = chunk->enabled[column / 64] >> (column % 64);
+        if (enabled == 0) {
+            column = (column / 64 + 1)*64;
+            continue;
+        }
+        column += __builtin_ctzll(enabled);
+
+        // Bits past the last column are clear so every run ends in time.
+        size_t first = column;
+        while (column < chunk->count) {
+            u64 disabled = ~chunk->enabled[column / 64] >> (column % 64);
+            if (disabled == 0) {
+                column = (column / 64 + 1)*64;
+                continue;
+            }
+            column += __builtin_ctzll(disabled);
+            break;
+        }
+
+        vec_push(cache->chunks, ((QueryChunk) {
+                .archetype = archetype_index,
+                .chunk = chunk_index,
+                .first = first,
+                .count = column - first,
+            }));
+    }
+}
+
+// Adds a single column of a matched archetype if the entity passes, merging
+// it into the previous entry when no sparse component is fetched.
+static void query_cache_push_column(QueryCache *cache, u32 archetype_index, size_t column, Entity entity) {
+    const Archetype *archetype = cache->archetypes[archetype_index];
+    u32 chunk = column / archetype->chunk_capacity;
+    u32 first = column % archetype->chunk_capacity;
+    if (!cache->desc.include_disabled && !chunk_enabled(&archetype->chunks[chunk], first)) {
+        return;
+    }
+    if (cache->filtered && !query_cache_chunk_passes(cache, archetype, &archetype->chunks[chunk])) {
+        return;
+    }
+    if (!query_cache_entity_passes(cache, archetype, entity)) {
+        return;
+    }
+
+    if (!cache->sparse_fetched && vec_len(cache->chunks) > 0) {
+        QueryChunk *last = &cache->chunks[vec_len(cache->chunks)-1];
+        if (last->archetype == archetype_index && last->chunk == chunk && last->first + last->count == first) {
+            last->count++;
+            return;
+        }
+    }
+    vec_push(cache->chunks, ((QueryChunk) {
+            .archetype = archetype_index,
+            .chunk = chunk,
+            .first = first,
+            .count = 1,
+        }));
+}
+
+// A required sparse component drives the iteration from its set, which
+// usually holds far fewer entities than the matched archetypes. Otherwise
+// every entity of the matched archetypes is checked.
+static void query_cache_refresh_sparse(ECS *ecs, QueryCache *cache) {
+    const SparseSet *driver = NULL;
+    for (size_t i = 0; i < cache->field_count; i++) {
+        Entity field = cache->desc.fields[i];
+        if (!cache->sparse_fields[i] ||
+                (field & (QUERY_TERM_WITHOUT | QUERY_TERM_OPTIONAL | QUERY_TERM_OR))) {
+            continue;
+        }
+        const SparseSet *set = &ecs->components[query_term_id(field)].sparse;
+        if (driver == NULL || vec_len(set->dense) < vec_len(driver->dense)) {
+            driver = set;
+        }
+    }
+
+    if (driver != NULL) {
+        for (size_t i = 0; i < vec_len(driver->dense); i++) {
+            Entity entity = driver->dense[i];
+            ArchetypeColumn record = ecs->entity_records[(uint32_t) entity];
+            if (record.archetype == NULL ||
+                    record.archetype->index >= vec_len(cache->archetype_lookup) ||
+                    cache->archetype_lookup[record.archetype->index] == 0) {
+                continue;
+            }
+            query_cache_push_column(cache, cache->archetype_lookup[record.archetype->index] - 1, record.index, entity);
+        }
+        return;
+    }
+
+    for (u32 i = 0; i < vec_len(cache->archetypes); i++) {
+        const Archetype *archetype = cache->archetypes[i];
+        for (size_t j = 0; j < vec_len(archetype->chunks); j++) {
+            const Chunk *chunk = &archetype->chunks[j];
+            for (size_t k = 0; k < chunk->count; k++) {
+                query_cache_push_column(cache, i, j*archetype->chunk_capacity + k, ((Entity *) chunk->data)[k]);
+            }
+        }
+    }
+}
+
+void query_cache_refresh(ECS *ecs, QueryCache *cache) {
+    if (cache->version == ecs->structure_version && !cache->filtered && !cache->sparse) {
+        return;
+    }
+
+    vec_clear(cache->chunks);
+    if (cache->sparse) {
+        query_cache_refresh_sparse(ecs, cache);
+        cache->version = ecs->structure_version;
+        return;
+    }
+    for (u32 i = 0; i < vec_len(cache->archetypes); i++) {
+        const Archetype *archetype = cache->archetypes[i];
+        for (u32 j = 0; j < vec_len(archetype->chunks); j++) {
+            const Chunk *chunk = &archetype->chunks[j];
+            if (cache->filtered && !query_cache_chunk_passes(cache, archetype, chunk)) {
+                continue;
+            }
+            if (chunk->disabled > 0 && !cache->desc.include_disabled) {
+                query_cache_push_enabled(cache, i, j, chunk);
+                continue;
+            }
+            vec_push(cache->chunks, ((QueryChunk) {
+                    .archetype = i,
+                    .chunk = j,
+                    .count = chunk->count,
+                }));
+        }
+    }
+    cache->version = ecs->structure_version;
+}
+
+void query_cache_tick(ECS *ecs, QueryCache *cache) {
+    cache->last_run = cache->this_run;
+    cache->this_run = ecs->tick++;
+}
+
+void query_cache_begin(ECS *ecs, QueryCache *cache) {
+    query_cache_tick(ecs, cache);
+    query_cache_refresh(ecs, cache);
+}
+
+void query_cache_mark_written(QueryCache *cache) {
+    for (size_t i = 0; i < vec_len(cache->chunks); i++) {
+        Archetype *archetype = cache->archetypes[cache->chunks[i].archetype];
+        Chunk *chunk = &archetype->chunks[cache->chunks[i].chunk];
+        for (size_t field = 0; field < cache->field_count; field++) {
+            if (cache->sparse_fields[field] || cache->desc.access[field] != QUERY_ACCESS_WRITE) {
+                continue;
+            }
+            u32 row = archetype_component_row(archetype, query_term_id(cache->desc.fields[field]));
+            if (row != ARCHETYPE_NO_ROW) {
+                chunk->changed_ticks[row] = cache->this_run;
+            }
+        }
+    }
+}
+
+void query_cache_free(QueryCache *cache) {
+    vec_free(cache->archetypes);
+    vec_free(cache->chunks);
+    vec_free(cache->archetype_lookup);
+    signature_free(&cache->with);
+    signature_free(&cache->without);
+    free(cache);
+}
+
+QueryCache *ecs_query_cache_new(ECS *ecs, QueryDesc desc) {
+    QueryCache *cache = malloc(sizeof(QueryCache));
+    *cache = (QueryCache) {
+        .desc = desc,
+        .persistent = true,
+    };
+    query_cache_init(ecs, cache);
+
+    // Match every existing archetype once, new ones are added by
+    // 'archetype_new()' as they're created.
+    query_cache_match_all(ecs, cache);
+
+    vec_push(ecs->query_caches, cache);
+    return cache;
+}
+
+Query ecs_query_cached(ECS *ecs, QueryCache *cache) {
+    ecs->active_queries++;
+    query_cache_begin(ecs, cache);
+
+    return (Query) {
+        .count = vec_len(cache->chunks),
+        ._cache = cache,
+    };
+}
+
+Query ecs_query(ECS *ecs, QueryDesc desc) {
+    ecs->active_queries++;
+
+    // One-off queries own a cache that isn't registered with the world and
+    // is freed by 'ecs_query_free()'.
+    QueryCache *cache = malloc(sizeof(QueryCache));
+    *cache = (QueryCache) {
+        .desc = desc,
+    };
+    query_cache_init(ecs, cache);
+    query_cache_match_all(ecs, cache);
+    query_cache_begin(ecs, cache);
 
     return (Query) {
-        .count = vec_len(archetypes),
-        ._desc = desc,
-        ._field_count = field_count,
-        ._archetypes = (void **) archetypes,
+        .count = vec_len(cache->chunks),
+        ._cache = cache,
     };
 }
 
 QueryIter ecs_query_get_iter(Query query, size_t i) {
     assert(i < query.count);
 
-    Vec(Archetype *) archetypes = (Archetype **) query._archetypes; 
-
-    size_t count = archetypes[i]->current_index;
+    QueryChunk entry = query._cache->chunks[i];
+    Archetype *archetype = query._cache->archetypes[entry.archetype];
+    Chunk chunk = archetype->chunks[entry.chunk];
     return (QueryIter) {
-        .count = count,
+        .count = entry.count,
+        .entities = (Entity *) chunk.data + entry.first,
+        .offset = entry.chunk*archetype->chunk_capacity + entry.first,
         ._i = i,
         ._query = query,
     };
 }
 
 void *ecs_query_iter_get_field(QueryIter iter, size_t field) {
-    assert(field < iter._query._field_count);
+    const QueryCache *cache = iter._query._cache;
+    assert(field < cache->field_count);
 
-    Archetype *archetype = ((Vec(Archetype *)) iter._query._archetypes)[iter._i];
-    size_t row = hash_map_get(archetype->component_lookup, iter._query._desc.fields[field]);
+    // Sparse fields only come with a single entity per iterator, unless
+    // they're excluded.
+    if (cache->sparse_fields[field]) {
+        SparseSet *set = &cache->ecs->components[query_term_id(cache->desc.fields[field])].sparse;
+        u32 index = sparse_set_index(set, iter.entities[0]);
+        if (index == SPARSE_SET_NONE) {
+            return NULL;
+        }
+        if (cache->desc.access[field] == QUERY_ACCESS_WRITE) {
+            set->changed_ticks[index] = cache->this_run;
+        }
+        return sparse_set_component(set, index);
+    }
 
-    return archetype->storage[row];
+    Archetype *archetype = cache->archetypes[cache->chunks[iter._i].archetype];
+    u32 row = archetype_component_row(archetype, query_term_id(cache->desc.fields[field]));
+    if (row == ARCHETYPE_NO_ROW) {
+        return NULL;
+    }
+    // Tasks of a parallel system can share a chunk, its ticks were marked
+    // before they started.
+    if (cache->desc.access[field] == QUERY_ACCESS_WRITE && !(cache->desc.parallel && cache->ecs->parallel)) {
+        archetype_chunk(archetype, iter.offset)->changed_ticks[row] = cache->this_run;
+    }
+
+    return archetype_component(archetype, row, iter.offset);
 }
 
 Entity ecs_query_iter_get_entity(QueryIter iter, size_t i) {
     assert(i < iter.count);
-    Archetype *archetype = ((Vec(Archetype *)) iter._query._archetypes)[iter._i];
-    return hash_map_get(archetype->entity_lookup, i);
+    return iter.entities[i];
 }
 
 void ecs_query_free(ECS *ecs, Query query) {
     ecs->active_queries--;
-    vec_free(query._archetypes);
+    if (query._cache != NULL && !query._cache->persistent) {
+        query_cache_free(query._cache);
+    }
 
     if (ecs->active_queries == 0) {
         _ecs_process_command_queue(ecs);
@@ -0,0 +1,319 @@
+#include "core.h"
+#include "ds.h"
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Ticks and enabled bits of a chunk, see 'archetype_push_chunk()'.
+static size_t rollback_ticks_len(const Archetype *archetype) {
+    return 2*type_len(archetype->type) + (archetype->chunk_capacity + 63) / 64;
+}
+
+void rollback_chunk_release(ECS *ecs, RollbackChunk *chunk) {
+    chunk->refs--;
+    if (chunk->refs == 0) {
+        chunk_release(ecs, chunk->data, chunk->size);
+        free(chunk);
+    }
+}
+
+// Whether the chunk still holds the data of its saved copy, i.e. nothing has
+// been written to it since the last save or restore.
+static b8 rollback_chunk_clean(const Rollback *rollback, const Archetype *archetype, const Chunk *chunk) {
+    if (chunk->saved == NULL || chunk->layout_tick > rollback->tick) {
+        return false;
+    }
+    for (size_t i = 0; i < type_len(archetype->type); i++) {
+        if (chunk->changed_ticks[i] > rollback->tick) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static RollbackChunk *rollback_chunk_copy(ECS *ecs, const Archetype *archetype, const Chunk *chunk) {
+    size_t ticks_len = rollback_ticks_len(archetype);
+    RollbackChunk *copy = malloc(sizeof(RollbackChunk) + ticks_len*sizeof(u64));
+    *copy = (RollbackChunk) {
+        .refs = 1,
+        .count = chunk->count,
+        .disabled = chunk->disabled,
+        .size = archetype->chunk_size,
+        .data = chunk_alloc(ecs, archetype->chunk_size),
+    };
+    memcpy(copy->data, chunk->data, archetype->chunk_size);
+    memcpy(copy->ticks, chunk->changed_ticks, ticks_len*sizeof(u64));
+    return copy;
+}
+
+// Overwrites a chunk with a copy, marking every row changed.
+static void rollback_chunk_restore(ECS *ecs, const Archetype *archetype, Chunk *chunk, RollbackChunk *copy) {
+    memcpy(chunk->data, copy->data, archetype->chunk_size);
+    memcpy(chunk->changed_ticks, copy->ticks, rollback_ticks_len(archetype)*sizeof(u64));
+    for (size_t i = 0; i < type_len(archetype->type); i++) {
+        chunk->changed_ticks[i] = ecs->tick;
+    }
+    chunk->count = copy->count;
+    chunk->disabled = copy->disabled;
+    chunk->layout_tick = ecs->tick;
+
+    copy->refs++;
+    if (chunk->saved != NULL) {
+        rollback_chunk_release(ecs, chunk->saved);
+    }
+    chunk->saved = copy;
+}
+
+static void rollback_frame_clear(ECS *ecs, RollbackFrame *frame) {
+    for (size_t i = 0; i < vec_len(frame->archetypes); i++) {
+        frame->archetypes[i].archetype->rollback_refs--;
+    }
+    for (size_t i = 0; i < vec_len(frame->chunks); i++) {
+        rollback_chunk_release(ecs, frame->chunks[i]);
+    }
+    vec_clear(frame->archetypes);
+    vec_clear(frame->chunks);
+    vec_clear(frame->sparse);
+    vec_clear(frame->sparse_data);
+    vec_clear(frame->entity_generation);
+    vec_clear(frame->entity_free_list);
+}
+
+static void rollback_append(Vec(u8) *data, const void *src, size_t size) {
+    if (size > 0) {
+        vec_insert_arr(*data, vec_len(*data), src, size);
+    }
+}
+
+static void rollback_save_archetype(ECS *ecs, RollbackFrame *frame, Archetype *archetype) {
+    vec_push(frame->archetypes, (RollbackArchetype) {
+            .archetype = archetype,
+            .count = archetype->current_index,
+            .first_chunk = vec_len(frame->chunks),
+            .chunk_count = vec_len(archetype->chunks),
+        });
+    archetype->rollback_refs++;
+
+    for (size_t i = 0; i < vec_len(archetype->chunks); i++) {
+        Chunk *chunk = &archetype->chunks[i];
+        if (!rollback_chunk_clean(&ecs->rollback, archetype, chunk)) {
+            if (chunk->saved != NULL) {
+                rollback_chunk_release(ecs, chunk->saved);
+            }
+            chunk->saved = rollback_chunk_copy(ecs, archetype, chunk);
+            ecs->rollback.copied_chunks++;
+        }
+        chunk->saved->refs++;
+        vec_push(frame->chunks, chunk->saved);
+    }
+}
+
+static void rollback_save_sparse(RollbackFrame *frame, const SparseSet *set) {
+    size_t count = vec_len(set->dense);
+    vec_push(frame->sparse, (RollbackSparse) {
+            .count = count,
+            .offset = vec_len(frame->sparse_data),
+        });
+    rollback_append(&frame->sparse_data, set->dense, sizeof(Entity)*count);
+    rollback_append(&frame->sparse_data, set->added_ticks, sizeof(u64)*count);
+    rollback_append(&frame->sparse_data, set->data, set->component_size*count);
+}
+
+void ecs_set_rollback_frames(ECS *ecs, u32 frames) {
+    if (ecs->active_queries > 0) {
+        log_error("Resizing the rollback ring inside a query.");
+        return;
+    }
+
+    rollback_free(ecs);
+    if (frames > 0) {
+        ecs->rollback.frames = calloc(frames, sizeof(RollbackFrame));
+        ecs->rollback.capacity = frames;
+    }
+}
+
+void ecs_rollback_save(ECS *ecs) {
+    Rollback *rollback = &ecs->rollback;
+    if (ecs->active_queries > 0) {
+        log_error("Saving rollback state inside a query.");
+        return;
+    }
+    if (rollback->capacity == 0) {
+        log_error("Saving rollback state without a ring, see 'ecs_set_rollback_frames()'.");
+        return;
+    }
+
+    RollbackFrame *frame;
+    if (rollback->count == rollback->capacity) {
+        frame = &rollback->frames[rollback->first];
+        rollback_frame_clear(ecs, frame);
+        rollback->first = (rollback->first + 1) % rollback->capacity;
+    } else {
+        frame = &rollback->frames[(rollback->first + rollback->count) % rollback->capacity];
+        rollback->count++;
+    }
+
+    rollback->copied_chunks = 0;
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        if (ecs->archetypes[i]->current_index > 0) {
+            rollback_save_archetype(ecs, frame, ecs->archetypes[i]);
+        }
+    }
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        rollback_save_sparse(frame, &ecs->components[ecs->sparse_components[i]].sparse);
+    }
+
+    if (ecs->entity_current_id > 0) {
+        vec_insert_arr(frame->entity_generation, 0, ecs->entity_generation, ecs->entity_current_id);
+    }
+    if (vec_len(ecs->entity_free_list) > 0) {
+        vec_insert_arr(frame->entity_free_list, 0, ecs->entity_free_list, vec_len(ecs->entity_free_list));
+    }
+    frame->entity_current_id = ecs->entity_current_id;
+
+    // Anything written from here on has a newer tick.
+    rollback->tick = ecs->tick;
+    ecs->tick++;
+}
+
+static void rollback_restore(ECS *ecs, const RollbackFrame *frame) {
+    Rollback *rollback = &ecs->rollback;
+
+    vec_clear(ecs->entity_generation);
+    vec_clear(ecs->entity_free_list);
+    if (frame->entity_current_id > 0) {
+        vec_insert_arr(ecs->entity_generation, 0, frame->entity_generation, frame->entity_current_id);
+    }
+    if (vec_len(frame->entity_free_list) > 0) {
+        vec_insert_arr(ecs->entity_free_list, 0, frame->entity_free_list, vec_len(frame->entity_free_list));
+    }
+    ecs->entity_current_id = frame->entity_current_id;
+
+    // Every entity is either free or placed in one of the archetypes below,
+    // which rewrite the records of the placed ones.
+    while (vec_len(ecs->entity_records) > ecs->entity_current_id) {
+        (void) vec_pop(ecs->entity_records);
+    }
+    while (vec_len(ecs->entity_records) < ecs->entity_current_id) {
+        vec_push(ecs->entity_records, (ArchetypeColumn) {0});
+    }
+    for (size_t i = 0; i < vec_len(ecs->entity_free_list); i++) {
+        ecs->entity_records[ecs->entity_free_list[i]] = (ArchetypeColumn) {0};
+    }
+
+    // Archetypes created since the state was saved, or empty back then, are
+    // emptied.
+    vec_clear(rollback->archetype_lookup);
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        vec_push(rollback->archetype_lookup, 0);
+    }
+    for (size_t i = 0; i < vec_len(frame->archetypes); i++) {
+        rollback->archetype_lookup[frame->archetypes[i].archetype->index] = i + 1;
+    }
+
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        Archetype *archetype = ecs->archetypes[i];
+        u32 lookup = rollback->archetype_lookup[i];
+        const RollbackArchetype *saved = lookup > 0 ? &frame->archetypes[lookup - 1] : NULL;
+        size_t count = saved != NULL ? saved->count : 0;
+        size_t chunk_count = saved != NULL ? saved->chunk_count : 0;
+
+        if (archetype->current_index > 0 && count == 0) {
+            archetype->empty_since = ecs->compact_frame;
+        }
+        archetype->current_index = count;
+        while (vec_len(archetype->chunks) > chunk_count) {
+            archetype_pop_chunk(ecs, archetype);
+        }
+        while (vec_len(archetype->chunks) < chunk_count) {
+            archetype_push_chunk(ecs, archetype);
+        }
+
+        for (size_t j = 0; j < chunk_count; j++) {
+            Chunk *chunk = &archetype->chunks[j];
+            RollbackChunk *copy = frame->chunks[saved->first_chunk + j];
+            if (chunk->saved != copy || !rollback_chunk_clean(rollback, archetype, chunk)) {
+                rollback_chunk_restore(ecs, archetype, chunk, copy);
+            }
+
+            const Entity *entities = (const Entity *) chunk->data;
+            for (size_t k = 0; k < chunk->count; k++) {
+                ecs->entity_records[(u32) entities[k]] = (ArchetypeColumn) {
+                    .archetype = archetype,
+                    .index = j*archetype->chunk_capacity + k,
+                };
+            }
+        }
+    }
+
+    // Sparse components registered since the state was saved are cleared.
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        SparseSet *set = &ecs->components[ecs->sparse_components[i]].sparse;
+        if (i >= vec_len(frame->sparse)) {
+            sparse_set_assign(set, NULL, NULL, NULL, 0, ecs->tick);
+            continue;
+        }
+        RollbackSparse sparse = frame->sparse[i];
+        const u8 *data = frame->sparse_data + sparse.offset;
+        sparse_set_assign(set, (const Entity *) data,
+                data + 2*sizeof(u64)*sparse.count,
+                (const u64 *) (data + sizeof(Entity)*sparse.count),
+                sparse.count, ecs->tick);
+    }
+
+    ecs->structure_version++;
+    rollback->tick = ecs->tick;
+    ecs->tick++;
+}
+
+b8 ecs_rollback(ECS *ecs, u32 frames) {
+    Rollback *rollback = &ecs->rollback;
+    if (ecs->active_queries > 0) {
+        log_error("Rolling back inside a query.");
+        return false;
+    }
+    if (frames >= rollback->count) {
+        return false;
+    }
+
+    for (u32 i = 0; i < frames; i++) {
+        rollback->count--;
+        rollback_frame_clear(ecs, &rollback->frames[(rollback->first + rollback->count) % rollback->capacity]);
+    }
+    rollback_restore(ecs, &rollback->frames[(rollback->first + rollback->count - 1) % rollback->capacity]);
+    return true;
+}
+
+u32 ecs_rollback_count(ECS *ecs) {
+    return ecs->rollback.count;
+}
+
+void rollback_free(ECS *ecs) {
+    Rollback *rollback = &ecs->rollback;
+    for (u32 i = 0; i < rollback->capacity; i++) {
+        RollbackFrame *frame = &rollback->frames[i];
+        rollback_frame_clear(ecs, frame);
+        vec_free(frame->archetypes);
+        vec_free(frame->chunks);
+        vec_free(frame->sparse);
+        vec_free(frame->sparse_data);
+        vec_free(frame->entity_generation);
+        vec_free(frame->entity_free_list);
+    }
+    free(rollback->frames);
+    vec_free(rollback->archetype_lookup);
+
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        Archetype *archetype = ecs->archetypes[i];
+        for (size_t j = 0; j < vec_len(archetype->chunks); j++) {
+            Chunk *chunk = &archetype->chunks[j];
+            if (chunk->saved != NULL) {
+                rollback_chunk_release(ecs, chunk->saved);
+                chunk->saved = NULL;
+            }
+        }
+    }
+
+    *rollback = (Rollback) {0};
+}
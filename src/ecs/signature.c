@@ -0,0 +1,136 @@
+#include "core.h"
+#include "ds.h"
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SIGNATURE_INLINE_BITS (SIGNATURE_WORDS*64)
+
+Signature signature_from_type(const Type type) {
+    Signature signature = {0};
+    for (size_t i = 0; i < type_len(type); i++) {
+        signature_set(&signature, type[i]);
+    }
+    return signature;
+}
+
+void signature_set(Signature *signature, ComponentId component) {
+    if (component < SIGNATURE_INLINE_BITS) {
+        signature->words[component / 64] |= (u64) 1 << (component % 64);
+        return;
+    }
+
+    size_t word = (component - SIGNATURE_INLINE_BITS) / 64;
+    if (word >= signature->overflow_count) {
+        signature->overflow = realloc(signature->overflow, (word + 1)*sizeof(u64));
+        memset(&signature->overflow[signature->overflow_count], 0, (word + 1 - signature->overflow_count)*sizeof(u64));
+        signature->overflow_count = word + 1;
+    }
+    signature->overflow[word] |= (u64) 1 << (component % 64);
+}
+
+b8 signature_test(const Signature *signature, ComponentId component) {
+    if (component < SIGNATURE_INLINE_BITS) {
+        return (signature->words[component / 64] >> (component % 64)) & 1;
+    }
+
+    size_t word = (component - SIGNATURE_INLINE_BITS) / 64;
+    if (word >= signature->overflow_count) {
+        return false;
+    }
+    return (signature->overflow[word] >> (component % 64)) & 1;
+}
+
+void signature_free(Signature *signature) {
+    free(signature->overflow);
+    *signature = (Signature) {0};
+}
+
+// Overflow words are only ever added for set bits, so equal signatures have
+// the same number of them.
+u64 signature_hash(const Signature *signature) {
+    u64 hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < SIGNATURE_WORDS; i++) {
+        hash = (hash ^ signature->words[i])*0x9e3779b97f4a7c15;
+        hash ^= hash >> 32;
+    }
+    for (size_t i = 0; i < signature->overflow_count; i++) {
+        hash = (hash ^ signature->overflow[i])*0x9e3779b97f4a7c15;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+b8 signature_equal(const Signature *a, const Signature *b) {
+    return memcmp(a->words, b->words, sizeof(a->words)) == 0 &&
+        a->overflow_count == b->overflow_count &&
+        (a->overflow_count == 0 || memcmp(a->overflow, b->overflow, a->overflow_count*sizeof(u64)) == 0);
+}
+
+static b8 signature_overflow_match(const Signature *signature, const Signature *with, const Signature *without) {
+    for (size_t i = 0; i < with->overflow_count; i++) {
+        u64 word = i < signature->overflow_count ? signature->overflow[i] : 0;
+        if ((word & with->overflow[i]) != with->overflow[i]) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < without->overflow_count && i < signature->overflow_count; i++) {
+        if (signature->overflow[i] & without->overflow[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+b8 signature_match(const Signature *signature, const Signature *with, const Signature *without) {
+    for (size_t i = 0; i < SIGNATURE_WORDS; i++) {
+        if ((signature->words[i] & with->words[i]) != with->words[i] ||
+                (signature->words[i] & without->words[i]) != 0) {
+            return false;
+        }
+    }
+    return signature_overflow_match(signature, with, without);
+}
+
+void signature_match_all(const Signature *signatures, size_t count, const Signature *with, const Signature *without, Vec(u32) *matches) {
+    b8 overflow = with->overflow_count > 0 || without->overflow_count > 0;
+
+#ifdef __SSE2__
+    // A signature matches when no required bit is missing and no excluded
+    // bit is set, two words at a time.
+    __m128i with_words[SIGNATURE_WORDS/2];
+    __m128i without_words[SIGNATURE_WORDS/2];
+    for (size_t i = 0; i < SIGNATURE_WORDS/2; i++) {
+        with_words[i] = _mm_loadu_si128((const __m128i *) &with->words[i*2]);
+        without_words[i] = _mm_loadu_si128((const __m128i *) &without->words[i*2]);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        __m128i mismatch = _mm_setzero_si128();
+        for (size_t j = 0; j < SIGNATURE_WORDS/2; j++) {
+            __m128i words = _mm_loadu_si128((const __m128i *) &signatures[i].words[j*2]);
+            mismatch = _mm_or_si128(mismatch, _mm_andnot_si128(words, with_words[j]));
+            mismatch = _mm_or_si128(mismatch, _mm_and_si128(words, without_words[j]));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(mismatch, _mm_setzero_si128())) != 0xffff) {
+            continue;
+        }
+        if (overflow && !signature_overflow_match(&signatures[i], with, without)) {
+            continue;
+        }
+        vec_push(*matches, i);
+    }
+#else
+    (void) overflow;
+    for (size_t i = 0; i < count; i++) {
+        if (signature_match(&signatures[i], with, without)) {
+            vec_push(*matches, i);
+        }
+    }
+#endif
+}
@@ -0,0 +1,552 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "core.h"
+#include "ds.h"
+#include "internal.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Layout of a snapshot, every section starting at a multiple of
+// SNAPSHOT_ALIGN:
+//
+//   SnapshotHeader
+//   SnapshotComponent followed by the name, for every component
+//   Generation of every entity and the free list, as u32
+//   For every archetype with entities:
+//     SnapshotArchetype
+//     Component IDs as u64, in order of the type
+//     Entities
+//     Every row of components, each followed by SnapshotHook and the hook
+//     data if the component has hooks
+//     Columns of disabled entities as u64
+//   For every sparse set with entities:
+//     SnapshotSparse
+//     Entities
+//     Components, followed by SnapshotHook and the hook data if the
+//     component has hooks
+//
+// Component IDs in the file are positions in its own registry.
+#define SNAPSHOT_MAGIC 0x53534345
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 16
+
+typedef struct SnapshotHeader SnapshotHeader;
+struct SnapshotHeader {
+    u32 magic;
+    u32 version;
+    u64 component_count;
+    u64 archetype_count;
+    u64 sparse_count;
+    u64 entity_count;
+    u64 free_count;
+};
+
+typedef struct SnapshotComponent SnapshotComponent;
+struct SnapshotComponent {
+    u64 size;
+    u64 storage;
+    u64 hooked;
+    u64 name_len;
+};
+
+typedef struct SnapshotArchetype SnapshotArchetype;
+struct SnapshotArchetype {
+    u64 component_count;
+    u64 entity_count;
+    u64 disabled_count;
+};
+
+typedef struct SnapshotSparse SnapshotSparse;
+struct SnapshotSparse {
+    u64 component;
+    u64 entity_count;
+};
+
+typedef struct SnapshotHook SnapshotHook;
+struct SnapshotHook {
+    u64 size;
+};
+
+// Writes go straight to the file. Reads walk either the mapped file or the
+// hook data of a single row.
+struct Snapshot {
+    FILE *file;
+    size_t offset;
+
+    u8 *data;
+    size_t size;
+    size_t cursor;
+
+    b8 failed;
+};
+
+void snapshot_write(Snapshot *snapshot, const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, snapshot->file) != size) {
+        snapshot->failed = true;
+    }
+    snapshot->offset += size;
+}
+
+b8 snapshot_read(Snapshot *snapshot, void *data, size_t size) {
+    if (snapshot->failed || size > snapshot->size - snapshot->cursor) {
+        snapshot->failed = true;
+        memset(data, 0, size);
+        return false;
+    }
+    memcpy(data, snapshot->data + snapshot->cursor, size);
+    snapshot->cursor += size;
+    return true;
+}
+
+static void snapshot_write_section(Snapshot *snapshot, const void *data, size_t size) {
+    static const u8 padding[SNAPSHOT_ALIGN] = {0};
+    snapshot_write(snapshot, padding, (SNAPSHOT_ALIGN - snapshot->offset % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN);
+    snapshot_write(snapshot, data, size);
+}
+
+// Rewrites part of the file once its contents are known.
+static void snapshot_patch(Snapshot *snapshot, size_t offset, const void *data, size_t size) {
+    if (fseek(snapshot->file, offset, SEEK_SET) != 0 ||
+            fwrite(data, 1, size, snapshot->file) != size ||
+            fseek(snapshot->file, snapshot->offset, SEEK_SET) != 0) {
+        snapshot->failed = true;
+    }
+}
+
+// Returns the next section of 'count' elements of 'size' bytes, or NULL past
+// the end of the file.
+static u8 *snapshot_take(Snapshot *snapshot, size_t count, size_t size) {
+    size_t cursor = (snapshot->cursor + SNAPSHOT_ALIGN-1) & ~(size_t) (SNAPSHOT_ALIGN-1);
+    if (snapshot->failed || cursor > snapshot->size ||
+            (size > 0 && count > (snapshot->size - cursor) / size)) {
+        snapshot->failed = true;
+        return NULL;
+    }
+    snapshot->cursor = cursor + count*size;
+    return snapshot->data + cursor;
+}
+
+// Hook data is written as its own section, sized once every hook has run,
+// so a reader without the hooks can skip it.
+static size_t snapshot_begin_hooks(Snapshot *snapshot) {
+    SnapshotHook hook = {0};
+    snapshot_write_section(snapshot, &hook, sizeof(hook));
+    snapshot_write_section(snapshot, NULL, 0);
+    return snapshot->offset;
+}
+
+static void snapshot_end_hooks(Snapshot *snapshot, size_t start) {
+    SnapshotHook hook = {
+        .size = snapshot->offset - start,
+    };
+    snapshot_patch(snapshot, start - SNAPSHOT_ALIGN, &hook, sizeof(hook));
+}
+
+static b8 snapshot_read_hooks(ECS *ecs, Snapshot *snapshot, SnapshotLoad load, u8 *components, size_t count, size_t size) {
+    SnapshotHook *hook = (SnapshotHook *) snapshot_take(snapshot, 1, sizeof(SnapshotHook));
+    if (hook == NULL) {
+        return false;
+    }
+    Snapshot hook_snapshot = {
+        .data = snapshot_take(snapshot, hook->size, 1),
+        .size = hook->size,
+    };
+    if (hook_snapshot.data == NULL) {
+        return false;
+    }
+    if (load == NULL) {
+        return true;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        load(ecs, &hook_snapshot, components + size*i);
+    }
+    return !hook_snapshot.failed;
+}
+
+static void snapshot_write_archetype(ECS *ecs, Snapshot *snapshot, const Archetype *archetype) {
+    size_t disabled = 0;
+    for (size_t i = 0; i < vec_len(archetype->chunks); i++) {
+        disabled += archetype->chunks[i].disabled;
+    }
+    SnapshotArchetype header = {
+        .component_count = type_len(archetype->type),
+        .entity_count = archetype->current_index,
+        .disabled_count = disabled,
+    };
+    snapshot_write_section(snapshot, &header, sizeof(header));
+
+    snapshot_write_section(snapshot, NULL, 0);
+    for (size_t i = 0; i < type_len(archetype->type); i++) {
+        u64 id = archetype->type[i];
+        snapshot_write(snapshot, &id, sizeof(id));
+    }
+
+    snapshot_write_section(snapshot, NULL, 0);
+    for (size_t i = 0; i < vec_len(archetype->chunks); i++) {
+        const Chunk *chunk = &archetype->chunks[i];
+        snapshot_write(snapshot, chunk->data, sizeof(Entity)*chunk->count);
+    }
+
+    // Chunks hold a row for each component, the file one for every entity.
+    for (size_t i = 0; i < type_len(archetype->type); i++) {
+        size_t size = archetype->row_sizes[i];
+        snapshot_write_section(snapshot, NULL, 0);
+        for (size_t j = 0; j < vec_len(archetype->chunks); j++) {
+            const Chunk *chunk = &archetype->chunks[j];
+            snapshot_write(snapshot, chunk->data + archetype->row_offsets[i], size*chunk->count);
+        }
+
+        SnapshotSave save = ecs->components[archetype->type[i]].snapshot_save;
+        if (save == NULL) {
+            continue;
+        }
+        size_t start = snapshot_begin_hooks(snapshot);
+        for (size_t j = 0; j < archetype->current_index; j++) {
+            save(ecs, snapshot, archetype_component(archetype, i, j));
+        }
+        snapshot_end_hooks(snapshot, start);
+    }
+
+    snapshot_write_section(snapshot, NULL, 0);
+    for (size_t i = 0; i < vec_len(archetype->chunks) && disabled > 0; i++) {
+        const Chunk *chunk = &archetype->chunks[i];
+        for (size_t j = 0; j < chunk->count && chunk->disabled > 0; j++) {
+            if (!chunk_enabled(chunk, j)) {
+                u64 column = i*archetype->chunk_capacity + j;
+                snapshot_write(snapshot, &column, sizeof(column));
+            }
+        }
+    }
+}
+
+static void snapshot_write_sparse(ECS *ecs, Snapshot *snapshot, ComponentId id) {
+    const Component *component = &ecs->components[id];
+    const SparseSet *set = &component->sparse;
+    SnapshotSparse header = {
+        .component = id,
+        .entity_count = vec_len(set->dense),
+    };
+    snapshot_write_section(snapshot, &header, sizeof(header));
+    snapshot_write_section(snapshot, set->dense, sizeof(Entity)*vec_len(set->dense));
+    snapshot_write_section(snapshot, set->data, set->component_size*vec_len(set->dense));
+    if (component->snapshot_save != NULL) {
+        size_t start = snapshot_begin_hooks(snapshot);
+        for (size_t i = 0; i < vec_len(set->dense); i++) {
+            component->snapshot_save(ecs, snapshot, sparse_set_component(set, i));
+        }
+        snapshot_end_hooks(snapshot, start);
+    }
+}
+
+void ecs_register_snapshot_hooks_id(ECS *ecs, ComponentId component, SnapshotSave save, SnapshotLoad load) {
+    assert(component < vec_len(ecs->components) && "Hooks for non-existent component.");
+    ecs->components[component].snapshot_save = save;
+    ecs->components[component].snapshot_load = load;
+}
+
+b8 ecs_snapshot_write(ECS *ecs, const char *path) {
+    if (ecs->active_queries > 0) {
+        log_error("Writing snapshot inside a query.");
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        log_error("Failed to open snapshot '%s' for writing.", path);
+        return false;
+    }
+    Snapshot snapshot = {
+        .file = file,
+    };
+
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .component_count = vec_len(ecs->components),
+        .entity_count = ecs->entity_current_id,
+        .free_count = vec_len(ecs->entity_free_list),
+    };
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        header.archetype_count += ecs->archetypes[i]->current_index > 0;
+    }
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        header.sparse_count += vec_len(ecs->components[ecs->sparse_components[i]].sparse.dense) > 0;
+    }
+    snapshot_write_section(&snapshot, &header, sizeof(header));
+
+    for (size_t i = 0; i < vec_len(ecs->components); i++) {
+        const Component *component = &ecs->components[i];
+        SnapshotComponent entry = {
+            .size = component->size,
+            .storage = component->storage,
+            .hooked = component->snapshot_save != NULL,
+            .name_len = component->name.len,
+        };
+        snapshot_write_section(&snapshot, &entry, sizeof(entry));
+        snapshot_write_section(&snapshot, component->name.data, component->name.len);
+    }
+
+    snapshot_write_section(&snapshot, ecs->entity_generation, sizeof(u32)*ecs->entity_current_id);
+    snapshot_write_section(&snapshot, ecs->entity_free_list, sizeof(u32)*vec_len(ecs->entity_free_list));
+
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        if (ecs->archetypes[i]->current_index > 0) {
+            snapshot_write_archetype(ecs, &snapshot, ecs->archetypes[i]);
+        }
+    }
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        if (vec_len(ecs->components[ecs->sparse_components[i]].sparse.dense) > 0) {
+            snapshot_write_sparse(ecs, &snapshot, ecs->sparse_components[i]);
+        }
+    }
+
+    b8 ok = !snapshot.failed;
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        log_error("Failed to write snapshot '%s'.", path);
+    }
+    return ok;
+}
+
+// Matches every component of the file with the one of the same name in the
+// world.
+typedef struct SnapshotRegistry SnapshotRegistry;
+struct SnapshotRegistry {
+    Vec(ComponentId) ids;
+    Vec(b8) hooked;
+};
+
+static b8 snapshot_read_components(ECS *ecs, Snapshot *snapshot, size_t count, SnapshotRegistry *registry) {
+    for (size_t i = 0; i < count; i++) {
+        SnapshotComponent *entry = (SnapshotComponent *) snapshot_take(snapshot, 1, sizeof(SnapshotComponent));
+        if (entry == NULL) {
+            return false;
+        }
+        Str name = {
+            .data = snapshot_take(snapshot, entry->name_len, 1),
+            .len = entry->name_len,
+        };
+        if (name.data == NULL) {
+            return false;
+        }
+
+        ComponentId id = hash_map_get(ecs->component_map, name);
+        if (id == (ComponentId) -1) {
+            log_error("Snapshot component '%.*s' isn't registered.", (int) name.len, name.data);
+            return false;
+        }
+        const Component *component = &ecs->components[id];
+        if (component->size != entry->size || component->storage != entry->storage) {
+            log_error("Snapshot component '%.*s' differs in size or storage.", (int) name.len, name.data);
+            return false;
+        }
+        vec_push(registry->ids, id);
+        vec_push(registry->hooked, entry->hooked != 0);
+    }
+    return true;
+}
+
+static b8 snapshot_entities_valid(ECS *ecs, const Entity *entities, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if ((u32) entities[i] >= ecs->entity_current_id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static b8 snapshot_read_archetype(ECS *ecs, Snapshot *snapshot, const SnapshotRegistry *registry, Vec(ComponentColumn) *columns) {
+    SnapshotArchetype *header = (SnapshotArchetype *) snapshot_take(snapshot, 1, sizeof(SnapshotArchetype));
+    if (header == NULL) {
+        return false;
+    }
+    u64 *ids = (u64 *) snapshot_take(snapshot, header->component_count, sizeof(u64));
+    Entity *entities = (Entity *) snapshot_take(snapshot, header->entity_count, sizeof(Entity));
+    if (entities == NULL || !snapshot_entities_valid(ecs, entities, header->entity_count)) {
+        return false;
+    }
+
+    Type type = NULL;
+    for (size_t i = 0; i < header->component_count; i++) {
+        if (ids[i] >= vec_len(registry->ids) ||
+                ecs->components[registry->ids[ids[i]]].storage != COMPONENT_STORAGE_TABLE) {
+            type_free(type);
+            return false;
+        }
+        type_add(&type, registry->ids[ids[i]]);
+    }
+    if (type_len(type) != header->component_count) {
+        type_free(type);
+        return false;
+    }
+    Archetype *archetype = archetype_get_or_new(ecs, type);
+    type_free(type);
+
+    // IDs may be ordered differently in this world, rows are put back in the
+    // order of the archetype.
+    vec_clear(*columns);
+    for (size_t i = 0; i < header->component_count; i++) {
+        vec_push(*columns, (ComponentColumn) {0});
+    }
+    for (size_t i = 0; i < header->component_count; i++) {
+        ComponentId id = registry->ids[ids[i]];
+        size_t size = ecs->components[id].size;
+        u8 *data = snapshot_take(snapshot, header->entity_count, size);
+        if (data == NULL) {
+            return false;
+        }
+        if (registry->hooked[ids[i]] &&
+                !snapshot_read_hooks(ecs, snapshot, ecs->components[id].snapshot_load, data, header->entity_count, size)) {
+            return false;
+        }
+        (*columns)[archetype_component_row(archetype, id)] = (ComponentColumn) {
+            .id = id,
+            .data = data,
+        };
+    }
+
+    u64 *disabled = (u64 *) snapshot_take(snapshot, header->disabled_count, sizeof(u64));
+    if (disabled == NULL) {
+        return false;
+    }
+
+    size_t first_column = archetype_spawn_rows(ecs, archetype, entities, header->entity_count, *columns);
+    for (size_t i = 0; i < header->disabled_count; i++) {
+        if (disabled[i] >= header->entity_count) {
+            return false;
+        }
+        archetype_set_enabled(ecs, archetype, first_column + disabled[i], false);
+    }
+    return true;
+}
+
+static b8 snapshot_read_sparse(ECS *ecs, Snapshot *snapshot, const SnapshotRegistry *registry) {
+    SnapshotSparse *header = (SnapshotSparse *) snapshot_take(snapshot, 1, sizeof(SnapshotSparse));
+    if (header == NULL || header->component >= vec_len(registry->ids)) {
+        return false;
+    }
+    ComponentId id = registry->ids[header->component];
+    const Component *component = &ecs->components[id];
+    if (component->storage != COMPONENT_STORAGE_SPARSE) {
+        return false;
+    }
+
+    Entity *entities = (Entity *) snapshot_take(snapshot, header->entity_count, sizeof(Entity));
+    u8 *data = snapshot_take(snapshot, header->entity_count, component->size);
+    if (data == NULL || !snapshot_entities_valid(ecs, entities, header->entity_count)) {
+        return false;
+    }
+    if (registry->hooked[header->component] &&
+            !snapshot_read_hooks(ecs, snapshot, component->snapshot_load, data, header->entity_count, component->size)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < header->entity_count; i++) {
+        _ecs_sparse_insert(ecs, id, entities[i], data + component->size*i);
+    }
+    return true;
+}
+
+static b8 snapshot_read_world(ECS *ecs, Snapshot *snapshot) {
+    SnapshotHeader *header = (SnapshotHeader *) snapshot_take(snapshot, 1, sizeof(SnapshotHeader));
+    if (header == NULL || header->magic != SNAPSHOT_MAGIC) {
+        log_error("Not a snapshot.");
+        return false;
+    }
+    if (header->version != SNAPSHOT_VERSION) {
+        log_error("Unsupported snapshot version %u.", header->version);
+        return false;
+    }
+
+    SnapshotRegistry registry = {0};
+    b8 ok = snapshot_read_components(ecs, snapshot, header->component_count, &registry);
+
+    u32 *generations = (u32 *) snapshot_take(snapshot, header->entity_count, sizeof(u32));
+    u32 *free_list = (u32 *) snapshot_take(snapshot, header->free_count, sizeof(u32));
+    ok = ok && free_list != NULL && header->entity_count <= UINT32_MAX;
+    for (size_t i = 0; ok && i < header->free_count; i++) {
+        ok = free_list[i] < header->entity_count;
+    }
+
+    if (ok) {
+        vec_insert_arr(ecs->entity_generation, 0, generations, header->entity_count);
+        vec_insert_arr(ecs->entity_free_list, 0, free_list, header->free_count);
+        for (size_t i = 0; i < header->entity_count; i++) {
+            vec_push(ecs->entity_records, (ArchetypeColumn) {0});
+        }
+        ecs->entity_current_id = header->entity_count;
+    }
+
+    Vec(ComponentColumn) columns = NULL;
+    for (size_t i = 0; ok && i < header->archetype_count; i++) {
+        ok = snapshot_read_archetype(ecs, snapshot, &registry, &columns);
+    }
+    for (size_t i = 0; ok && i < header->sparse_count; i++) {
+        ok = snapshot_read_sparse(ecs, snapshot, &registry);
+    }
+
+    vec_free(columns);
+    vec_free(registry.ids);
+    vec_free(registry.hooked);
+    return ok;
+}
+
+b8 ecs_snapshot_read(ECS *ecs, const char *path) {
+    if (ecs->active_queries > 0) {
+        log_error("Reading snapshot inside a query.");
+        return false;
+    }
+    if (ecs->entity_current_id > 0) {
+        log_error("Reading snapshot into a world with entities.");
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        log_error("Failed to open snapshot '%s'.", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        log_error("Failed to read snapshot '%s'.", path);
+        close(fd);
+        return false;
+    }
+
+    // A private mapping lets the hooks patch components in place before
+    // they're copied, without touching the file.
+    size_t size = st.st_size;
+    u8 *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Failed to map snapshot '%s'.", path);
+        return false;
+    }
+
+    Snapshot snapshot = {
+        .data = data,
+        .size = size,
+    };
+    b8 ok = snapshot_read_world(ecs, &snapshot);
+    munmap(data, size);
+    if (!ok) {
+        log_error("Failed to read snapshot '%s'.", path);
+    }
+
+    // Observers of the components read may have deferred changes.
+    if (vec_len(ecs->command_buffer.commands) > 0) {
+        _ecs_process_command_queue(ecs);
+    }
+    return ok;
+}
@@ -0,0 +1,115 @@
+#include "core.h"
+#include "ds.h"
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void sparse_set_insert(SparseSet *set, Entity entity, const void *data, u64 tick) {
+    u32 index = sparse_set_index(set, entity);
+    if (index != SPARSE_SET_NONE) {
+        set->changed_ticks[index] = tick;
+        if (set->component_size > 0) {
+            memcpy(sparse_set_component(set, index), data, set->component_size);
+        }
+        return;
+    }
+
+    while (vec_len(set->sparse) <= (u32) entity) {
+        vec_push(set->sparse, 0);
+    }
+    index = vec_len(set->dense);
+    if (index == set->capacity && set->component_size > 0) {
+        set->capacity = set->capacity > 0 ? set->capacity*2 : 64;
+        set->data = realloc(set->data, set->capacity*set->component_size);
+    }
+
+    vec_push(set->dense, entity);
+    vec_push(set->changed_ticks, tick);
+    vec_push(set->added_ticks, tick);
+    set->sparse[(u32) entity] = index + 1;
+    if (set->component_size > 0) {
+        memcpy(sparse_set_component(set, index), data, set->component_size);
+    }
+}
+
+void sparse_set_remove(SparseSet *set, Entity entity) {
+    u32 index = sparse_set_index(set, entity);
+    if (index == SPARSE_SET_NONE) {
+        return;
+    }
+
+    u32 last = vec_len(set->dense) - 1;
+    if (index != last) {
+        Entity moved = set->dense[last];
+        set->dense[index] = moved;
+        set->changed_ticks[index] = set->changed_ticks[last];
+        set->added_ticks[index] = set->added_ticks[last];
+        if (set->component_size > 0) {
+            memcpy(sparse_set_component(set, index), sparse_set_component(set, last), set->component_size);
+        }
+        set->sparse[(u32) moved] = index + 1;
+    }
+    set->sparse[(u32) entity] = 0;
+    (void) vec_pop(set->dense);
+    (void) vec_pop(set->changed_ticks);
+    (void) vec_pop(set->added_ticks);
+}
+
+void sparse_set_assign(SparseSet *set, const Entity *dense, const void *data, const u64 *added_ticks, size_t count, u64 tick) {
+    for (size_t i = 0; i < vec_len(set->dense); i++) {
+        set->sparse[(u32) set->dense[i]] = 0;
+    }
+    vec_clear(set->dense);
+    vec_clear(set->changed_ticks);
+    vec_clear(set->added_ticks);
+    if (count == 0) {
+        return;
+    }
+    vec_insert_arr(set->dense, 0, dense, count);
+    vec_insert_arr(set->added_ticks, 0, added_ticks, count);
+
+    for (size_t i = 0; i < count; i++) {
+        u32 index = set->dense[i];
+        while (vec_len(set->sparse) <= index) {
+            vec_push(set->sparse, 0);
+        }
+        set->sparse[index] = i + 1;
+        vec_push(set->changed_ticks, tick);
+    }
+
+    if (set->component_size == 0) {
+        return;
+    }
+    if (count > set->capacity) {
+        while (set->capacity < count) {
+            set->capacity = set->capacity > 0 ? set->capacity*2 : 64;
+        }
+        set->data = realloc(set->data, set->capacity*set->component_size);
+    }
+    memcpy(set->data, data, count*set->component_size);
+}
+
+size_t sparse_set_shrink(SparseSet *set) {
+    size_t capacity = set->capacity;
+    while (capacity > 64 && vec_len(set->dense)*4 < capacity) {
+        capacity /= 2;
+    }
+    if (capacity == set->capacity) {
+        return 0;
+    }
+
+    size_t released = (set->capacity - capacity)*set->component_size;
+    set->data = realloc(set->data, capacity*set->component_size);
+    set->capacity = capacity;
+    return released;
+}
+
+void sparse_set_free(SparseSet *set) {
+    vec_free(set->sparse);
+    vec_free(set->dense);
+    free(set->data);
+    vec_free(set->changed_ticks);
+    vec_free(set->added_ticks);
+    *set = (SparseSet) {0};
+}
@@ -0,0 +1,79 @@
+#include "core.h"
+#include "ds.h"
+#include "internal.h"
+
+// Bytes of one column of the archetype, its entity included.
+static size_t stats_column_size(const Archetype *archetype) {
+    size_t size = sizeof(Entity);
+    for (size_t i = 0; i < vec_len(archetype->row_sizes); i++) {
+        size += archetype->row_sizes[i];
+    }
+    return size;
+}
+
+ECSStats ecs_stats(ECS *ecs) {
+    size_t free_count = vec_len(ecs->entity_free_list);
+    ECSStats stats = {
+        .entity_count = ecs->entity_current_id - free_count,
+        .free_entity_count = free_count,
+        .component_count = vec_len(ecs->components),
+        .archetype_count = vec_len(ecs->archetypes),
+        .query_count = vec_len(ecs->query_caches),
+        .pooled_chunk_count = vec_len(ecs->chunk_pool),
+        .command_count = vec_len(ecs->command_buffer.commands),
+        .command_high_water = ecs->command_high_water,
+        .command_bytes_high_water = ecs->command_bytes_high_water,
+        .rollback_copied_chunks = ecs->rollback.copied_chunks,
+    };
+    if (vec_len(ecs->archetype_table) > 0) {
+        stats.archetype_table_load = (f32) vec_len(ecs->archetypes) / vec_len(ecs->archetype_table);
+    }
+    if (ecs->entity_current_id > 0) {
+        stats.free_list_load = (f32) free_count / ecs->entity_current_id;
+    }
+
+    for (size_t i = 0; i < vec_len(ecs->archetypes); i++) {
+        const Archetype *archetype = ecs->archetypes[i];
+        stats.chunk_count += vec_len(archetype->chunks);
+        stats.chunk_bytes += vec_len(archetype->chunks)*archetype->chunk_size;
+        stats.edge_count += archetype->edge_count;
+        stats.bundle_edge_count += vec_len(archetype->bundle_edges);
+    }
+    // Both archetypes of an edge count it.
+    stats.edge_count /= 2;
+
+    for (size_t i = 0; i < vec_len(ecs->sparse_components); i++) {
+        stats.sparse_count += vec_len(ecs->components[ecs->sparse_components[i]].sparse.dense);
+    }
+    return stats;
+}
+
+size_t ecs_archetype_stats(ECS *ecs, ArchetypeStats *stats, size_t capacity) {
+    size_t count = min(capacity, vec_len(ecs->archetypes));
+    for (size_t i = 0; i < count; i++) {
+        const Archetype *archetype = ecs->archetypes[i];
+        stats[i] = (ArchetypeStats) {
+            .components = archetype->type,
+            .component_count = type_len(archetype->type),
+            .entity_count = archetype->current_index,
+            .chunk_count = vec_len(archetype->chunks),
+            .capacity_bytes = vec_len(archetype->chunks)*archetype->chunk_size,
+            .used_bytes = archetype->current_index*stats_column_size(archetype),
+            .edge_count = archetype->edge_count,
+            .bundle_edge_count = vec_len(archetype->bundle_edges),
+        };
+    }
+
+    // Walking the queries touches each match once, rather than matching
+    // every archetype against every query.
+    for (size_t i = 0; i < vec_len(ecs->query_caches); i++) {
+        const QueryCache *cache = ecs->query_caches[i];
+        for (size_t j = 0; j < vec_len(cache->archetypes); j++) {
+            u32 index = cache->archetypes[j]->index;
+            if (index < count) {
+                stats[index].query_count++;
+            }
+        }
+    }
+    return vec_len(ecs->archetypes);
+}
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "core.h"
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct ThreadPoolWorker ThreadPoolWorker;
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    u32 index;
+    pthread_t thread;
+};
+
+struct ThreadPool {
+    ThreadPoolWorker *workers;
+    u32 worker_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    // Work of the current run. A new run is signaled by bumping 'generation'.
+    ThreadPoolFunc func;
+    void *data;
+    u64 generation;
+    u32 running;
+    b8 quit;
+};
+
+static void *thread_pool_worker(void *arg) {
+    ThreadPoolWorker *worker = arg;
+    ThreadPool *pool = worker->pool;
+    u64 generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == generation && !pool->quit) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        generation = pool->generation;
+        ThreadPoolFunc func = pool->func;
+        void *data = pool->data;
+        pthread_mutex_unlock(&pool->lock);
+
+        func(data, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+u32 thread_pool_cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+        return 1;
+    }
+    return count;
+}
+
+ThreadPool *thread_pool_new(u32 worker_count) {
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    *pool = (ThreadPool) {
+        .workers = malloc(sizeof(ThreadPoolWorker)*worker_count),
+        .worker_count = worker_count,
+    };
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (u32 i = 0; i < worker_count; i++) {
+        pool->workers[i] = (ThreadPoolWorker) {
+            .pool = pool,
+            .index = i + 1,
+        };
+        pthread_create(&pool->workers[i].thread, NULL, thread_pool_worker, &pool->workers[i]);
+    }
+
+    return pool;
+}
+
+void thread_pool_free(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (u32 i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+void thread_pool_run(ThreadPool *pool, ThreadPoolFunc func, void *data) {
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->data = data;
+    pool->running = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    func(data, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -4,23 +4,24 @@
 #include <assert.h>
 #include <stdio.h>
 
-void type_add(Type type, ComponentId component) {
-    for (size_t i = 0; i < vec_len(type); i++) {
-        if (type[i] == component) {
+// Both take the type by pointer since inserting may move the vector.
+void type_add(Type *type, ComponentId component) {
+    for (size_t i = 0; i < vec_len(*type); i++) {
+        if ((*type)[i] == component) {
             return;
-        } else if (type[i] > component) {
-            vec_insert(type, i, component);
+        } else if ((*type)[i] > component) {
+            vec_insert(*type, i, component);
             return;
         }
     }
 
-    vec_push(type, component);
+    vec_push(*type, component);
 }
 
-void type_remove(Type type, ComponentId component) {
-    for (size_t i = 0; i < vec_len(type); i++) {
-        if (type[i] == component) {
-            vec_remove(type, i);
+void type_remove(Type *type, ComponentId component) {
+    for (size_t i = 0; i < vec_len(*type); i++) {
+        if ((*type)[i] == component) {
+            vec_remove(*type, i);
             return;
         }
     }
@@ -42,6 +43,9 @@ int type_cmp(const void *a, const void *b, size_t size) {
     (void) size;
     Type const *_a = a;
     Type const *_b = b;
+    if (vec_len(*_a) != vec_len(*_b)) {
+        return vec_len(*_a) < vec_len(*_b) ? -1 : 1;
+    }
     return memcmp(*_a, *_b, vec_len(*_a) * sizeof(ComponentId));
 }
 
@@ -103,16 +103,29 @@ typedef enum {
     BOSS_ATTACK_TASTE_THE_RAINBOW,
 } BossAttack;
 
+#define BOSS_SHIELD_COUNT 6
+
 typedef struct Boss Boss;
 struct Boss {
     BossAttack attack;
     f32 attack_timer;
     b8 shielded;
-    Vec(Entity) shields;
+    // Kept inline so rolling the world back restores them with the boss.
+    Entity shields[BOSS_SHIELD_COUNT];
     // ttr = taste the rainbow
     u32 ttr_circle_count;
 };
 
+ecs_declare_component(Transform);
+ecs_declare_component(Player);
+ecs_declare_component(Renderable);
+ecs_declare_component(PhysicsBody);
+ecs_declare_component(Projectile);
+ecs_declare_component(Enemy);
+ecs_declare_component(Health);
+ecs_declare_component(Hit);
+ecs_declare_component(Boss);
+
 // -----------------------------------------------------------------------------
 
 typedef enum {
@@ -181,7 +194,7 @@ void grid_free(SpatialGrid *grid) {
 }
 
 void grid_insert(SpatialGrid *grid, ECS *ecs, Entity entity) {
-    Transform *transform = entity_get_component(ecs, entity, Transform);
+    const Transform *transform = entity_read_component(ecs, entity, Transform);
     if (transform == NULL) {
         log_warn("Partitioning an entity without a transform.");
         return;
@@ -227,7 +240,7 @@ Vec(Entity) grid_query_radius(SpatialGrid *grid, ECS *ecs, Vec2 pos, f32 radius)
                     continue;
                 }
 
-                Transform *transform = entity_get_component(ecs, ent, Transform);
+                const Transform *transform = entity_read_component(ecs, ent, Transform);
                 if (aabb_overlap_circle(*transform, pos, radius)) {
                     vec_push(result, ent);
                 }
@@ -245,6 +258,17 @@ typedef enum {
     STAGE_QUIT,
 } Stage;
 
+// Templates of the entities spawned during a game, built by
+// 'setup_prefabs()'.
+typedef struct Prefabs Prefabs;
+struct Prefabs {
+    Entity slime;
+    Entity shield;
+    Entity boss;
+    Entity player_bullet;
+    Entity slime_bullet;
+};
+
 typedef struct GameState GameState;
 struct GameState {
     ECS *ecs;
@@ -255,6 +279,11 @@ struct GameState {
     Camera cam;
 
     SystemGroup group;
+    QueryCache *grid_query;
+    QueryCache *render_query;
+    QueryCache *health_bar_query;
+    QueryCache *hit_text_query;
+    Prefabs prefabs;
 
     Tile tiles[WORLD_WIDTH*WORLD_HEIGHT];
 
@@ -266,6 +295,7 @@ struct GameState {
     Stage stage;
     b8 paused;
     b8 setup;
+    b8 show_ecs_stats;
 };
 
 Tile get_tile(GameState *state, Vec2 pos) {
@@ -321,13 +351,14 @@ static void projectile_entity_collision(ECS *ecs, Entity self, Entity other, Min
         if (health != NULL) {
             health->curr -= proj->damage;
             Entity hit = ecs_entity(ecs);
-            entity_add_component(ecs, hit, Transform, {
-                    .position = proj_transform->position,
-                });
-            entity_add_component(ecs, hit, Hit, {
-                    .damage = proj->damage,
-                    .color = COLOR_RED,
-                });
+            entity_add_components(ecs, hit,
+                    component_data(Transform, {
+                        .position = proj_transform->position,
+                    }),
+                    component_data(Hit, {
+                        .damage = proj->damage,
+                        .color = COLOR_RED,
+                    }));
         }
 
         if (proj->penetration == 0) {
@@ -344,13 +375,14 @@ static void projectile_entity_collision(ECS *ecs, Entity self, Entity other, Min
         if (health != NULL) {
             health->curr -= proj->damage;
             Entity hit = ecs_entity(ecs);
-            entity_add_component(ecs, hit, Transform, {
-                    .position = proj_transform->position,
-                });
-            entity_add_component(ecs, hit, Hit, {
-                    .damage = proj->damage,
-                    .color = COLOR_RED,
-                });
+            entity_add_components(ecs, hit,
+                    component_data(Transform, {
+                        .position = proj_transform->position,
+                    }),
+                    component_data(Hit, {
+                        .damage = proj->damage,
+                        .color = COLOR_RED,
+                    }));
         }
 
         if (proj->penetration == 0) {
@@ -391,6 +423,23 @@ b8 is_grounded(GameState *state, Transform transform) {
 
 // -- Systems ------------------------------------------------------------------
 
+#define MAX_SPAWN_OVERRIDES 8
+
+// Position and velocity of each instance of a prefab.
+typedef struct SpawnOverride SpawnOverride;
+struct SpawnOverride {
+    Vec2 positions[MAX_SPAWN_OVERRIDES];
+    Vec2 velocities[MAX_SPAWN_OVERRIDES];
+};
+
+static void spawn_override(ECS *ecs, Entity instance, size_t index, const void *user_data) {
+    const SpawnOverride *spawn = user_data;
+    Transform *transform = entity_get_component(ecs, instance, Transform);
+    PhysicsBody *body = entity_get_component(ecs, instance, PhysicsBody);
+    transform->position = spawn->positions[index];
+    body->velocity = spawn->velocities[index];
+}
+
 void template_system(ECS *ecs, QueryIter iter, void *user_ptr) {
     (void) ecs;
     GameState *state = user_ptr;
@@ -486,32 +535,11 @@ void player_control_system(ECS *ecs, QueryIter iter, void *user_ptr) {
             dir = vec2_normalized(dir);
             dir = vec2_muls(dir, 100.0f);
 
-            Entity proj = ecs_entity(ecs);
-            entity_add_component(ecs, proj, Transform, {
-                    .position = transform[i].position,
-                    .size = vec2s(0.5f),
-                });
-            entity_add_component(ecs, proj, Renderable, {
-                    .color = COLOR_WHITE,
-                });
-            entity_add_component(ecs, proj, Projectile, {
-                    .friendly = true,
-                    .env_collide = true,
-                    .penetration = 1,
-                    .lifespan = 3.0f,
-                    .damage = 5,
-                });
-            entity_add_component(ecs, proj, PhysicsBody, {
-                    .gravity_multiplier = 0.0f,
-                    .velocity = dir,
-                    .collider = true,
-                    .tile_collision_cbs = {
-                        projectile_tile_collision
-                    },
-                    .entity_collision_cbs = {
-                        projectile_entity_collision
-                    },
-                });
+            SpawnOverride spawn = {
+                .positions = {transform[i].position},
+                .velocities = {dir},
+            };
+            ecs_instantiate_with(ecs, state->prefabs.player_bullet, 1, NULL, spawn_override, &spawn, sizeof(spawn));
         }
     }
 }
@@ -528,7 +556,7 @@ void projectile_system(ECS *ecs, QueryIter iter, void *user_ptr) {
 
         projectile[i].lifespan -= state->dt;
         if (projectile[i].lifespan <= 0.0f || projectile[i].penetration == 0) {
-            Entity entity = ecs_query_iter_get_entity(iter, i);
+            Entity entity = iter.entities[i];
             ecs_entity_kill(ecs, entity);
         }
     }
@@ -599,7 +627,7 @@ void tile_collision_system(ECS *ecs, QueryIter iter, void *user_ptr) {
 
                     for (u32 j = 0; j < arrlen(body[i].tile_collision_cbs); j++) {
                         if (body[i].tile_collision_cbs[j] != NULL) {
-                            Entity ent = ecs_query_iter_get_entity(iter, i);
+                            Entity ent = iter.entities[i];
                             body[i].tile_collision_cbs[j](ecs, ent, pos, diff);
                         }
                     }
@@ -672,10 +700,9 @@ void entity_to_entity_collision(GameState *state) {
     }
 }
 
-void slime_ai(GameState *state, Entity slime, Transform *transform, Enemy *enemy) {
+void slime_ai(GameState *state, Transform *transform, Enemy *enemy, PhysicsBody *body) {
     ECS *ecs = state->ecs;
 
-    PhysicsBody *body = entity_get_component(ecs, slime, PhysicsBody);
     // Deceleration
     body->velocity.x = lerp(body->velocity.x, 0.0f, state->dt*2.0f);
 
@@ -683,7 +710,7 @@ void slime_ai(GameState *state, Entity slime, Transform *transform, Enemy *enemy
     if (enemy->target == (Entity) -1) {
         Vec(Entity) near = grid_query_radius(&state->grid, ecs, transform->position, 30.0f);
         for (u32 i = 0; i < vec_len(near); i++) {
-            Player *player = entity_get_component(ecs, near[i], Player);
+            const Player *player = entity_read_component(ecs, near[i], Player);
             if (player != NULL) {
                 enemy->target = near[i];
                 break;
@@ -691,7 +718,7 @@ void slime_ai(GameState *state, Entity slime, Transform *transform, Enemy *enemy
         }
         vec_free(near);
     } else {
-        Transform *target_transform = entity_get_component(ecs, enemy->target, Transform);
+        const Transform *target_transform = entity_read_component(ecs, enemy->target, Transform);
 
         // Jumping
         enemy->jump_timer += state->dt;
@@ -710,32 +737,11 @@ void slime_ai(GameState *state, Entity slime, Transform *transform, Enemy *enemy
             dir = vec2_normalized(dir);
             dir = vec2_muls(dir, 20.0f);
 
-            Entity proj = ecs_entity(ecs);
-            entity_add_component(ecs, proj, Transform, {
-                    .position = transform->position,
-                    .size = vec2s(0.5f),
-                });
-            entity_add_component(ecs, proj, Renderable, {
-                    .color = color_rgb_hex(0xfcba03),
-                });
-            entity_add_component(ecs, proj, Projectile, {
-                    .friendly = false,
-                    .env_collide = true,
-                    .penetration = 1,
-                    .lifespan = 3.0f,
-                    .damage = 2,
-                });
-            entity_add_component(ecs, proj, PhysicsBody, {
-                    .collider = true,
-                    .gravity_multiplier = 0.0f,
-                    .velocity = dir,
-                    .tile_collision_cbs = {
-                        projectile_tile_collision
-                    },
-                    .entity_collision_cbs = {
-                        projectile_entity_collision
-                    },
-                });
+            SpawnOverride spawn = {
+                .positions = {transform->position},
+                .velocities = {dir},
+            };
+            ecs_instantiate_with(ecs, state->prefabs.slime_bullet, 1, NULL, spawn_override, &spawn, sizeof(spawn));
         }
     }
 }
@@ -743,8 +749,8 @@ void slime_ai(GameState *state, Entity slime, Transform *transform, Enemy *enemy
 void attack_carpet_bomb(GameState *state, Entity ent, Transform *transform, Enemy *enemy, Boss *boss) {
     ECS *ecs = state->ecs;
     PhysicsBody *body = entity_get_component(ecs, ent, PhysicsBody);
-    Transform *target_transform = entity_get_component(ecs, enemy->target, Transform);
-    PhysicsBody *target_body = entity_get_component(ecs, enemy->target, PhysicsBody);
+    const Transform *target_transform = entity_read_component(ecs, enemy->target, Transform);
+    const PhysicsBody *target_body = entity_read_component(ecs, enemy->target, PhysicsBody);
 
     Vec2 half_size = aabb_half_size(*transform);
 
@@ -780,32 +786,33 @@ void attack_carpet_bomb(GameState *state, Entity ent, Transform *transform, Enem
         enemy->shoot_timer = 0.0f;
 
         Entity bomb = ecs_entity(ecs);
-        entity_add_component(ecs, bomb, Transform, {
-                .position = transform->position,
-                .size = vec2s(0.5f),
-            });
-        entity_add_component(ecs, bomb, Renderable, {
-                .color = color_rgb_hex(0x808080),
-            });
-        entity_add_component(ecs, bomb, Projectile, {
-                .friendly = false,
-                .env_collide = false,
-                .penetration = 1,
-                .lifespan = 3.0f,
-                .damage = 20,
-            });
-        entity_add_component(ecs, bomb, PhysicsBody, {
-                .gravity_multiplier = bomb_gravity_mult,
-                .velocity = {
-                    .y = bomb_v0,
-                },
-                .tile_collision_cbs = {
-                    projectile_tile_collision
-                },
-                .entity_collision_cbs = {
-                    projectile_entity_collision
-                },
-            });
+        entity_add_components(ecs, bomb,
+                component_data(Transform, {
+                    .position = transform->position,
+                    .size = vec2s(0.5f),
+                }),
+                component_data(Renderable, {
+                    .color = color_rgb_hex(0x808080),
+                }),
+                component_data(Projectile, {
+                    .friendly = false,
+                    .env_collide = false,
+                    .penetration = 1,
+                    .lifespan = 3.0f,
+                    .damage = 20,
+                }),
+                component_data(PhysicsBody, {
+                    .gravity_multiplier = bomb_gravity_mult,
+                    .velocity = {
+                        .y = bomb_v0,
+                    },
+                    .tile_collision_cbs = {
+                        projectile_tile_collision
+                    },
+                    .entity_collision_cbs = {
+                        projectile_entity_collision
+                    },
+                }));
     }
 
     boss->attack_timer += state->dt;
@@ -817,53 +824,22 @@ void attack_carpet_bomb(GameState *state, Entity ent, Transform *transform, Enem
     }
 }
 
-Entity spawn_shield(ECS *ecs, Vec2 pos) {
-    Entity ent = ecs_entity(ecs);
-    entity_add_component(ecs, ent, Transform, {
-            .position = pos,
-            .size = vec2s(1.0f),
-        });
-    entity_add_component(ecs, ent, Renderable, {
-            .color = color_rgb_hex(0x9ed0ff),
-        });
-    entity_add_component(ecs, ent, Enemy, {0});
-    entity_add_component(ecs, ent, Health, {
-            .max = 25.0f,
-            .curr = 25.0f,
-        });
-    entity_add_component(ecs, ent, PhysicsBody, {
-            .collider = true,
-            .gravity_multiplier = 0.0f,
-        });
+// Slimes take off in a direction depending on their jump delay.
+typedef struct SlimeOverride SlimeOverride;
+struct SlimeOverride {
+    Vec2 position;
+    f32 jump_delays[MAX_SPAWN_OVERRIDES];
+};
 
-    return ent;
-}
-
-void spawn_slime(ECS *ecs, Vec2 pos, f32 jump_delay) {
-    Entity ent = ecs_entity(ecs);
-    Vec2 dir = vec2(cosf(jump_delay), sinf(jump_delay));
-    dir = vec2_muls(dir, 25.0f);
-    entity_add_component(ecs, ent, Transform, {
-            .position = pos,
-            .size = vec2s(1.0f),
-        });
-    entity_add_component(ecs, ent, Renderable, {
-            .color = color_rgb_hex(0xfcba03),
-        });
-    entity_add_component(ecs, ent, Enemy, {
-            .ai = ENEMY_AI_SLIME,
-            .jump_delay = jump_delay,
-            .shoot_delay = 1.0f,
-        });
-    entity_add_component(ecs, ent, Health, {
-            .max = 25.0f,
-            .curr = 25.0f,
-        });
-    entity_add_component(ecs, ent, PhysicsBody, {
-            .collider = true,
-            .velocity = dir,
-            .gravity_multiplier = 10.0f,
-        });
+static void slime_override(ECS *ecs, Entity instance, size_t index, const void *user_data) {
+    const SlimeOverride *spawn = user_data;
+    f32 jump_delay = spawn->jump_delays[index];
+    Transform *transform = entity_get_component(ecs, instance, Transform);
+    Enemy *enemy = entity_get_component(ecs, instance, Enemy);
+    PhysicsBody *body = entity_get_component(ecs, instance, PhysicsBody);
+    transform->position = spawn->position;
+    enemy->jump_delay = jump_delay;
+    body->velocity = vec2_muls(vec2(cosf(jump_delay), sinf(jump_delay)), 25.0f);
 }
 
 void attack_shield(GameState *state, Entity ent, Transform *transform, Enemy *enemy, Boss *boss) {
@@ -875,24 +851,28 @@ void attack_shield(GameState *state, Entity ent, Transform *transform, Enemy *en
         renderable->color = color_rgb_hex(0x19161f);
         enemy->invincible = true;
 
-        const u32 shield_count = 6;
-        for (u32 i = 0; i < shield_count; i++) {
+        SpawnOverride shield_spawn = {0};
+        for (u32 i = 0; i < BOSS_SHIELD_COUNT; i++) {
             const f32 radius = 10.0f;
             Vec2 shield_pos = transform->position;
-            shield_pos.x += cosf((2.0f * PI / shield_count) * i) * radius;
-            shield_pos.y += sinf((2.0f * PI / shield_count) * i) * radius;
-            Entity shield_ent = spawn_shield(ecs, shield_pos);
-            vec_push(boss->shields, shield_ent);
+            shield_pos.x += cosf((2.0f * PI / BOSS_SHIELD_COUNT) * i) * radius;
+            shield_pos.y += sinf((2.0f * PI / BOSS_SHIELD_COUNT) * i) * radius;
+            shield_spawn.positions[i] = shield_pos;
         }
+        ecs_instantiate_with(ecs, state->prefabs.shield, BOSS_SHIELD_COUNT, boss->shields, spawn_override, &shield_spawn, sizeof(shield_spawn));
 
-        const u32 slime_count = 4;
+        enum { slime_count = 4 };
+        SlimeOverride slime_spawn = {
+            .position = transform->position,
+        };
         for (u32 i = 0; i < slime_count; i++) {
-            spawn_slime(ecs, transform->position, 1.0f + 0.25f * (i + 1));
+            slime_spawn.jump_delays[i] = 1.0f + 0.25f * (i + 1);
         }
+        ecs_instantiate_with(ecs, state->prefabs.slime, slime_count, NULL, slime_override, &slime_spawn, sizeof(slime_spawn));
     }
 
     b8 has_live_shields = false;
-    for (u32 i = 0; i < vec_len(boss->shields); i++) {
+    for (u32 i = 0; i < BOSS_SHIELD_COUNT; i++) {
         if (entity_alive(ecs, boss->shields[i])) {
             has_live_shields = true;
             break;
@@ -931,9 +911,11 @@ void attack_taste_the_rainbow(GameState *state, Entity ent, Transform *transform
 
         boss->ttr_circle_count++;
 
-        const u32 proj_count = 16;
+        enum { proj_count = 16 };
+        Transform transforms[proj_count];
+        Renderable renderables[proj_count];
+        PhysicsBody bodies[proj_count];
         for (u32 i = 0; i < proj_count; i++) {
-            Entity proj = ecs_entity(ecs);
             Color color = color_hsv(360.0f / proj_count * i, 0.75f, 1.0f);
 
             f32 angle_a = 2.0f * PI / proj_count * i;
@@ -941,32 +923,37 @@ void attack_taste_the_rainbow(GameState *state, Entity ent, Transform *transform
             Vec2 dir = vec2(cosf(angle_a + angle_b), sinf(angle_a + angle_b));
             dir = vec2_muls(dir, 25.0f);
 
-            entity_add_component(ecs, proj, Transform, {
-                    .position = transform->position,
-                    .size = vec2s(0.5f),
-                });
-            entity_add_component(ecs, proj, Renderable, {
-                    .color = color,
-                });
-            entity_add_component(ecs, proj, Projectile, {
+            transforms[i] = (Transform) {
+                .position = transform->position,
+                .size = vec2s(0.5f),
+            };
+            renderables[i] = (Renderable) {
+                .color = color,
+            };
+            bodies[i] = (PhysicsBody) {
+                .gravity_multiplier = 0.0f,
+                .velocity = dir,
+                .collider = true,
+                .tile_collision_cbs = {
+                    projectile_tile_collision
+                },
+                .entity_collision_cbs = {
+                    projectile_entity_collision
+                },
+            };
+        }
+
+        ecs_spawn_batch(ecs, proj_count, NULL,
+                component_column(Transform, transforms),
+                component_column(Renderable, renderables),
+                component_column(PhysicsBody, bodies),
+                component_fill(Projectile, {
                     .friendly = false,
                     .env_collide = true,
                     .penetration = 1,
                     .lifespan = 10.0f,
                     .damage = 5,
-                });
-            entity_add_component(ecs, proj, PhysicsBody, {
-                    .gravity_multiplier = 0.0f,
-                    .velocity = dir,
-                    .collider = true,
-                    .tile_collision_cbs = {
-                        projectile_tile_collision
-                    },
-                    .entity_collision_cbs = {
-                        projectile_entity_collision
-                    },
-                });
-        }
+                }));
     }
 
     if (boss->ttr_circle_count == circle_count) {
@@ -975,15 +962,14 @@ void attack_taste_the_rainbow(GameState *state, Entity ent, Transform *transform
     }
 }
 
-void boss_ai(GameState *state, Entity ent, Transform *transform, Enemy *enemy) {
+void boss_ai(GameState *state, Entity ent, Transform *transform, Enemy *enemy, Boss *boss) {
     ECS *ecs = state->ecs;
-    Boss *boss = entity_get_component(ecs, ent, Boss);
 
     // Find the target and never change.
     if (enemy->target == (Entity) -1) {
         Vec(Entity) near = grid_query_radius(&state->grid, ecs, transform->position, 30.0f);
         for (u32 i = 0; i < vec_len(near); i++) {
-            Player *player = entity_get_component(ecs, near[i], Player);
+            const Player *player = entity_read_component(ecs, near[i], Player);
             if (player != NULL) {
                 enemy->target = near[i];
                 break;
@@ -1015,16 +1001,18 @@ void enemy_ai(ECS *ecs, QueryIter iter, void *user_ptr) {
 
     Transform *transform = ecs_query_iter_get_field(iter, 0);
     Enemy *enemy = ecs_query_iter_get_field(iter, 1);
+    PhysicsBody *body = ecs_query_iter_get_field(iter, 2);
+    Boss *boss = ecs_query_iter_get_field(iter, 3);
     for (u32 i = 0; i < iter.count; i++) {
-        Entity ent = ecs_query_iter_get_entity(iter, i);
+        Entity ent = iter.entities[i];
         switch (enemy[i].ai) {
             case ENEMY_AI_NONE:
                 break;
             case ENEMY_AI_SLIME:
-                slime_ai(state, ent, &transform[i], &enemy[i]);
+                slime_ai(state, &transform[i], &enemy[i], &body[i]);
                 break;
             case ENEMY_AI_BOSS:
-                boss_ai(state, ent, &transform[i], &enemy[i]);
+                boss_ai(state, ent, &transform[i], &enemy[i], &boss[i]);
                 break;
         }
     }
@@ -1037,7 +1025,7 @@ void health_system(ECS *ecs, QueryIter iter, void *user_ptr) {
     for (u32 i = 0; i < iter.count; i++) {
         h[i].curr = clamp(h[i].curr, 0, h[i].max);
         if (h[i].curr <= 0) {
-            Entity ent = ecs_query_iter_get_entity(iter, i);
+            Entity ent = iter.entities[i];
             if (h[i].on_death != NULL) {
                 h[i].on_death(ecs, ent, user_ptr);
             }
@@ -1061,7 +1049,7 @@ void hit_system(ECS *ecs, QueryIter iter, void *user_ptr) {
         t[i].position.y += ease;
         h[i].timer += state->dt;
         if (h[i].timer >= life) {
-            Entity ent = ecs_query_iter_get_entity(iter, i);
+            Entity ent = iter.entities[i];
             ecs_entity_kill(ecs, ent);
         }
     }
@@ -1097,6 +1085,87 @@ void game_state_free(GameState *state) {
     window_free(state->window);
 }
 
+// -- Snapshot hooks -----------------------------------------------------------
+// Function pointers change between runs so snapshots store their index into
+// these tables instead, 0 being NULL. Unknown callbacks are dropped.
+
+void player_death(ECS *ecs, Entity ent, void *user_ptr);
+
+static const EntityCollisionCallback entity_collision_callbacks[] = {
+    NULL,
+    projectile_entity_collision,
+};
+
+static const TileCollisionCallback tile_collision_callbacks[] = {
+    NULL,
+    projectile_tile_collision,
+};
+
+static void (*const death_callbacks[])(ECS *ecs, Entity entity, void *user_ptr) = {
+    NULL,
+    player_death,
+};
+
+static void physics_body_save(ECS *ecs, Snapshot *snapshot, const void *component) {
+    (void) ecs;
+    const PhysicsBody *body = component;
+    u8 entity_cbs[arrlen(body->entity_collision_cbs)] = {0};
+    u8 tile_cbs[arrlen(body->tile_collision_cbs)] = {0};
+    for (u32 i = 0; i < arrlen(entity_cbs); i++) {
+        for (u8 j = 0; j < arrlen(entity_collision_callbacks); j++) {
+            if (body->entity_collision_cbs[i] == entity_collision_callbacks[j]) {
+                entity_cbs[i] = j;
+            }
+        }
+    }
+    for (u32 i = 0; i < arrlen(tile_cbs); i++) {
+        for (u8 j = 0; j < arrlen(tile_collision_callbacks); j++) {
+            if (body->tile_collision_cbs[i] == tile_collision_callbacks[j]) {
+                tile_cbs[i] = j;
+            }
+        }
+    }
+    snapshot_write(snapshot, entity_cbs, sizeof(entity_cbs));
+    snapshot_write(snapshot, tile_cbs, sizeof(tile_cbs));
+}
+
+static void physics_body_load(ECS *ecs, Snapshot *snapshot, void *component) {
+    (void) ecs;
+    PhysicsBody *body = component;
+    u8 entity_cbs[arrlen(body->entity_collision_cbs)];
+    u8 tile_cbs[arrlen(body->tile_collision_cbs)];
+    snapshot_read(snapshot, entity_cbs, sizeof(entity_cbs));
+    snapshot_read(snapshot, tile_cbs, sizeof(tile_cbs));
+    for (u32 i = 0; i < arrlen(entity_cbs); i++) {
+        body->entity_collision_cbs[i] = entity_cbs[i] < arrlen(entity_collision_callbacks) ?
+            entity_collision_callbacks[entity_cbs[i]] : NULL;
+    }
+    for (u32 i = 0; i < arrlen(tile_cbs); i++) {
+        body->tile_collision_cbs[i] = tile_cbs[i] < arrlen(tile_collision_callbacks) ?
+            tile_collision_callbacks[tile_cbs[i]] : NULL;
+    }
+}
+
+static void health_save(ECS *ecs, Snapshot *snapshot, const void *component) {
+    (void) ecs;
+    const Health *health = component;
+    u8 on_death = 0;
+    for (u8 i = 0; i < arrlen(death_callbacks); i++) {
+        if (health->on_death == death_callbacks[i]) {
+            on_death = i;
+        }
+    }
+    snapshot_write(snapshot, &on_death, sizeof(on_death));
+}
+
+static void health_load(ECS *ecs, Snapshot *snapshot, void *component) {
+    (void) ecs;
+    Health *health = component;
+    u8 on_death;
+    snapshot_read(snapshot, &on_death, sizeof(on_death));
+    health->on_death = on_death < arrlen(death_callbacks) ? death_callbacks[on_death] : NULL;
+}
+
 void setup_ecs(GameState *state) {
     state->group = ecs_system_group(state->ecs);
 
@@ -1107,8 +1176,12 @@ void setup_ecs(GameState *state) {
     ecs_register_component(state->ecs, Projectile);
     ecs_register_component(state->ecs, Enemy);
     ecs_register_component(state->ecs, Health);
-    ecs_register_component(state->ecs, Hit);
+    ecs_register_component_storage(state->ecs, Hit, COMPONENT_STORAGE_SPARSE);
     ecs_register_component(state->ecs, Boss);
+    ecs_register_snapshot_hooks(state->ecs, PhysicsBody, physics_body_save, physics_body_load);
+    ecs_register_snapshot_hooks(state->ecs, Health, health_save, health_load);
+    // Five seconds worth of frames for rewinding.
+    ecs_set_rollback_frames(state->ecs, 300);
 
     ecs_register_system(state->ecs, player_input_system, state->group, (QueryDesc) {
             .user_ptr = state,
@@ -1127,28 +1200,37 @@ void setup_ecs(GameState *state) {
             },
         });
 
-    ecs_register_system(state->ecs, projectile_system, state->group, (QueryDesc) {
+    ecs_register_system(state->ecs, camera_follow_system, state->group, (QueryDesc) {
             .user_ptr = state,
             .fields = {
-                [0] = ecs_id(state->ecs, Projectile),
+                [0] = ecs_id(state->ecs, Transform),
+                [1] = ecs_id(state->ecs, Player),
                 QUERY_FIELDS_END,
             },
+            .access = {
+                [0] = QUERY_ACCESS_READ,
+                [1] = QUERY_ACCESS_READ,
+            },
         });
 
-    ecs_register_system(state->ecs, camera_follow_system, state->group, (QueryDesc) {
+    // The AI reads and writes components of the player and the boss'
+    // shields.
+    ecs_register_system(state->ecs, enemy_ai, state->group, (QueryDesc) {
             .user_ptr = state,
             .fields = {
                 [0] = ecs_id(state->ecs, Transform),
-                [1] = ecs_id(state->ecs, Player),
+                [1] = ecs_id(state->ecs, Enemy),
+                [2] = Optional(ecs_id(state->ecs, PhysicsBody)),
+                [3] = Optional(ecs_id(state->ecs, Boss)),
                 QUERY_FIELDS_END,
             },
+            .exclusive = true,
         });
 
-    ecs_register_system(state->ecs, enemy_ai, state->group, (QueryDesc) {
+    ecs_register_system(state->ecs, projectile_system, state->group, (QueryDesc) {
             .user_ptr = state,
             .fields = {
-                [0] = ecs_id(state->ecs, Transform),
-                [1] = ecs_id(state->ecs, Enemy),
+                [0] = ecs_id(state->ecs, Projectile),
                 QUERY_FIELDS_END,
             },
         });
@@ -1180,7 +1262,10 @@ void setup_ecs(GameState *state) {
                 [1] = ecs_id(state->ecs, PhysicsBody),
                 QUERY_FIELDS_END,
             },
+            .parallel = true,
         });
+
+    // Collision callbacks get components of the colliding entity.
     ecs_register_system(state->ecs, tile_collision_system, state->group, (QueryDesc) {
             .user_ptr = state,
             .fields = {
@@ -1188,6 +1273,39 @@ void setup_ecs(GameState *state) {
                 [1] = ecs_id(state->ecs, PhysicsBody),
                 QUERY_FIELDS_END,
             },
+            .exclusive = true,
+        });
+
+    state->grid_query = ecs_query_cache_new(state->ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(state->ecs, Transform),
+                QUERY_FIELDS_END,
+            },
+            .access = {[0] = QUERY_ACCESS_READ},
+        });
+    state->render_query = ecs_query_cache_new(state->ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(state->ecs, Transform),
+                ecs_id(state->ecs, Renderable),
+                QUERY_FIELDS_END,
+            },
+            .access = {[0] = QUERY_ACCESS_READ, [1] = QUERY_ACCESS_READ},
+        });
+    state->health_bar_query = ecs_query_cache_new(state->ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(state->ecs, Transform),
+                ecs_id(state->ecs, Health),
+                QUERY_FIELDS_END,
+            },
+            .access = {[0] = QUERY_ACCESS_READ, [1] = QUERY_ACCESS_READ},
+        });
+    state->hit_text_query = ecs_query_cache_new(state->ecs, (QueryDesc) {
+            .fields = {
+                ecs_id(state->ecs, Transform),
+                ecs_id(state->ecs, Hit),
+                QUERY_FIELDS_END,
+            },
+            .access = {[0] = QUERY_ACCESS_READ, [1] = QUERY_ACCESS_READ},
         });
 }
 
@@ -1202,31 +1320,132 @@ void setup_world(GameState *state) {
     }
 }
 
-void setup_boss(ECS *ecs) {
-    Entity boss = ecs_entity(ecs);
-    entity_add_component(ecs, boss, Transform, {
-            .position = vec2(WORLD_WIDTH/2.0f, WORLD_HEIGHT/2.0f),
-            .size = vec2(5.0f, 5.0f),
-        });
-    entity_add_component(ecs, boss, Renderable, {
-            .color = color_rgb_hex(0x4e03fc),
-            .texture = TEXTURE_NULL,
-        });
-    entity_add_component(ecs, boss, PhysicsBody, {
-            .gravity_multiplier = 0.0f,
-            .is_static = false,
-            .collider = true,
-        });
-    entity_add_component(ecs, boss, Health, {
-            .max = 500,
-            .curr = 500,
-        });
-    entity_add_component(ecs, boss, Enemy, {
-            .ai = ENEMY_AI_BOSS,
-            .target = -1,
-            .shoot_delay = 0.1f,
-        });
-    entity_add_component(ecs, boss, Boss, {});
+// Prefabs are built once per world, every entity spawned from them starts
+// out as a copy.
+void setup_prefabs(GameState *state) {
+    ECS *ecs = state->ecs;
+    Prefabs *prefabs = &state->prefabs;
+
+    prefabs->slime = ecs_prefab(ecs);
+    entity_add_components(ecs, prefabs->slime,
+            component_data(Transform, {
+                .size = vec2s(1.0f),
+            }),
+            component_data(Renderable, {
+                .color = color_rgb_hex(0xfcba03),
+            }),
+            component_data(Enemy, {
+                .ai = ENEMY_AI_SLIME,
+                .shoot_delay = 1.0f,
+            }),
+            component_data(Health, {
+                .max = 25.0f,
+                .curr = 25.0f,
+            }),
+            component_data(PhysicsBody, {
+                .collider = true,
+                .gravity_multiplier = 10.0f,
+            }));
+
+    prefabs->shield = ecs_prefab(ecs);
+    entity_add_components(ecs, prefabs->shield,
+            component_data(Transform, {
+                .size = vec2s(1.0f),
+            }),
+            component_data(Renderable, {
+                .color = color_rgb_hex(0x9ed0ff),
+            }),
+            component_data(Enemy, {0}),
+            component_data(Health, {
+                .max = 25.0f,
+                .curr = 25.0f,
+            }),
+            component_data(PhysicsBody, {
+                .collider = true,
+                .gravity_multiplier = 0.0f,
+            }));
+
+    prefabs->player_bullet = ecs_prefab(ecs);
+    entity_add_components(ecs, prefabs->player_bullet,
+            component_data(Transform, {
+                .size = vec2s(0.5f),
+            }),
+            component_data(Renderable, {
+                .color = COLOR_WHITE,
+            }),
+            component_data(Projectile, {
+                .friendly = true,
+                .env_collide = true,
+                .penetration = 1,
+                .lifespan = 3.0f,
+                .damage = 5,
+            }),
+            component_data(PhysicsBody, {
+                .gravity_multiplier = 0.0f,
+                .collider = true,
+                .tile_collision_cbs = {
+                    projectile_tile_collision
+                },
+                .entity_collision_cbs = {
+                    projectile_entity_collision
+                },
+            }));
+
+    prefabs->slime_bullet = ecs_prefab(ecs);
+    entity_add_components(ecs, prefabs->slime_bullet,
+            component_data(Transform, {
+                .size = vec2s(0.5f),
+            }),
+            component_data(Renderable, {
+                .color = color_rgb_hex(0xfcba03),
+            }),
+            component_data(Projectile, {
+                .friendly = false,
+                .env_collide = true,
+                .penetration = 1,
+                .lifespan = 3.0f,
+                .damage = 2,
+            }),
+            component_data(PhysicsBody, {
+                .collider = true,
+                .gravity_multiplier = 0.0f,
+                .tile_collision_cbs = {
+                    projectile_tile_collision
+                },
+                .entity_collision_cbs = {
+                    projectile_entity_collision
+                },
+            }));
+
+    prefabs->boss = ecs_prefab(ecs);
+    entity_add_components(ecs, prefabs->boss,
+            component_data(Transform, {
+                .position = vec2(WORLD_WIDTH/2.0f, WORLD_HEIGHT/2.0f),
+                .size = vec2(5.0f, 5.0f),
+            }),
+            component_data(Renderable, {
+                .color = color_rgb_hex(0x4e03fc),
+                .texture = TEXTURE_NULL,
+            }),
+            component_data(PhysicsBody, {
+                .gravity_multiplier = 0.0f,
+                .is_static = false,
+                .collider = true,
+            }),
+            component_data(Health, {
+                .max = 500,
+                .curr = 500,
+            }),
+            component_data(Enemy, {
+                .ai = ENEMY_AI_BOSS,
+                .target = -1,
+                .shoot_delay = 0.1f,
+            }),
+            component_data(Boss, {}));
+}
+
+void setup_boss(GameState *state) {
+    ecs_instantiate(state->ecs, state->prefabs.boss, 1, NULL);
 }
 
 b8 button(Renderer *renderer, Window *window, AABB box, Str str, Font *font, u32 font_size) {
@@ -1305,6 +1524,34 @@ void player_death(ECS *ecs, Entity ent, void *user_ptr) {
     game_quit(state);
 }
 
+#define QUICK_SAVE_PATH "quicksave.ecs"
+
+// Reads the quick save into a new world, keeping the current one if that
+// fails. Prefabs are part of the snapshot and keep their IDs.
+void quick_load(GameState *state) {
+    ECS *ecs = state->ecs;
+    SystemGroup group = state->group;
+    QueryCache *grid_query = state->grid_query;
+    QueryCache *render_query = state->render_query;
+    QueryCache *health_bar_query = state->health_bar_query;
+    QueryCache *hit_text_query = state->hit_text_query;
+
+    state->ecs = ecs_new();
+    setup_ecs(state);
+    if (ecs_snapshot_read(state->ecs, QUICK_SAVE_PATH)) {
+        ecs_free(ecs);
+        return;
+    }
+
+    ecs_free(state->ecs);
+    state->ecs = ecs;
+    state->group = group;
+    state->grid_query = grid_query;
+    state->render_query = render_query;
+    state->health_bar_query = health_bar_query;
+    state->hit_text_query = hit_text_query;
+}
+
 void setup_game(GameState *game_state) {
     if (game_state->ecs != NULL) {
         ecs_free(game_state->ecs);
@@ -1314,53 +1561,57 @@ void setup_game(GameState *game_state) {
 
     ECS *ecs = game_state->ecs;
     Entity player = ecs_entity(ecs);
-    entity_add_component(ecs, player, Transform, {
-            .position = vec2(WORLD_WIDTH/2.0f, WORLD_HEIGHT/8.0f),
-            .size = vec2(1.0f, 1.0f),
-        });
-    entity_add_component(ecs, player, Player, {
-            .acceleration = 5.0f,
-            .deceleration = 40.0f,
-            .max_horizontal_speed = 30.0f,
-
-            .max_fall_speed = -90.0f,
-            .max_flight_time = 10.0f,
-            .max_vertical_speed = 30.0f,
-            .flight_acc = 5.0f,
-
-            .shoot_delay = 1.0f / 5.0f,
-        });
-    entity_add_component(ecs, player, Renderable, {
-            .color = color_hsv(0.0f, 0.75f, 1.0f),
-            .texture = TEXTURE_NULL,
-        });
-    entity_add_component(ecs, player, PhysicsBody, {
-            .gravity_multiplier = 10.0f,
-            .is_static = false,
-            .collider = true,
-        });
-    entity_add_component(ecs, player, Health, {
-            .max = 100,
-            .curr = 100,
-            .on_death = player_death,
-        });
+    entity_add_components(ecs, player,
+            component_data(Transform, {
+                .position = vec2(WORLD_WIDTH/2.0f, WORLD_HEIGHT/8.0f),
+                .size = vec2(1.0f, 1.0f),
+            }),
+            component_data(Player, {
+                .acceleration = 5.0f,
+                .deceleration = 40.0f,
+                .max_horizontal_speed = 30.0f,
+    
+                .max_fall_speed = -90.0f,
+                .max_flight_time = 10.0f,
+                .max_vertical_speed = 30.0f,
+                .flight_acc = 5.0f,
+    
+                .shoot_delay = 1.0f / 5.0f,
+            }),
+            component_data(Renderable, {
+                .color = color_hsv(0.0f, 0.75f, 1.0f),
+                .texture = TEXTURE_NULL,
+            }),
+            component_data(PhysicsBody, {
+                .gravity_multiplier = 10.0f,
+                .is_static = false,
+                .collider = true,
+            }),
+            component_data(Health, {
+                .max = 100,
+                .curr = 100,
+                .on_death = player_death,
+            }));
+
+    setup_prefabs(game_state);
 }
 
 void game(GameState *game_state, Font *font) {
-    if (!game_state->paused) {
+    // Holding R rewinds the world a frame at a time instead of simulating it.
+    b8 rewind = !game_state->paused && key_down(game_state->window, KEY_R);
+    if (rewind) {
+        ecs_rollback(game_state->ecs, 1);
+    }
+
+    if (!game_state->paused && !rewind) {
         game_state->debug_draw_i = 0;
         {
             grid_clear(&game_state->grid);
-            Query query = ecs_query(game_state->ecs, (QueryDesc) {
-                    .fields = {
-                    ecs_id(game_state->ecs, Transform),
-                    QUERY_FIELDS_END,
-                    },
-                });
+            Query query = ecs_query_cached(game_state->ecs, game_state->grid_query);
             for (u32 i = 0; i < query.count; i++) {
                 QueryIter iter = ecs_query_get_iter(query, i);
                 for (u32 j = 0; j < iter.count; j++) {
-                    Entity ent = ecs_query_iter_get_entity(iter, j);
+                    Entity ent = iter.entities[j];
                     grid_insert(&game_state->grid, game_state->ecs, ent);
                 }
             }
@@ -1369,6 +1620,14 @@ void game(GameState *game_state, Font *font) {
 
         ecs_run_group(game_state->ecs, game_state->group);
         entity_to_entity_collision(game_state);
+
+        // Bullet patterns leave plenty of short lived archetypes behind.
+        ecs_compact_with(game_state->ecs, (CompactDesc) {
+                .empty_frames = 600,
+                .pooled_chunks = 64,
+                .budget_ns = 50000,
+            });
+        ecs_rollback_save(game_state->ecs);
     }
 
     renderer_begin(game_state->renderer, game_state->cam);
@@ -1392,17 +1651,11 @@ void game(GameState *game_state, Font *font) {
         }
     }
 
-    Query query = ecs_query(game_state->ecs, (QueryDesc) {
-            .fields = {
-                ecs_id(game_state->ecs, Transform),
-                ecs_id(game_state->ecs, Renderable),
-                QUERY_FIELDS_END,
-            },
-        });
+    Query query = ecs_query_cached(game_state->ecs, game_state->render_query);
     for (u32 i = 0; i < query.count; i++) {
         QueryIter iter = ecs_query_get_iter(query, i);
-        Transform *t = ecs_query_iter_get_field(iter, 0);
-        Renderable *r = ecs_query_iter_get_field(iter, 1);
+        const Transform *t = ecs_query_iter_get_field(iter, 0);
+        const Renderable *r = ecs_query_iter_get_field(iter, 1);
         for (u32 j = 0; j < iter.count; j++) {
             renderer_draw_aabb(game_state->renderer, (AABB) {
                     .position = t[j].position,
@@ -1438,21 +1691,33 @@ void game(GameState *game_state, Font *font) {
         Vec2 pos = vec2s(10.0f);
         Vec2 size = renderer_draw_string(game_state->renderer, str_lit("Intense gaming"), font, 32.0f, pos, COLOR_WHITE);
         pos.y += size.y;
-        renderer_draw_string(game_state->renderer, str_lit("Press P to spawn boss."), font, 32.0f, pos, COLOR_WHITE);
+        size = renderer_draw_string(game_state->renderer, str_lit("Press P to spawn boss."), font, 32.0f, pos, COLOR_WHITE);
+        pos.y += size.y;
+
+        if (game_state->show_ecs_stats) {
+            ECSStats stats = ecs_stats(game_state->ecs);
+            char lines[4][128];
+            snprintf(lines[0], arrlen(lines[0]), "Entities: %zu (%zu free)",
+                    stats.entity_count, stats.free_entity_count);
+            snprintf(lines[1], arrlen(lines[1]), "Archetypes: %zu (table %.0f%% full), edges: %zu",
+                    stats.archetype_count, stats.archetype_table_load*100.0f, stats.edge_count);
+            snprintf(lines[2], arrlen(lines[2]), "Chunks: %zu (%zu KiB), pooled: %zu",
+                    stats.chunk_count, stats.chunk_bytes / 1024, stats.pooled_chunk_count);
+            snprintf(lines[3], arrlen(lines[3]), "Commands: %zu peak, %zu KiB",
+                    stats.command_high_water, stats.command_bytes_high_water / 1024);
+            for (u32 i = 0; i < arrlen(lines); i++) {
+                size = renderer_draw_string(game_state->renderer, str_cstr(lines[i]), font, 16.0f, pos, COLOR_WHITE);
+                pos.y += size.y;
+            }
+        }
     }
 
     // Health
-    query = ecs_query(game_state->ecs, (QueryDesc) {
-            .fields = {
-                ecs_id(game_state->ecs, Transform),
-                ecs_id(game_state->ecs, Health),
-                QUERY_FIELDS_END,
-            },
-        });
+    query = ecs_query_cached(game_state->ecs, game_state->health_bar_query);
     for (u32 i = 0; i < query.count; i++) {
         QueryIter iter = ecs_query_get_iter(query, i);
-        Transform *t = ecs_query_iter_get_field(iter, 0);
-        Health *h = ecs_query_iter_get_field(iter, 1);
+        const Transform *t = ecs_query_iter_get_field(iter, 0);
+        const Health *h = ecs_query_iter_get_field(iter, 1);
         for (u32 j = 0; j < iter.count; j++) {
             Vec2 half_size = aabb_half_size(*t);
             Vec2 over_entity = t[j].position;
@@ -1503,17 +1768,11 @@ void game(GameState *game_state, Font *font) {
     ecs_query_free(game_state->ecs, query);
 
     // :hit_text
-    query = ecs_query(game_state->ecs, (QueryDesc) {
-            .fields = {
-                ecs_id(game_state->ecs, Transform),
-                ecs_id(game_state->ecs, Hit),
-                QUERY_FIELDS_END,
-            },
-        });
+    query = ecs_query_cached(game_state->ecs, game_state->hit_text_query);
     for (u32 i = 0; i < query.count; i++) {
         QueryIter iter = ecs_query_get_iter(query, i);
-        Transform *t = ecs_query_iter_get_field(iter, 0);
-        Hit *h = ecs_query_iter_get_field(iter, 1);
+        const Transform *t = ecs_query_iter_get_field(iter, 0);
+        const Hit *h = ecs_query_iter_get_field(iter, 1);
         for (u32 j = 0; j < iter.count; j++) {
             Vec2 screen_pos = world_to_screen_space(game_state->cam, t[j].position);
 
@@ -1581,7 +1840,18 @@ void game(GameState *game_state, Font *font) {
     }
 
     if (key_press(game_state->window, KEY_P)) {
-        setup_boss(game_state->ecs);
+        setup_boss(game_state);
+    }
+
+    if (key_press(game_state->window, KEY_F3)) {
+        game_state->show_ecs_stats = !game_state->show_ecs_stats;
+    }
+
+    if (key_press(game_state->window, KEY_F5)) {
+        ecs_snapshot_write(game_state->ecs, QUICK_SAVE_PATH);
+    }
+    if (key_press(game_state->window, KEY_F9)) {
+        quick_load(game_state);
     }
 }
 